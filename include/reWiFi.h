@@ -14,6 +14,10 @@
 #ifndef __RE_WIFI_H__
 #define __RE_WIFI_H__ 
 
+#include "reWiFiStates.h"
+#include "reWiFiTelemetry.h"
+#include "reWiFiSelfTest.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,17 +41,444 @@ extern "C" {
 #include "freertos/event_groups.h"
 
 
+#if CONFIG_WIFI_REASON_POLICY || CONFIG_WIFI_RECOVERY_LADDER
+
+typedef enum {
+  WIFI_ACTION_RETRY = 0,          // Reconnect to the same network after delay_min
+  WIFI_ACTION_BACKOFF,            // Reconnect to the same network, delay doubles from delay_min to delay_max
+  WIFI_ACTION_SWITCH,             // Switch to another network (in single network mode - as BACKOFF)
+  WIFI_ACTION_RESTORE             // Restore WiFi stack to default settings ("cold" reconnect)
+} wifi_reconnect_action_t;
+
+#endif // CONFIG_WIFI_REASON_POLICY || CONFIG_WIFI_RECOVERY_LADDER
+
+#if CONFIG_WIFI_REASON_POLICY || CONFIG_WIFI_STATS
+
+// Groups of disconnection reasons (WIFI_REASON_*) that require different handling
+typedef enum {
+  WIFI_REASON_CAT_TRANSIENT = 0,  // All other reasons, including lost IP and timeouts
+  WIFI_REASON_CAT_BEACON,         // Beacon loss
+  WIFI_REASON_CAT_AUTH,           // Authentication failed or 4-way handshake timeout (most likely wrong password)
+  WIFI_REASON_CAT_AP_FULL,        // AP has too many associated stations
+  WIFI_REASON_CAT_NO_AP,          // AP not found
+  WIFI_REASON_CAT_MAX
+} wifi_reason_category_t;
+
+wifi_reason_category_t wifiReasonCategory(uint8_t reason);
+
+#endif // CONFIG_WIFI_REASON_POLICY || CONFIG_WIFI_STATS
+
+#if CONFIG_WIFI_REASON_POLICY
+
+typedef struct {
+  wifi_reconnect_action_t action;
+  uint32_t delay_min;             // ms
+  uint32_t delay_max;             // ms
+  uint8_t  attempts;              // Budget of attempts, after which the action is escalated (0 - unlimited)
+} wifi_reason_policy_t;
+
+bool wifiReasonPolicySet(wifi_reason_category_t category, const wifi_reason_policy_t* policy);
+wifi_reason_policy_t wifiReasonPolicyGet(wifi_reason_category_t category);
+
+#endif // CONFIG_WIFI_REASON_POLICY
+
+#if CONFIG_WIFI_RECOVERY_LADDER
+
+// Recovery tiers, from cheapest to most expensive
+typedef enum {
+  WIFI_TIER_REASSOC = 0,          // Reconnect to the same network
+  WIFI_TIER_RESCAN,               // Full scan and switch to another network
+  WIFI_TIER_STA_RESTART,          // Stop and start STA
+  WIFI_TIER_DRIVER,               // Deinit and init WiFi driver
+  WIFI_TIER_NETIF,                // Recreate network interface
+  WIFI_TIER_RESTORE,              // Restore WiFi stack persistent settings to default values
+  WIFI_TIER_REBOOT,               // Device restart
+  WIFI_TIER_MAX
+} wifi_recovery_tier_t;
+
+typedef struct {
+  uint32_t reached;               // Number of incidents that reached this tier
+  uint32_t recovered;             // Number of incidents recovered at this tier
+  uint32_t time_total;            // Total recovery time of recovered incidents, ms
+  uint32_t time_max;              // Maximum recovery time, ms
+} wifi_recovery_stats_t;
+
+bool wifiRecoveryBudgetSet(wifi_recovery_tier_t tier, uint8_t attempts, uint32_t time_ms);
+wifi_recovery_stats_t wifiRecoveryStatsGet(wifi_recovery_tier_t tier);
+char* wifiRecoveryGetJson();
+
+#endif // CONFIG_WIFI_RECOVERY_LADDER
+
+#if CONFIG_WIFI_PROFILES
+
+typedef enum {
+  WIFI_PROFILE_LOW_POWER = 0,     // Maximum modem sleep, HT20, reduced TX power
+  WIFI_PROFILE_BALANCED,          // Minimum modem sleep (ESP-IDF default)
+  WIFI_PROFILE_THROUGHPUT,        // No power save, HT40, maximum TX power (OTA, bulk uploads)
+  WIFI_PROFILE_MAX
+} wifi_profile_t;
+
+typedef struct {
+  wifi_ps_type_t ps;              // Power save mode
+  uint16_t listen_interval;       // Beacon intervals between wakeups in WIFI_PS_MAX_MODEM, applied at the next association
+  wifi_bandwidth_t bandwidth;     // WIFI_BW_HT20 / WIFI_BW_HT40
+  uint8_t  protocol;              // WIFI_PROTOCOL_* bitmap
+  int8_t   max_tx_power;          // 0.25 dBm units, 8..84
+  uint16_t inactive_time;         // Beacon timeout, s (ESP-IDF 5.0+)
+} wifi_profile_config_t;
+
+bool wifiProfileSet(wifi_profile_t profile);
+wifi_profile_t wifiProfileGet();
+bool wifiProfileConfigSet(wifi_profile_t profile, const wifi_profile_config_t* config);
+wifi_profile_config_t wifiProfileConfigGet(wifi_profile_t profile);
+uint32_t wifiProfileTimeGet(wifi_profile_t profile); // Time spent in the profile since boot, s
+
+#endif // CONFIG_WIFI_PROFILES
+
+#if CONFIG_WIFI_BANDWIDTH_AUTO
+
+typedef struct {
+  uint8_t  bandwidth;             // Selected wifi_bandwidth_t
+  uint8_t  busy;                  // Channel busy time during the last sampling, %
+  uint8_t  retry;                 // Share of retransmitted frames, %
+  uint8_t  neighbors;             // Access points overlapping the 40 MHz channel pair (background scan table)
+  uint16_t rate;                  // Average PHY rate of data frames from the AP, 100 kbit/s
+  uint16_t changes;               // Number of bandwidth changes since boot
+  uint32_t measured;              // Time of the last measurement, seconds since boot
+} wifi_bandwidth_stats_t;
+
+bool wifiBandwidthMeasure();      // Measure and re-evaluate now (only when connected)
+wifi_bandwidth_stats_t wifiBandwidthStatsGet(uint8_t index); // Network 1..5, 0 - current
+
+#endif // CONFIG_WIFI_BANDWIDTH_AUTO
+
+#if CONFIG_WIFI_LONGRANGE_AUTO
+
+typedef struct {
+  bool     active;                // Long Range protocol is selected
+  int8_t   rssi;                  // Smoothed RSSI of the current connection, dBm
+  uint8_t  success;               // Smoothed share of successful connection attempts, %
+  uint16_t switches;              // Number of protocol switches since boot
+  uint32_t time_bgn;              // Time in 11b/g/n since boot, s
+  uint32_t time_lr;               // Time in Long Range since boot, s
+} wifi_longrange_stats_t;
+
+wifi_longrange_stats_t wifiLongRangeStatsGet();
+
+#endif // CONFIG_WIFI_LONGRANGE_AUTO
+
+#if CONFIG_WIFI_TXPOWER_AUTO
+
+#define WIFI_TXPOWER_LEVELS 10    // 2 dB steps: 2..3.75 dBm, 4..5.75 dBm, ... 20..21 dBm
+
+typedef struct {
+  int8_t   power;                 // Current maximum TX power, 0.25 dBm
+  int8_t   margin;                // Estimated uplink margin above the RSSI threshold, dB
+  uint16_t changes;               // Number of power changes since boot
+  uint32_t time[WIFI_TXPOWER_LEVELS]; // Time at each power level since boot, s
+  uint32_t saved;                 // Estimated energy saved compared to CONFIG_WIFI_TXPOWER_MAX, uAh
+} wifi_txpower_stats_t;
+
+wifi_txpower_stats_t wifiTxPowerStatsGet();
+
+#endif // CONFIG_WIFI_TXPOWER_AUTO
+
+#if CONFIG_WIFI_RTT_PROBE
+
+typedef struct {
+  uint16_t p50;                   // Percentiles of the gateway RTT in the histogram window, ms
+  uint16_t p95;
+  uint16_t p99;
+  uint16_t jitter;                // Smoothed difference between consecutive RTT (RFC 3550), ms
+  uint16_t last;                  // Last RTT, ms
+  uint8_t  loss;                  // Share of unanswered requests in the window, %
+  uint32_t samples;               // Number of replies since boot
+} wifi_rtt_stats_t;
+
+wifi_rtt_stats_t wifiRttStatsGet();
+char* wifiRttGetJson();
+bool wifiRttIsOk();               // Connected and p95 of RTT is below the threshold parameter: realtime uploads are reasonable
+
+#endif // CONFIG_WIFI_RTT_PROBE
+
+#if CONFIG_WIFI_LINK_SCORE
+
+#define WIFI_LINK_NA 0xFF         // The component is not measured (the feature is disabled or there are no samples yet)
+
+typedef struct {
+  uint8_t  score;                 // Composite score 0..100, 0 - no IP address
+  uint8_t  rssi;                  // Components 0..100: smoothed RSSI relative to the RSSI threshold
+  uint8_t  retry;                 // Retransmissions by the AP (CONFIG_WIFI_BANDWIDTH_AUTO)
+  uint8_t  rtt;                   // p95 of gateway RTT and loss (CONFIG_WIFI_RTT_PROBE)
+  uint8_t  flaps;                 // Disconnections during CONFIG_WIFI_LINK_FLAP_WINDOW
+  uint8_t  power;                 // Power save factor, %
+  int8_t   rssi_avg;              // Smoothed RSSI, dBm
+  uint8_t  flap_count;            // Number of disconnections during CONFIG_WIFI_LINK_FLAP_WINDOW
+} wifi_link_quality_t;
+
+uint8_t wifiLinkScore();          // Cached value, does not call the driver
+wifi_link_quality_t wifiLinkQualityGet();
+// Admission of a transfer of the given size: 0 - send now, otherwise the recommended delay before the next check, ms
+uint32_t wifiLinkAdmit(size_t bytes);
+
+#endif // CONFIG_WIFI_LINK_SCORE
+
+#if CONFIG_WIFI_DEFER_QUEUE
+
+typedef enum {
+  WIFI_DEFER_LOW = 0,
+  WIFI_DEFER_NORMAL,
+  WIFI_DEFER_HIGH                 // Starts the batch without waiting for other jobs (the link quality is still checked)
+} wifi_defer_priority_t;
+
+// Called in the worker task; data points to the copy of the payload, valid only during the call
+// Return false to retry the job in the next batch (it is dropped after CONFIG_WIFI_DEFER_ATTEMPTS attempts)
+typedef bool (*wifi_defer_cb_t)(const void* data, size_t size, void* arg);
+
+typedef struct {
+  uint16_t depth;                 // Jobs in the queue
+  uint16_t depth_max;
+  uint32_t bytes;                 // Payload buffer used, bytes
+  uint32_t posted;
+  uint32_t executed;
+  uint32_t failed;                // Dropped after CONFIG_WIFI_DEFER_ATTEMPTS attempts
+  uint32_t dropped;               // Rejected: no free slot or buffer space
+  uint32_t batches;
+  uint32_t wait_avg;              // Time from posting to execution, ms
+  uint32_t wait_max;
+} wifi_defer_stats_t;
+
+// The payload (may be null if size = 0) is copied into the static buffer of the queue
+bool wifiDeferPost(wifi_defer_cb_t callback, const void* data, size_t size, wifi_defer_priority_t priority, void* arg);
+void wifiDeferFlush();            // Start the batch at the next check without waiting for batching conditions
+wifi_defer_stats_t wifiDeferStatsGet();
+
+#endif // CONFIG_WIFI_DEFER_QUEUE
+
+#if CONFIG_WIFI_STATS
+
+typedef struct {
+  uint32_t attempts;              // Connection attempts since boot
+  uint32_t connects;              // IP address received
+  uint32_t disconnects[WIFI_REASON_CAT_MAX]; // Disconnection events by reason category
+  uint32_t roams;                 // Connections to an AP (BSSID) other than the previous one
+  uint32_t restarts;              // WiFi restarts (see wifiRestartWiFi())
+  uint32_t ip_time;               // Average time from the connection attempt to IP address, ms
+  uint16_t online;                // Share of time with IP address since wifiInit(), 0.01 % (CONFIG_WIFI_AVAILABILITY, otherwise 0)
+} wifi_stats_t;
+
+wifi_stats_t wifiStatsGet();
+
+#endif // CONFIG_WIFI_STATS
+
+#if CONFIG_WIFI_AVAILABILITY
+
+typedef enum {
+  WIFI_AVAIL_DISABLED = 0,        // WiFi is stopped or suspended
+  WIFI_AVAIL_CONNECTING,          // Enabled, not associated
+  WIFI_AVAIL_ASSOCIATED,          // Associated, no IP address
+  WIFI_AVAIL_CONNECTED,           // IP address received
+  WIFI_AVAIL_VERIFIED,            // Internet access confirmed, see wifiInternetSet()
+  WIFI_AVAIL_MAX
+} wifi_avail_state_t;
+
+typedef enum {
+  WIFI_AVAIL_BOOT = 0,            // Since wifiInit()
+  WIFI_AVAIL_DAY,                 // Last 24 hours (hourly resolution)
+  WIFI_AVAIL_LIFETIME             // All boots, saved to NVS every CONFIG_WIFI_AVAILABILITY_SAVE_INTERVAL
+} wifi_avail_scope_t;
+
+typedef struct {
+  uint32_t time[WIFI_AVAIL_MAX];  // Time in each state, s
+  uint16_t availability;          // Available time relative to the enabled time (all states except disabled), 0.01 %
+} wifi_availability_t;
+
+wifi_availability_t wifiAvailabilityGet(wifi_avail_scope_t scope);
+char* wifiAvailabilityGetJson();
+
+#endif // CONFIG_WIFI_AVAILABILITY
+
+#if CONFIG_WIFI_TUNABLES
+// Number of automatic rollbacks of connection parameters since boot
+uint16_t wifiTunablesRollbacks();
+#endif // CONFIG_WIFI_TUNABLES
+
+typedef struct {
+  uint32_t count;                 // Number of starts
+  uint32_t start_last;            // Time from request to STA started, ms
+  uint32_t start_total;
+  uint32_t ip_last;               // Time from request to IP received, ms
+  uint32_t ip_total;
+  int32_t  heap_delta;            // Heap consumed by the last start (measured when IP is received), bytes
+} wifi_start_stats_t;
+
+typedef struct {
+  uint32_t cycles;                // Number of low-level initializations
+  uint32_t init_last;             // Duration of the last initialization, us
+  uint32_t init_total;            // Total duration of all initializations, us
+  uint32_t heap_free;             // Free heap after the last initialization, bytes
+  uint32_t heap_largest;          // Largest free block after the last initialization, bytes
+  uint32_t heap_largest_min;      // Minimum of the largest free block after initialization since boot, bytes
+} wifi_lowlevel_stats_t;
+
+#if CONFIG_WIFI_SCAN_ENABLE
+
+typedef struct {
+  uint32_t ssid_hash;             // FNV-1a hash of SSID, see wifiSsidHash()
+  uint8_t  bssid[6];
+  int8_t   rssi;
+  uint8_t  channel;               // Primary channel
+  uint8_t  second;                // Secondary channel (wifi_second_chan_t)
+  uint8_t  authmode;              // wifi_auth_mode_t
+  uint8_t  phy_11n:1;             // 802.11n supported
+  uint8_t  phy_lr:1;              // Espressif Long Range supported
+  uint32_t last_seen;             // Seconds since boot
+} wifi_scan_record_t;
+
+uint32_t wifiSsidHash(const char* ssid);
+bool wifiScanStart(uint32_t interval_s);
+void wifiScanStop();
+uint8_t wifiScanGetTable(wifi_scan_record_t* records, uint8_t max_count);
+bool wifiScanFind(const char* ssid, wifi_scan_record_t* record);
+char* wifiScanGetJson();
+
+#endif // CONFIG_WIFI_SCAN_ENABLE
+
+#if CONFIG_WIFI_PMK_CACHE
+
+typedef struct {
+  uint32_t count;                 // Number of successful associations
+  uint32_t last;                  // Time from esp_wifi_connect() to WIFI_EVENT_STA_CONNECTED, ms
+  uint32_t total;
+  uint8_t  authmode;              // wifi_auth_mode_t of the last connection
+} wifi_handshake_stats_t;
+
+wifi_handshake_stats_t wifiHandshakeStatsGet(bool cached);
+
+#endif // CONFIG_WIFI_PMK_CACHE
+
 bool wifiInit();
 bool wifiStart();
 bool wifiStop();
 bool wifiFree();
 bool wifiIsConnected();
 
+// Stops the radio, but keeps the driver, netif, timers and handlers allocated
+bool wifiSuspend();
+bool wifiResume();
+bool wifiIsSuspended();
+wifi_start_stats_t wifiStartStatsGet(bool warm);
+wifi_lowlevel_stats_t wifiLowLevelStatsGet();
+
+// Status bits, see wifiStatusGet()
+#define WIFI_STATUS_TCPIP_INIT          0x0001
+#define WIFI_STATUS_LOWLEVEL_INIT       0x0002
+#define WIFI_STATUS_ENABLED             WIFI_FSM_BIT_ENABLED
+#define WIFI_STATUS_STARTED             WIFI_FSM_BIT_STARTED
+#define WIFI_STATUS_CONNECTED           WIFI_FSM_BIT_CONNECTED
+#define WIFI_STATUS_GOT_IP              WIFI_FSM_BIT_GOT_IP
+#define WIFI_STATUS_DISCONNECT_STOP     WIFI_FSM_BIT_DISCONNECT_STOP
+#define WIFI_STATUS_DISCONNECT_RESTORE  WIFI_FSM_BIT_DISCONNECT_RESTORE
+#define WIFI_STATUS_SUSPENDED           WIFI_FSM_BIT_SUSPENDED
+#define WIFI_STATUS_INTERNET            0x0200
+
 EventBits_t wifiStatusGet();
 char* wifiStatusGetJson();
+
+EventBits_t wifiStatusWait(const EventBits_t bits, const BaseType_t clearOnExit, const uint32_t timeout_ms);
+
+typedef enum {
+  WIFI_COND_NONE = 0,
+  WIFI_COND_CONNECTED,            // Associated with AP
+  WIFI_COND_GOT_IP,               // IP address received
+  WIFI_COND_INTERNET              // Internet access confirmed, see wifiInternetSet()
+} wifi_wait_condition_t;
+
+typedef enum {
+  WIFI_WAIT_OK = 0,               // Condition is satisfied
+  WIFI_WAIT_TIMEOUT,              // Deadline expired
+  WIFI_WAIT_CANCELLED,            // Token was cancelled
+  WIFI_WAIT_INVALID               // WiFi is not initialized or the condition is invalid
+} wifi_wait_status_t;
+
+typedef struct {
+  wifi_wait_status_t status;
+  wifi_wait_condition_t satisfied; // Highest condition reached at the moment of return
+  wifi_fsm_state_t state;
+  uint32_t elapsed;               // ms
+  uint8_t  reason;                // Last disconnection reason (WIFI_REASON_*), useful on timeout
+} wifi_wait_result_t;
+
+typedef struct {
+  volatile bool cancelled;
+} wifi_wait_token_t;
+
+#define WIFI_WAIT_TOKEN_INIT { false }
+
+// Blocks the calling task until the condition is satisfied, the deadline expires (timeout_ms = 0 - no deadline)
+// or the token (may be null) is cancelled from another task with wifiWaitCancel()
+wifi_wait_result_t wifiWaitFor(wifi_wait_condition_t condition, uint32_t timeout_ms, wifi_wait_token_t* token);
+void wifiWaitCancel(wifi_wait_token_t* token);
+
+// Confirmation of Internet access by the application (e.g. after a successful request), it is reset when IP is lost
+void wifiInternetSet(bool available);
+bool wifiInternetAvailable();
+
+typedef enum {
+  WIFI_EDGE_SET = 1,              // Any of the bits of the mask has been set
+  WIFI_EDGE_CLEAR = 2,            // Any of the bits of the mask has been cleared
+  WIFI_EDGE_ANY = 3
+} wifi_status_edge_t;
+
+// Status change subscriptions (CONFIG_WIFI_SUBSCRIBERS_MAX, default 8, 0 - disabled)
+// The callback is called in the context of the task that changed the status (usually the default event loop), keep it short
+// The task is notified with xTaskNotify(task, notify, eSetBits)
+// Returns a handle for wifiUnsubscribe() or -1; the handle is not a slot index and is not reused by the next subscriber
+typedef void (*wifi_status_cb_t)(EventBits_t prev, EventBits_t curr, void* arg);
+int  wifiSubscribe(EventBits_t mask, wifi_status_edge_t edge, wifi_status_cb_t callback, void* arg);
+int  wifiSubscribeTask(EventBits_t mask, wifi_status_edge_t edge, TaskHandle_t task, uint32_t notify);
+bool wifiUnsubscribe(int handle);
+
+// Connection state machine, see reWiFiStates.h
+typedef void (*wifi_fsm_trace_t)(wifi_fsm_state_t prev, wifi_fsm_event_t event, wifi_fsm_action_t action, wifi_fsm_state_t next);
+wifi_fsm_state_t wifiStateGet();
+void wifiStateSetTrace(wifi_fsm_trace_t trace);
+
 #if CONFIG_WIFI_DEBUG_ENABLE
 char* wifiGetDebugInfo();
 #endif // CONFIG_WIFI_DEBUG_ENABLE
+
+#if CONFIG_WIFI_TELEMETRY
+
+// Binary snapshot (format in reWiFiTelemetry.h), at most WIFI_TELEMETRY_MAX_SIZE bytes
+// If delta = true, only the fields changed since the previous snapshot are written (every N-th snapshot is full anyway)
+wifi_telemetry_t wifiTelemetryGet();
+size_t wifiTelemetrySnapshot(uint8_t* buf, size_t size, bool delta);
+
+#endif // CONFIG_WIFI_TELEMETRY
+
+#if CONFIG_WIFI_TRACE_ENABLE
+
+// Record of the transition trace, 12 bytes
+typedef struct {
+  uint32_t time;                  // Time since boot, ms
+  uint16_t bits;                  // Status bits after the transition
+  uint8_t  event;                 // wifi_fsm_event_t
+  uint8_t  state;                 // wifi_fsm_state_t after the transition
+  uint8_t  reason;                // Last disconnection reason (WIFI_REASON_*)
+  int8_t   rssi;                  // Last known RSSI, dBm
+  uint8_t  index;                 // Network index
+  uint8_t  boot;                  // Boot number (low 8 bits), records of previous boots survive a software reset
+} wifi_trace_record_t;
+
+uint16_t wifiTraceGet(wifi_trace_record_t* records, uint16_t max_count);
+char* wifiTraceGetJson(uint16_t max_count);
+void wifiTraceClear();
+
+#endif // CONFIG_WIFI_TRACE_ENABLE
+#if CONFIG_WIFI_NETWORK_SCORING && !defined(CONFIG_WIFI_SSID)
+char* wifiScoresGetJson();
+#endif // CONFIG_WIFI_NETWORK_SCORING
 wifi_mode_t wifiMode();
 wifi_ap_record_t wifiInfo();
 int8_t wifiRSSI();
@@ -0,0 +1,87 @@
+/*
+   EN: Histogram of the gateway round-trip time of the reWiFi module: sliding window and percentiles
+       Does not depend on ESP-IDF, so it can be checked on the host
+   RU: Гистограмма времени отклика шлюза модуля reWiFi: скользящее окно и процентили
+       Не зависит от ESP-IDF, поэтому её можно проверить на хосте
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#ifndef __RE_WIFI_RTT_H__
+#define __RE_WIFI_RTT_H__
+
+#include <stdint.h>
+
+#define WIFI_RTT_BUCKETS 16
+
+// Upper bounds of the histogram buckets, ms (roughly logarithmic), the last bucket ends at the probe timeout
+static const uint16_t wifiRttBounds[WIFI_RTT_BUCKETS - 1] = { 1, 2, 3, 5, 8, 13, 20, 30, 50, 80, 130, 200, 300, 500, 800 };
+
+typedef struct {
+  uint16_t hist[WIFI_RTT_BUCKETS];
+  uint16_t count;                 // Replies in the window, always the sum of the buckets
+  uint16_t lost;                  // Timeouts in the window
+} wifi_rtt_hist_t;
+
+static inline uint16_t wifiRttBound(uint8_t bucket, uint16_t timeout)
+{
+  return bucket < WIFI_RTT_BUCKETS - 1 ? wifiRttBounds[bucket] : timeout;
+}
+
+// When the window is full, all counters are halved. The number of replies is recalculated from the buckets: each bucket
+// is rounded down separately, and a halved total would drift above their sum
+static inline void wifiRttHistDecay(wifi_rtt_hist_t* h, uint16_t window)
+{
+  if (h->count + h->lost >= window) {
+    uint16_t count = 0;
+    for (uint8_t i = 0; i < WIFI_RTT_BUCKETS; i++) {
+      h->hist[i] /= 2;
+      count += h->hist[i];
+    };
+    h->count = count;
+    h->lost /= 2;
+  };
+}
+
+static inline void wifiRttHistPut(wifi_rtt_hist_t* h, uint32_t elapsed, uint16_t window)
+{
+  uint8_t bucket = 0;
+  while ((bucket < WIFI_RTT_BUCKETS - 1) && (elapsed > wifiRttBounds[bucket])) {
+    bucket++;
+  };
+  h->hist[bucket]++;
+  h->count++;
+  wifiRttHistDecay(h, window);
+}
+
+static inline void wifiRttHistLost(wifi_rtt_hist_t* h, uint16_t window)
+{
+  h->lost++;
+  wifiRttHistDecay(h, window);
+}
+
+// Linear interpolation inside the bucket, 0 - no replies in the window
+static inline uint16_t wifiRttHistPercentile(const wifi_rtt_hist_t* h, uint8_t percent, uint16_t timeout)
+{
+  if (h->count == 0) return 0;
+  uint32_t target = ((uint32_t)h->count * percent + 99) / 100;
+  uint32_t cumulative = 0;
+  for (uint8_t i = 0; i < WIFI_RTT_BUCKETS; i++) {
+    if ((h->hist[i] > 0) && (cumulative + h->hist[i] >= target)) {
+      uint16_t lo = i > 0 ? wifiRttBound(i - 1, timeout) : 0;
+      return (uint16_t)(lo + (uint32_t)(wifiRttBound(i, timeout) - lo) * (target - cumulative) / h->hist[i]);
+    };
+    cumulative += h->hist[i];
+  };
+  return timeout;
+}
+
+// Share of timeouts in the window, %
+static inline uint8_t wifiRttHistLoss(const wifi_rtt_hist_t* h)
+{
+  uint32_t total = (uint32_t)h->count + h->lost;
+  return total > 0 ? (uint8_t)((uint32_t)h->lost * 100 / total) : 0;
+}
+
+#endif // __RE_WIFI_RTT_H__
@@ -0,0 +1,63 @@
+/*
+   EN: On-device TCP throughput self-test against a configurable endpoint
+       On ESP-IDF, lwIP netconn API with zero-copy buffers is used; on other platforms (Linux) - BSD sockets,
+       so the same code can be checked on the host against a loopback sink
+   RU: Встроенный тест пропускной способности TCP до заданного узла
+       На ESP-IDF используется netconn API lwIP без копирования буферов; на других платформах (Linux) - сокеты BSD,
+       так что тот же код можно проверить на компьютере через loopback
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#ifndef __RE_WIFI_SELFTEST_H__
+#define __RE_WIFI_SELFTEST_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define WIFI_SELFTEST_UPLOAD       0x01   // Device -> endpoint, for example: nc -lk 5201 > /dev/null
+#define WIFI_SELFTEST_DOWNLOAD     0x02   // Endpoint -> device, for example: nc -lk 5202 < /dev/zero
+#define WIFI_SELFTEST_HOST_MAX     64
+
+typedef struct {
+  const char* host;               // IPv4 address or host name
+  uint16_t port_upload;           // Port of the sink
+  uint16_t port_download;         // Port of the source (can be the same as port_upload, if the endpoint does both)
+  uint16_t duration;              // Duration of each direction, s
+  uint8_t  directions;            // WIFI_SELFTEST_UPLOAD | WIFI_SELFTEST_DOWNLOAD
+} wifi_selftest_config_t;
+
+typedef struct {
+  uint64_t bytes;                 // Payload bytes transferred
+  uint32_t duration;              // Actual duration of the transfer, ms
+  uint32_t goodput;               // Payload rate, kbit/s
+  uint32_t rtt;                   // TCP handshake time (connect), us
+  int32_t  retransmits;           // TCP segments retransmitted during the test, -1 - not available
+  int32_t  error;                 // 0 - ok, otherwise errno or lwIP err_t
+} wifi_selftest_result_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Runs the test in the calling task (blocking); results of skipped directions are zeroed
+bool wifiSelfTestRun(const wifi_selftest_config_t* config, wifi_selftest_result_t* upload, wifi_selftest_result_t* download);
+
+// Formats results as JSON, returns the length of the string or 0 if the buffer is too small
+size_t wifiSelfTestFormat(const wifi_selftest_result_t* upload, const wifi_selftest_result_t* download, char* buf, size_t size);
+
+#if defined(ESP_PLATFORM)
+// Runs the test in a separate task; returns false if the test is already running
+bool wifiSelfTestStart(const wifi_selftest_config_t* config);
+bool wifiSelfTestRunning();
+// Results of the last test: {"state":"idle|running|done","upload":{...},"download":{...}}, the string must be freed
+char* wifiSelfTestGetJson();
+#endif // ESP_PLATFORM
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RE_WIFI_SELFTEST_H__
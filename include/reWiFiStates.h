@@ -0,0 +1,205 @@
+/*
+   EN: Connection state machine of the reWiFi module: states, events and transition table
+       Does not depend on ESP-IDF, so the table can be checked on the host
+   RU: Конечный автомат подключения модуля reWiFi: состояния, события и таблица переходов
+       Не зависит от ESP-IDF, поэтому таблицу можно проверить на хосте
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#ifndef __RE_WIFI_STATES_H__
+#define __RE_WIFI_STATES_H__
+
+#include <stdint.h>
+
+// Status bits, managed by the state machine (the same values as in the WiFi status event group)
+#define WIFI_FSM_BIT_ENABLED            0x0004
+#define WIFI_FSM_BIT_STARTED            0x0008
+#define WIFI_FSM_BIT_CONNECTED          0x0010
+#define WIFI_FSM_BIT_GOT_IP             0x0020
+#define WIFI_FSM_BIT_DISCONNECT_STOP    0x0040
+#define WIFI_FSM_BIT_DISCONNECT_RESTORE 0x0080
+#define WIFI_FSM_BIT_SUSPENDED          0x0100
+#define WIFI_FSM_BITS                   0x01FC
+
+typedef enum {
+  WIFI_STATE_OFF = 0,             // Driver is not initialized
+  WIFI_STATE_IDLE,                // Driver is initialized, STA is stopped
+  WIFI_STATE_SUSPENDED,           // STA is stopped, driver and netif are kept ("warm" standby)
+  WIFI_STATE_STARTING,            // esp_wifi_start() -> WIFI_EVENT_STA_START
+  WIFI_STATE_CONNECTING,          // STA is started, connection attempts (including delays between them)
+  WIFI_STATE_CONNECTED,           // Associated with AP, waiting for IP address
+  WIFI_STATE_ONLINE,              // IP address received
+  WIFI_STATE_DISCONNECTING,       // Disconnect and stop STA mode (offline)
+  WIFI_STATE_RESTORING,           // Disconnect and restore STA mode ("cold" reconnect)
+  WIFI_STATE_STOPPING,            // esp_wifi_stop() -> WIFI_EVENT_STA_STOP, then the driver is released
+  WIFI_STATE_RESTARTING,          // esp_wifi_stop() -> WIFI_EVENT_STA_STOP, then STA is started again
+  WIFI_STATE_MAX
+} wifi_fsm_state_t;
+
+typedef enum {
+  WIFI_FSM_EV_INIT = 0,           // Driver initialized
+  WIFI_FSM_EV_DEINIT,             // Driver released
+  WIFI_FSM_EV_START,              // wifiStart() / wifiResume()
+  WIFI_FSM_EV_STOP,               // wifiStop() / wifiSuspend()
+  WIFI_FSM_EV_RESTART,            // Restart of STA mode is requested
+  WIFI_FSM_EV_STA_START,          // WIFI_EVENT_STA_START
+  WIFI_FSM_EV_CONNECTED,          // WIFI_EVENT_STA_CONNECTED
+  WIFI_FSM_EV_GOT_IP,             // IP_EVENT_STA_GOT_IP
+  WIFI_FSM_EV_DISCONNECTED,       // WIFI_EVENT_STA_DISCONNECTED / WIFI_EVENT_STA_BEACON_TIMEOUT
+  WIFI_FSM_EV_LOST_IP,            // IP_EVENT_STA_LOST_IP
+  WIFI_FSM_EV_STA_STOP,           // WIFI_EVENT_STA_STOP
+  WIFI_FSM_EV_TIMEOUT,            // Operation time-out
+  WIFI_FSM_EV_SUSPENDED,          // STA is stopped, the driver is kept
+  WIFI_FSM_EV_MAX
+} wifi_fsm_event_t;
+
+typedef enum {
+  WIFI_FSM_ACT_NONE = 0,          // Nothing to do (or the event is ignored in this state)
+  WIFI_FSM_ACT_START_STA,         // Start STA mode
+  WIFI_FSM_ACT_RESTART_STA,       // Start STA mode after it has been stopped (with reinitialization, if requested)
+  WIFI_FSM_ACT_CONNECT,           // Connect to AP
+  WIFI_FSM_ACT_RECONNECT,         // Next connection attempt according to the reconnection rules
+  WIFI_FSM_ACT_DISCONNECT,        // Disconnect from AP
+  WIFI_FSM_ACT_RESTORE,           // Restore WiFi stack persistent settings to default values
+  WIFI_FSM_ACT_STOP_STA,          // Stop STA mode
+  WIFI_FSM_ACT_RELEASE,           // Release the driver (or keep it in suspended mode)
+  WIFI_FSM_ACT_MAX
+} wifi_fsm_action_t;
+
+typedef struct {
+  uint8_t action;                 // wifi_fsm_action_t
+  uint8_t next;                   // wifi_fsm_state_t
+} wifi_fsm_transition_t;
+
+#ifdef __cplusplus
+
+#define WIFI_FSM_T(action, next) { WIFI_FSM_ACT_##action, WIFI_STATE_##next }
+
+// State x event -> action and next state
+// Columns: INIT, DEINIT, START, STOP, RESTART, STA_START, CONNECTED, GOT_IP, DISCONNECTED, LOST_IP, STA_STOP, TIMEOUT, SUSPENDED
+static constexpr wifi_fsm_transition_t wifiFsmTable[WIFI_STATE_MAX][WIFI_FSM_EV_MAX] = {
+  // OFF
+  { WIFI_FSM_T(NONE, IDLE),             WIFI_FSM_T(NONE, OFF),                WIFI_FSM_T(NONE, OFF),               WIFI_FSM_T(NONE, OFF),
+    WIFI_FSM_T(NONE, OFF),              WIFI_FSM_T(NONE, OFF),                WIFI_FSM_T(NONE, OFF),               WIFI_FSM_T(NONE, OFF),
+    WIFI_FSM_T(NONE, OFF),              WIFI_FSM_T(NONE, OFF),                WIFI_FSM_T(NONE, OFF),               WIFI_FSM_T(NONE, OFF),
+    WIFI_FSM_T(NONE, OFF) },
+  // IDLE
+  { WIFI_FSM_T(NONE, IDLE),             WIFI_FSM_T(NONE, OFF),                WIFI_FSM_T(START_STA, STARTING),     WIFI_FSM_T(RELEASE, IDLE),
+    WIFI_FSM_T(NONE, IDLE),             WIFI_FSM_T(NONE, IDLE),               WIFI_FSM_T(NONE, IDLE),              WIFI_FSM_T(NONE, IDLE),
+    WIFI_FSM_T(NONE, IDLE),             WIFI_FSM_T(NONE, IDLE),               WIFI_FSM_T(NONE, IDLE),              WIFI_FSM_T(NONE, IDLE),
+    WIFI_FSM_T(NONE, SUSPENDED) },
+  // SUSPENDED
+  { WIFI_FSM_T(NONE, SUSPENDED),        WIFI_FSM_T(NONE, OFF),                WIFI_FSM_T(START_STA, STARTING),     WIFI_FSM_T(RELEASE, IDLE),
+    WIFI_FSM_T(NONE, SUSPENDED),        WIFI_FSM_T(NONE, SUSPENDED),          WIFI_FSM_T(NONE, SUSPENDED),         WIFI_FSM_T(NONE, SUSPENDED),
+    WIFI_FSM_T(NONE, SUSPENDED),        WIFI_FSM_T(NONE, SUSPENDED),          WIFI_FSM_T(NONE, SUSPENDED),         WIFI_FSM_T(NONE, SUSPENDED),
+    WIFI_FSM_T(NONE, SUSPENDED) },
+  // STARTING
+  { WIFI_FSM_T(NONE, STARTING),         WIFI_FSM_T(NONE, STARTING),           WIFI_FSM_T(NONE, STARTING),          WIFI_FSM_T(NONE, STOPPING),
+    WIFI_FSM_T(NONE, STARTING),         WIFI_FSM_T(CONNECT, CONNECTING),      WIFI_FSM_T(NONE, CONNECTED),         WIFI_FSM_T(NONE, STARTING),
+    WIFI_FSM_T(NONE, STARTING),         WIFI_FSM_T(NONE, STARTING),           WIFI_FSM_T(RESTART_STA, STARTING),   WIFI_FSM_T(START_STA, STARTING),
+    WIFI_FSM_T(NONE, STARTING) },
+  // CONNECTING
+  { WIFI_FSM_T(NONE, CONNECTING),       WIFI_FSM_T(NONE, CONNECTING),         WIFI_FSM_T(NONE, CONNECTING),        WIFI_FSM_T(STOP_STA, STOPPING),
+    WIFI_FSM_T(STOP_STA, RESTARTING),   WIFI_FSM_T(NONE, CONNECTING),         WIFI_FSM_T(NONE, CONNECTED),         WIFI_FSM_T(NONE, ONLINE),
+    WIFI_FSM_T(RECONNECT, CONNECTING),  WIFI_FSM_T(RECONNECT, CONNECTING),    WIFI_FSM_T(RESTART_STA, STARTING),   WIFI_FSM_T(RECONNECT, CONNECTING),
+    WIFI_FSM_T(NONE, CONNECTING) },
+  // CONNECTED
+  { WIFI_FSM_T(NONE, CONNECTED),        WIFI_FSM_T(NONE, CONNECTED),          WIFI_FSM_T(NONE, CONNECTED),         WIFI_FSM_T(DISCONNECT, DISCONNECTING),
+    WIFI_FSM_T(DISCONNECT, RESTORING),  WIFI_FSM_T(NONE, CONNECTED),          WIFI_FSM_T(NONE, CONNECTED),         WIFI_FSM_T(NONE, ONLINE),
+    WIFI_FSM_T(RECONNECT, CONNECTING),  WIFI_FSM_T(RECONNECT, CONNECTING),    WIFI_FSM_T(RESTART_STA, STARTING),   WIFI_FSM_T(RECONNECT, CONNECTING),
+    WIFI_FSM_T(NONE, CONNECTED) },
+  // ONLINE
+  { WIFI_FSM_T(NONE, ONLINE),           WIFI_FSM_T(NONE, ONLINE),             WIFI_FSM_T(NONE, ONLINE),            WIFI_FSM_T(DISCONNECT, DISCONNECTING),
+    WIFI_FSM_T(DISCONNECT, RESTORING),  WIFI_FSM_T(NONE, ONLINE),             WIFI_FSM_T(NONE, ONLINE),            WIFI_FSM_T(NONE, ONLINE),
+    WIFI_FSM_T(RECONNECT, CONNECTING),  WIFI_FSM_T(RECONNECT, CONNECTING),    WIFI_FSM_T(RESTART_STA, STARTING),   WIFI_FSM_T(NONE, ONLINE),
+    WIFI_FSM_T(NONE, ONLINE) },
+  // DISCONNECTING
+  { WIFI_FSM_T(NONE, DISCONNECTING),    WIFI_FSM_T(NONE, DISCONNECTING),      WIFI_FSM_T(NONE, CONNECTING),        WIFI_FSM_T(NONE, DISCONNECTING),
+    WIFI_FSM_T(NONE, RESTORING),        WIFI_FSM_T(NONE, DISCONNECTING),      WIFI_FSM_T(NONE, DISCONNECTING),     WIFI_FSM_T(NONE, DISCONNECTING),
+    WIFI_FSM_T(STOP_STA, STOPPING),     WIFI_FSM_T(NONE, DISCONNECTING),      WIFI_FSM_T(RELEASE, IDLE),           WIFI_FSM_T(STOP_STA, STOPPING),
+    WIFI_FSM_T(NONE, DISCONNECTING) },
+  // RESTORING
+  { WIFI_FSM_T(NONE, RESTORING),        WIFI_FSM_T(NONE, RESTORING),          WIFI_FSM_T(NONE, RESTORING),         WIFI_FSM_T(NONE, DISCONNECTING),
+    WIFI_FSM_T(NONE, RESTORING),        WIFI_FSM_T(NONE, RESTORING),          WIFI_FSM_T(NONE, RESTORING),         WIFI_FSM_T(NONE, RESTORING),
+    WIFI_FSM_T(RESTORE, CONNECTING),    WIFI_FSM_T(NONE, RESTORING),          WIFI_FSM_T(RESTART_STA, STARTING),   WIFI_FSM_T(RESTORE, CONNECTING),
+    WIFI_FSM_T(NONE, RESTORING) },
+  // STOPPING
+  { WIFI_FSM_T(NONE, STOPPING),         WIFI_FSM_T(NONE, STOPPING),           WIFI_FSM_T(NONE, RESTARTING),        WIFI_FSM_T(NONE, STOPPING),
+    WIFI_FSM_T(NONE, RESTARTING),       WIFI_FSM_T(STOP_STA, STOPPING),       WIFI_FSM_T(NONE, STOPPING),          WIFI_FSM_T(NONE, STOPPING),
+    WIFI_FSM_T(NONE, STOPPING),         WIFI_FSM_T(NONE, STOPPING),           WIFI_FSM_T(RELEASE, IDLE),           WIFI_FSM_T(NONE, STOPPING),
+    WIFI_FSM_T(NONE, STOPPING) },
+  // RESTARTING
+  { WIFI_FSM_T(NONE, RESTARTING),       WIFI_FSM_T(NONE, RESTARTING),         WIFI_FSM_T(NONE, RESTARTING),        WIFI_FSM_T(NONE, STOPPING),
+    WIFI_FSM_T(NONE, RESTARTING),       WIFI_FSM_T(CONNECT, CONNECTING),      WIFI_FSM_T(NONE, RESTARTING),        WIFI_FSM_T(NONE, RESTARTING),
+    WIFI_FSM_T(NONE, RESTARTING),       WIFI_FSM_T(NONE, RESTARTING),         WIFI_FSM_T(RESTART_STA, STARTING),   WIFI_FSM_T(RESTART_STA, STARTING),
+    WIFI_FSM_T(NONE, RESTARTING) }
+};
+
+#undef WIFI_FSM_T
+
+// Status bits corresponding to each state
+static constexpr uint16_t wifiFsmBitsTable[WIFI_STATE_MAX] = {
+  /* OFF           */ 0,
+  /* IDLE          */ 0,
+  /* SUSPENDED     */ WIFI_FSM_BIT_SUSPENDED,
+  /* STARTING      */ WIFI_FSM_BIT_ENABLED,
+  /* CONNECTING    */ WIFI_FSM_BIT_ENABLED | WIFI_FSM_BIT_STARTED,
+  /* CONNECTED     */ WIFI_FSM_BIT_ENABLED | WIFI_FSM_BIT_STARTED | WIFI_FSM_BIT_CONNECTED,
+  /* ONLINE        */ WIFI_FSM_BIT_ENABLED | WIFI_FSM_BIT_STARTED | WIFI_FSM_BIT_CONNECTED | WIFI_FSM_BIT_GOT_IP,
+  /* DISCONNECTING */ WIFI_FSM_BIT_STARTED | WIFI_FSM_BIT_CONNECTED | WIFI_FSM_BIT_DISCONNECT_STOP,
+  /* RESTORING     */ WIFI_FSM_BIT_ENABLED | WIFI_FSM_BIT_STARTED | WIFI_FSM_BIT_CONNECTED | WIFI_FSM_BIT_DISCONNECT_RESTORE,
+  /* STOPPING      */ WIFI_FSM_BIT_STARTED,
+  /* RESTARTING    */ WIFI_FSM_BIT_ENABLED | WIFI_FSM_BIT_STARTED
+};
+
+static_assert(sizeof(wifiFsmTable) == WIFI_STATE_MAX * WIFI_FSM_EV_MAX * sizeof(wifi_fsm_transition_t), "WiFi FSM table size mismatch");
+static_assert(sizeof(wifiFsmBitsTable) == WIFI_STATE_MAX * sizeof(uint16_t), "WiFi FSM bits table size mismatch");
+
+static constexpr wifi_fsm_transition_t wifiFsmTransition(wifi_fsm_state_t state, wifi_fsm_event_t event)
+{
+  return ((state < WIFI_STATE_MAX) && (event < WIFI_FSM_EV_MAX))
+    ? wifiFsmTable[state][event]
+    : wifi_fsm_transition_t { WIFI_FSM_ACT_NONE, (uint8_t)state };
+}
+
+static constexpr uint16_t wifiFsmStateBits(wifi_fsm_state_t state)
+{
+  return state < WIFI_STATE_MAX ? wifiFsmBitsTable[state] : 0;
+}
+
+// Spot checks of the table, performed by the compiler
+static_assert(wifiFsmTransition(WIFI_STATE_OFF, WIFI_FSM_EV_INIT).next == WIFI_STATE_IDLE, "WiFi FSM: OFF + INIT");
+static_assert(wifiFsmTransition(WIFI_STATE_STARTING, WIFI_FSM_EV_STA_START).action == WIFI_FSM_ACT_CONNECT, "WiFi FSM: STARTING + STA_START");
+static_assert(wifiFsmTransition(WIFI_STATE_CONNECTED, WIFI_FSM_EV_GOT_IP).next == WIFI_STATE_ONLINE, "WiFi FSM: CONNECTED + GOT_IP");
+static_assert(wifiFsmTransition(WIFI_STATE_ONLINE, WIFI_FSM_EV_DISCONNECTED).action == WIFI_FSM_ACT_RECONNECT, "WiFi FSM: ONLINE + DISCONNECTED");
+static_assert(wifiFsmTransition(WIFI_STATE_DISCONNECTING, WIFI_FSM_EV_DISCONNECTED).next == WIFI_STATE_STOPPING, "WiFi FSM: DISCONNECTING + DISCONNECTED");
+static_assert(wifiFsmTransition(WIFI_STATE_STOPPING, WIFI_FSM_EV_STA_STOP).action == WIFI_FSM_ACT_RELEASE, "WiFi FSM: STOPPING + STA_STOP");
+static_assert(wifiFsmTransition(WIFI_STATE_IDLE, WIFI_FSM_EV_SUSPENDED).next == WIFI_STATE_SUSPENDED, "WiFi FSM: IDLE + SUSPENDED");
+static_assert(wifiFsmTransition(WIFI_STATE_MAX, WIFI_FSM_EV_START).action == WIFI_FSM_ACT_NONE, "WiFi FSM: out of range");
+
+static inline const char* wifiFsmStateName(wifi_fsm_state_t state)
+{
+  static const char* names[WIFI_STATE_MAX] = { "off", "idle", "suspended", "starting", "connecting", "connected", 
+    "online", "disconnecting", "restoring", "stopping", "restarting" };
+  return state < WIFI_STATE_MAX ? names[state] : "?";
+}
+
+static inline const char* wifiFsmEventName(wifi_fsm_event_t event)
+{
+  static const char* names[WIFI_FSM_EV_MAX] = { "init", "deinit", "start", "stop", "restart", "sta_start", 
+    "connected", "got_ip", "disconnected", "lost_ip", "sta_stop", "timeout", "suspended" };
+  return event < WIFI_FSM_EV_MAX ? names[event] : "?";
+}
+
+static inline const char* wifiFsmActionName(wifi_fsm_action_t action)
+{
+  static const char* names[WIFI_FSM_ACT_MAX] = { "none", "start_sta", "restart_sta", "connect", "reconnect", 
+    "disconnect", "restore", "stop_sta", "release" };
+  return action < WIFI_FSM_ACT_MAX ? names[action] : "?";
+}
+
+#endif // __cplusplus
+
+#endif // __RE_WIFI_STATES_H__
@@ -0,0 +1,85 @@
+/*
+   EN: Compact binary snapshot of WiFi health for publishing (MQTT, etc.)
+       Does not depend on ESP-IDF, the same code is used to decode the snapshot on the host
+   RU: Компактный двоичный снимок состояния WiFi для публикации (MQTT и т.д.)
+       Не зависит от ESP-IDF, тот же код используется для декодирования снимка на хосте
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#ifndef __RE_WIFI_TELEMETRY_H__
+#define __RE_WIFI_TELEMETRY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+  Format (version 1), all multi-byte values are little-endian:
+    [0]     version
+    [1]     flags: bit 0 - delta snapshot (only fields changed since the previous snapshot)
+    [2]     sequence number, incremented with each snapshot
+    [3..4]  field mask, bit N = field N is present
+    [5..]   present fields in ascending order of their numbers:
+            U8 / I8 - 1 byte, U16 - 2 bytes, VAR - unsigned LEB128 (1..5 bytes)
+  Unknown trailing fields of a newer minor revision can't be skipped, so any layout change increments the version
+*/
+
+#define WIFI_TELEMETRY_VERSION     1
+#define WIFI_TELEMETRY_FLAG_DELTA  0x01
+#define WIFI_TELEMETRY_HEADER_SIZE 5
+#define WIFI_TELEMETRY_MAX_SIZE    64
+
+typedef enum {
+  WIFI_TLM_BITS = 0,              // U16: status bits
+  WIFI_TLM_STATE,                 // U8:  wifi_fsm_state_t
+  WIFI_TLM_INDEX,                 // U8:  network index
+  WIFI_TLM_REASON,                // U8:  last disconnection reason
+  WIFI_TLM_RSSI,                  // I8:  current RSSI, dBm
+  WIFI_TLM_RSSI_AVG,              // I8:  exponential moving average of RSSI
+  WIFI_TLM_RSSI_MIN,              // I8
+  WIFI_TLM_RSSI_MAX,              // I8
+  WIFI_TLM_CONNECTS,              // VAR: number of successful connections (IP received) since boot
+  WIFI_TLM_DISCONNECTS,           // VAR: number of lost connections since boot
+  WIFI_TLM_ATTEMPTS,              // VAR: number of connection attempts since boot
+  WIFI_TLM_ONLINE,                // VAR: duration of the current connection, s
+  WIFI_TLM_T_START,               // U16: last duration of esp_wifi_start() -> STA_START, ms
+  WIFI_TLM_T_CONNECT,             // U16: last duration of esp_wifi_connect() -> STA_CONNECTED, ms
+  WIFI_TLM_T_GOT_IP,              // U16: last duration of STA_CONNECTED -> GOT_IP, ms
+  WIFI_TLM_MAX
+} wifi_telemetry_field_t;
+
+typedef struct {
+  uint16_t bits;
+  uint8_t  state;
+  uint8_t  index;
+  uint8_t  reason;
+  int8_t   rssi;
+  int8_t   rssi_avg;
+  int8_t   rssi_min;
+  int8_t   rssi_max;
+  uint32_t connects;
+  uint32_t disconnects;
+  uint32_t attempts;
+  uint32_t online;
+  uint16_t t_start;
+  uint16_t t_connect;
+  uint16_t t_got_ip;
+} wifi_telemetry_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Encodes the snapshot; if prev is not null, only changed fields are written (delta). Returns size or 0 if the buffer is too small
+size_t wifiTelemetryEncode(const wifi_telemetry_t* data, const wifi_telemetry_t* prev, uint8_t seq, uint8_t* buf, size_t size);
+
+// Decodes the snapshot into data; for a delta, data must contain the previous state. Returns false if the snapshot is invalid
+bool wifiTelemetryDecode(const uint8_t* buf, size_t size, wifi_telemetry_t* data, uint16_t* mask, uint8_t* seq, bool* delta);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RE_WIFI_TELEMETRY_H__
@@ -10,14 +10,24 @@
 
 #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
 
+#include <math.h>
 #include "sdkconfig.h"
 #include "esp_netif.h"
+#include "esp_wifi_default.h"
+#include "esp_heap_caps.h"
 #include "esp_event.h"
 #include "esp_timer.h"
+#include "esp_idf_version.h"
+#include "esp_system.h"
+#include "esp_attr.h"
 #include "lwip/inet.h"
 #include "lwip/netdb.h"
 #include "lwip/sockets.h"
 #include "lwip/ip_addr.h"
+#if CONFIG_WIFI_RTT_PROBE
+#include "ping/ping_sock.h"
+#include "reWiFiRtt.h"
+#endif // CONFIG_WIFI_RTT_PROBE
 
 static const char * logTAG                    = "WiFi";
 
@@ -37,11 +47,513 @@ static const int _WIFI_STA_CONNECTED          = BIT4;
 static const int _WIFI_STA_GOT_IP             = BIT5;
 static const int _WIFI_STA_DISCONNECT_STOP    = BIT6; // Disconnect and stop STA mode (offline)
 static const int _WIFI_STA_DISCONNECT_RESTORE = BIT7; // Disconnect and restore STA mode ("cold" reconnect)
+static const int _WIFI_STA_SUSPENDED          = BIT8; // STA is stopped, but the driver and netif are kept ("warm" standby)
+static const int _WIFI_INTERNET               = BIT9; // Internet access is confirmed by the application, see wifiInternetSet()
+static const int _WIFI_WAIT_CANCEL            = BIT10; // Reserved: pulsed to wake up wifiWaitFor() when a token is cancelled
+
+// STA bits are derived from the state of the connection state machine
+static_assert(_WIFI_STA_ENABLED == WIFI_FSM_BIT_ENABLED, "WiFi status bits mismatch");
+static_assert(_WIFI_STA_STARTED == WIFI_FSM_BIT_STARTED, "WiFi status bits mismatch");
+static_assert(_WIFI_STA_CONNECTED == WIFI_FSM_BIT_CONNECTED, "WiFi status bits mismatch");
+static_assert(_WIFI_STA_GOT_IP == WIFI_FSM_BIT_GOT_IP, "WiFi status bits mismatch");
+static_assert(_WIFI_STA_DISCONNECT_STOP == WIFI_FSM_BIT_DISCONNECT_STOP, "WiFi status bits mismatch");
+static_assert(_WIFI_STA_DISCONNECT_RESTORE == WIFI_FSM_BIT_DISCONNECT_RESTORE, "WiFi status bits mismatch");
+static_assert(_WIFI_STA_SUSPENDED == WIFI_FSM_BIT_SUSPENDED, "WiFi status bits mismatch");
+static_assert((_WIFI_TCPIP_INIT == WIFI_STATUS_TCPIP_INIT) && (_WIFI_LOWLEVEL_INIT == WIFI_STATUS_LOWLEVEL_INIT), "WiFi status bits mismatch");
+static_assert((_WIFI_INTERNET == WIFI_STATUS_INTERNET) && ((_WIFI_INTERNET & WIFI_FSM_BITS) == 0), "WiFi status bits mismatch");
+
+#ifndef CONFIG_WIFI_SUBSCRIBERS_MAX
+  // Maximum number of status change subscribers
+  #define CONFIG_WIFI_SUBSCRIBERS_MAX 8
+#endif
+
+#if defined(CONFIG_WIFI_SSID)
+  #define WIFI_NETWORKS_COUNT 1
+#elif defined(CONFIG_WIFI_5_SSID)
+  #define WIFI_NETWORKS_COUNT 5
+#elif defined(CONFIG_WIFI_4_SSID)
+  #define WIFI_NETWORKS_COUNT 4
+#elif defined(CONFIG_WIFI_3_SSID)
+  #define WIFI_NETWORKS_COUNT 3
+#elif defined(CONFIG_WIFI_2_SSID)
+  #define WIFI_NETWORKS_COUNT 2
+#else
+  #define WIFI_NETWORKS_COUNT 1
+#endif
+
+#if CONFIG_WIFI_TIMEOUT_ADAPTIVE
+  // Number of successful durations remembered for each phase of each network
+  #ifndef CONFIG_WIFI_TIMEOUT_SAMPLES
+    #define CONFIG_WIFI_TIMEOUT_SAMPLES 8
+  #endif
+  // Percentile of successful durations used as the base of the timeout
+  #ifndef CONFIG_WIFI_TIMEOUT_PERCENTILE
+    #define CONFIG_WIFI_TIMEOUT_PERCENTILE 90
+  #endif
+  // Timeout = percentile * multiplier / 100
+  #ifndef CONFIG_WIFI_TIMEOUT_MULTIPLIER
+    #define CONFIG_WIFI_TIMEOUT_MULTIPLIER 300
+  #endif
+  // Floor and ceiling of the learned timeout, ms
+  #ifndef CONFIG_WIFI_TIMEOUT_MIN
+    #define CONFIG_WIFI_TIMEOUT_MIN 5000
+  #endif
+  #ifndef CONFIG_WIFI_TIMEOUT_MAX
+    #if (2 * CONFIG_WIFI_TIMEOUT) > CONFIG_WIFI_TIMEOUT_MIN
+      #define CONFIG_WIFI_TIMEOUT_MAX (2 * CONFIG_WIFI_TIMEOUT)
+    #else
+      #define CONFIG_WIFI_TIMEOUT_MAX CONFIG_WIFI_TIMEOUT_MIN
+    #endif
+  #endif
+  #if CONFIG_WIFI_TIMEOUT_MAX < CONFIG_WIFI_TIMEOUT_MIN
+    #error "CONFIG_WIFI_TIMEOUT_MAX must not be less than CONFIG_WIFI_TIMEOUT_MIN"
+  #endif
+  static const char * wifiNvsTimeouts           = "tmo%d";
+#endif // CONFIG_WIFI_TIMEOUT_ADAPTIVE
+
+#if CONFIG_WIFI_PMK_CACHE
+  static const char * wifiNvsChannels           = "chan";
+#endif // CONFIG_WIFI_PMK_CACHE
+
+#if CONFIG_WIFI_TELEMETRY
+  // Every N-th snapshot is always full, so the receiver can recover after a lost delta
+  #ifndef CONFIG_WIFI_TELEMETRY_FULL_INTERVAL
+    #define CONFIG_WIFI_TELEMETRY_FULL_INTERVAL 10
+  #endif
+#endif // CONFIG_WIFI_TELEMETRY
+
+#if CONFIG_WIFI_TRACE_ENABLE
+  // Number of records in the transition trace ring, must be a power of two
+  #ifndef CONFIG_WIFI_TRACE_SIZE
+    #define CONFIG_WIFI_TRACE_SIZE 64
+  #endif
+  // Number of the last records added to wifiGetDebugInfo()
+  #ifndef CONFIG_WIFI_TRACE_DEBUG_MAX
+    #define CONFIG_WIFI_TRACE_DEBUG_MAX 32
+  #endif
+  static_assert((CONFIG_WIFI_TRACE_SIZE & (CONFIG_WIFI_TRACE_SIZE - 1)) == 0, "CONFIG_WIFI_TRACE_SIZE must be a power of two");
+#endif // CONFIG_WIFI_TRACE_ENABLE
+
+#if CONFIG_WIFI_NETWORK_SCORING && !defined(CONFIG_WIFI_SSID)
+  // Statistics window: when the number of attempts reaches this value, counters are halved
+  #ifndef CONFIG_WIFI_SCORE_WINDOW
+    #define CONFIG_WIFI_SCORE_WINDOW 64
+  #endif
+  // Weight of the exploration term (UCB1), in percent of the maximum score
+  #ifndef CONFIG_WIFI_SCORE_EXPLORATION
+    #define CONFIG_WIFI_SCORE_EXPLORATION 20
+  #endif
+  // Failed attempts are written to NVS at most once per this interval, minutes (a successful connection is written at once)
+  #ifndef CONFIG_WIFI_SCORE_STORE_INTERVAL
+    #define CONFIG_WIFI_SCORE_STORE_INTERVAL 10
+  #endif
+  static const char * wifiNvsScores             = "scr%d";
+#endif // CONFIG_WIFI_NETWORK_SCORING
+
+#if CONFIG_WIFI_SCAN_ENABLE
+  #ifndef CONFIG_WIFI_SCAN_INTERVAL
+    #define CONFIG_WIFI_SCAN_INTERVAL 300
+  #endif
+  #ifndef CONFIG_WIFI_SCAN_TABLE_SIZE
+    #define CONFIG_WIFI_SCAN_TABLE_SIZE 16
+  #endif
+  #ifndef CONFIG_WIFI_SCAN_PASSIVE_TIME
+    #define CONFIG_WIFI_SCAN_PASSIVE_TIME 120
+  #endif
+  #ifndef CONFIG_WIFI_SCAN_HOME_DWELL
+    #define CONFIG_WIFI_SCAN_HOME_DWELL 30
+  #endif
+  #ifndef CONFIG_WIFI_SCAN_MAX_AGE
+    #if CONFIG_WIFI_SCAN_INTERVAL > 0
+      #define CONFIG_WIFI_SCAN_MAX_AGE (3 * CONFIG_WIFI_SCAN_INTERVAL)
+    #else
+      #define CONFIG_WIFI_SCAN_MAX_AGE 900
+    #endif
+  #endif
+#endif // CONFIG_WIFI_SCAN_ENABLE
+
+#if CONFIG_WIFI_BANDWIDTH_AUTO
+  // Re-evaluation interval and delay of the first measurement after the connection, s
+  #ifndef CONFIG_WIFI_BANDWIDTH_INTERVAL
+    #define CONFIG_WIFI_BANDWIDTH_INTERVAL 900
+  #endif
+  #ifndef CONFIG_WIFI_BANDWIDTH_SETTLE
+    #define CONFIG_WIFI_BANDWIDTH_SETTLE 30
+  #endif
+  // Duration of promiscuous sampling of the home channel, ms
+  #ifndef CONFIG_WIFI_BANDWIDTH_SAMPLE
+    #define CONFIG_WIFI_BANDWIDTH_SAMPLE 250
+  #endif
+  // Channel busy time, %: HT40 is allowed below LOW, HT20 is forced above HIGH
+  #ifndef CONFIG_WIFI_BANDWIDTH_BUSY_LOW
+    #define CONFIG_WIFI_BANDWIDTH_BUSY_LOW 25
+  #endif
+  #ifndef CONFIG_WIFI_BANDWIDTH_BUSY_HIGH
+    #define CONFIG_WIFI_BANDWIDTH_BUSY_HIGH 50
+  #endif
+  // Share of retransmitted frames, %: the same hysteresis
+  #ifndef CONFIG_WIFI_BANDWIDTH_RETRY_LOW
+    #define CONFIG_WIFI_BANDWIDTH_RETRY_LOW 10
+  #endif
+  #ifndef CONFIG_WIFI_BANDWIDTH_RETRY_HIGH
+    #define CONFIG_WIFI_BANDWIDTH_RETRY_HIGH 25
+  #endif
+  // Number of audible access points overlapping the 40 MHz channel pair (from the background scan table)
+  #ifndef CONFIG_WIFI_BANDWIDTH_NEIGHBORS
+    #define CONFIG_WIFI_BANDWIDTH_NEIGHBORS 3
+  #endif
+  // 1 - reassociate immediately after the change, 0 - the change takes effect at the next connection
+  #ifndef CONFIG_WIFI_BANDWIDTH_REASSOC
+    #define CONFIG_WIFI_BANDWIDTH_REASSOC 0
+  #endif
+  static const char * wifiNvsBandwidth          = "bw";
+#endif // CONFIG_WIFI_BANDWIDTH_AUTO
+
+#if CONFIG_WIFI_LONGRANGE_AUTO
+  // Smoothed RSSI, dBm: switch to LR below LOW, back to 11b/g/n above HIGH
+  #ifndef CONFIG_WIFI_LONGRANGE_RSSI_LOW
+    #define CONFIG_WIFI_LONGRANGE_RSSI_LOW -82
+  #endif
+  #ifndef CONFIG_WIFI_LONGRANGE_RSSI_HIGH
+    #define CONFIG_WIFI_LONGRANGE_RSSI_HIGH -70
+  #endif
+  // Smoothed share of successful connection attempts, %: switch to LR below this value
+  #ifndef CONFIG_WIFI_LONGRANGE_SUCCESS_LOW
+    #define CONFIG_WIFI_LONGRANGE_SUCCESS_LOW 40
+  #endif
+  // Minimum time in the protocol before the next switch, s
+  #ifndef CONFIG_WIFI_LONGRANGE_MIN_TIME
+    #define CONFIG_WIFI_LONGRANGE_MIN_TIME 300
+  #endif
+  // RSSI sampling interval while connected, s
+  #ifndef CONFIG_WIFI_LONGRANGE_CHECK_INTERVAL
+    #define CONFIG_WIFI_LONGRANGE_CHECK_INTERVAL 15
+  #endif
+#endif // CONFIG_WIFI_LONGRANGE_AUTO
+
+#if CONFIG_WIFI_TXPOWER_AUTO
+  // Control interval while connected, s
+  #ifndef CONFIG_WIFI_TXPOWER_INTERVAL
+    #define CONFIG_WIFI_TXPOWER_INTERVAL 10
+  #endif
+  // Estimated uplink margin above the RSSI threshold, dB: power is lowered above HIGH and raised below LOW
+  #ifndef CONFIG_WIFI_TXPOWER_MARGIN_HIGH
+    #define CONFIG_WIFI_TXPOWER_MARGIN_HIGH 15
+  #endif
+  #ifndef CONFIG_WIFI_TXPOWER_MARGIN_LOW
+    #define CONFIG_WIFI_TXPOWER_MARGIN_LOW 8
+  #endif
+  // Share of frames retransmitted by the AP, % (with CONFIG_WIFI_BANDWIDTH_AUTO only): power is raised above this value
+  #ifndef CONFIG_WIFI_TXPOWER_RETRY_HIGH
+    #define CONFIG_WIFI_TXPOWER_RETRY_HIGH 15
+  #endif
+  // Power limits, 0.25 dBm units (8..84)
+  #ifndef CONFIG_WIFI_TXPOWER_MIN
+    #define CONFIG_WIFI_TXPOWER_MIN 34
+  #endif
+  #ifndef CONFIG_WIFI_TXPOWER_MAX
+    #define CONFIG_WIFI_TXPOWER_MAX 84
+  #endif
+  // Share of time the radio transmits, %: used only to estimate the saved energy
+  #ifndef CONFIG_WIFI_TXPOWER_DUTY
+    #define CONFIG_WIFI_TXPOWER_DUTY 2
+  #endif
+#endif // CONFIG_WIFI_TXPOWER_AUTO
+
+#if CONFIG_WIFI_RTT_PROBE
+  // Interval between ICMP echo requests to the gateway, s (parameter)
+  #ifndef CONFIG_WIFI_RTT_INTERVAL
+    #define CONFIG_WIFI_RTT_INTERVAL 5
+  #endif
+  #ifndef CONFIG_WIFI_RTT_INTERVAL_KEY
+    #define CONFIG_WIFI_RTT_INTERVAL_KEY "rtt_interval"
+  #endif
+  #ifndef CONFIG_WIFI_RTT_INTERVAL_FRIENDLY
+    #define CONFIG_WIFI_RTT_INTERVAL_FRIENDLY "RTT probe interval"
+  #endif
+  // p95 of RTT, ms, below which wifiRttIsOk() returns true (parameter)
+  #ifndef CONFIG_WIFI_RTT_THRESHOLD
+    #define CONFIG_WIFI_RTT_THRESHOLD 100
+  #endif
+  #ifndef CONFIG_WIFI_RTT_THRESHOLD_KEY
+    #define CONFIG_WIFI_RTT_THRESHOLD_KEY "rtt_max"
+  #endif
+  #ifndef CONFIG_WIFI_RTT_THRESHOLD_FRIENDLY
+    #define CONFIG_WIFI_RTT_THRESHOLD_FRIENDLY "RTT threshold"
+  #endif
+  #ifndef CONFIG_WIFI_RTT_TIMEOUT
+    #define CONFIG_WIFI_RTT_TIMEOUT 1000
+  #endif
+  // The timeout is the upper bound of the last histogram bucket, the previous one ends at 800 ms
+  #if CONFIG_WIFI_RTT_TIMEOUT <= 800
+    #error "CONFIG_WIFI_RTT_TIMEOUT must be greater than 800 ms"
+  #endif
+  // Histogram window: when the number of samples reaches this value, counters are halved
+  #ifndef CONFIG_WIFI_RTT_WINDOW
+    #define CONFIG_WIFI_RTT_WINDOW 240
+  #endif
+  // Percentiles and jitter are published as local data in a separate group of parameters
+  #ifndef CONFIG_WIFI_RTT_PGROUP_KEY
+    #define CONFIG_WIFI_RTT_PGROUP_KEY "rtt"
+  #endif
+  #ifndef CONFIG_WIFI_RTT_PGROUP_TOPIC
+    #define CONFIG_WIFI_RTT_PGROUP_TOPIC "rtt"
+  #endif
+  #ifndef CONFIG_WIFI_RTT_PGROUP_FRIENDLY
+    #define CONFIG_WIFI_RTT_PGROUP_FRIENDLY "Gateway RTT"
+  #endif
+  #ifndef CONFIG_WIFI_RTT_QOS
+    #define CONFIG_WIFI_RTT_QOS CONFIG_MQTT_PARAMS_QOS
+  #endif
+  // Publication interval while connected, s
+  #ifndef CONFIG_WIFI_RTT_PUBLISH_INTERVAL
+    #define CONFIG_WIFI_RTT_PUBLISH_INTERVAL 60
+  #endif
+#endif // CONFIG_WIFI_RTT_PROBE
+
+#if CONFIG_WIFI_LINK_SCORE
+  // Update interval of the composite score while connected, s
+  #ifndef CONFIG_WIFI_LINK_SCORE_INTERVAL
+    #define CONFIG_WIFI_LINK_SCORE_INTERVAL 5
+  #endif
+  // Disconnections during this time reduce the score, s
+  #ifndef CONFIG_WIFI_LINK_FLAP_WINDOW
+    #define CONFIG_WIFI_LINK_FLAP_WINDOW 600
+  #endif
+  // RSSI margin above the RSSI threshold parameter, dB, at which the signal component reaches 100 (symmetric: -SPAN gives 0)
+  #ifndef CONFIG_WIFI_LINK_RSSI_SPAN
+    #define CONFIG_WIFI_LINK_RSSI_SPAN 10
+  #endif
+  // Share of frames retransmitted by the AP, % (with CONFIG_WIFI_BANDWIDTH_AUTO only), at which the retry component reaches 0
+  #ifndef CONFIG_WIFI_LINK_RETRY_MAX
+    #define CONFIG_WIFI_LINK_RETRY_MAX 40
+  #endif
+  // Minimum score for a transfer, and for a transfer of at least CONFIG_WIFI_LINK_BULK_SIZE bytes
+  #ifndef CONFIG_WIFI_LINK_ADMIT_SCORE
+    #define CONFIG_WIFI_LINK_ADMIT_SCORE 40
+  #endif
+  #ifndef CONFIG_WIFI_LINK_BULK_SCORE
+    #define CONFIG_WIFI_LINK_BULK_SCORE 65
+  #endif
+  #ifndef CONFIG_WIFI_LINK_BULK_SIZE
+    #define CONFIG_WIFI_LINK_BULK_SIZE 16384
+  #endif
+  // Maximum delay returned by wifiLinkAdmit(), ms
+  #ifndef CONFIG_WIFI_LINK_RETRY_DELAY_MAX
+    #define CONFIG_WIFI_LINK_RETRY_DELAY_MAX 60000
+  #endif
+#endif // CONFIG_WIFI_LINK_SCORE
+
+#if CONFIG_WIFI_DEFER_QUEUE
+  // Maximum number of queued jobs
+  #ifndef CONFIG_WIFI_DEFER_JOBS
+    #define CONFIG_WIFI_DEFER_JOBS 32
+  #endif
+  // Size of the static ring buffer for job payloads, bytes (at most 65535)
+  #ifndef CONFIG_WIFI_DEFER_BUFFER
+    #define CONFIG_WIFI_DEFER_BUFFER 4096
+  #endif
+  // Jobs are executed only after the IP address has been held for this time, s
+  #ifndef CONFIG_WIFI_DEFER_STABLE
+    #define CONFIG_WIFI_DEFER_STABLE 10
+  #endif
+  // Batching: the queue is processed when it contains this number of jobs, or the oldest job waits for CONFIG_WIFI_DEFER_MAX_DELAY s
+  #ifndef CONFIG_WIFI_DEFER_BATCH
+    #define CONFIG_WIFI_DEFER_BATCH 4
+  #endif
+  #ifndef CONFIG_WIFI_DEFER_MAX_DELAY
+    #define CONFIG_WIFI_DEFER_MAX_DELAY 60
+  #endif
+  // The job is dropped after this number of failed attempts
+  #ifndef CONFIG_WIFI_DEFER_ATTEMPTS
+    #define CONFIG_WIFI_DEFER_ATTEMPTS 3
+  #endif
+  // Worker task
+  #ifndef CONFIG_WIFI_DEFER_CHECK_INTERVAL
+    #define CONFIG_WIFI_DEFER_CHECK_INTERVAL 1000
+  #endif
+  #ifndef CONFIG_WIFI_DEFER_STACK_SIZE
+    #define CONFIG_WIFI_DEFER_STACK_SIZE 3072
+  #endif
+  #ifndef CONFIG_WIFI_DEFER_PRIORITY
+    #define CONFIG_WIFI_DEFER_PRIORITY 3
+  #endif
+#endif // CONFIG_WIFI_DEFER_QUEUE
+
+#if CONFIG_WIFI_TUNABLES
+  #ifndef CONFIG_WIFI_TIMEOUT_KEY
+    #define CONFIG_WIFI_TIMEOUT_KEY "timeout"
+  #endif
+  #ifndef CONFIG_WIFI_TIMEOUT_FRIENDLY
+    #define CONFIG_WIFI_TIMEOUT_FRIENDLY "Connection timeout"
+  #endif
+  #ifndef CONFIG_WIFI_RECONNECT_DELAY_KEY
+    #define CONFIG_WIFI_RECONNECT_DELAY_KEY "rc_delay"
+  #endif
+  #ifndef CONFIG_WIFI_RECONNECT_DELAY_FRIENDLY
+    #define CONFIG_WIFI_RECONNECT_DELAY_FRIENDLY "Reconnect delay"
+  #endif
+  #ifndef CONFIG_WIFI_RECONNECT_ATTEMPTS_KEY
+    #define CONFIG_WIFI_RECONNECT_ATTEMPTS_KEY "rc_attempts"
+  #endif
+  #ifndef CONFIG_WIFI_RECONNECT_ATTEMPTS_FRIENDLY
+    #define CONFIG_WIFI_RECONNECT_ATTEMPTS_FRIENDLY "Reconnect attempts"
+  #endif
+  #ifndef CONFIG_WIFI_RESTART_ATTEMPTS_KEY
+    #define CONFIG_WIFI_RESTART_ATTEMPTS_KEY "rs_attempts"
+  #endif
+  #ifndef CONFIG_WIFI_RESTART_ATTEMPTS_FRIENDLY
+    #define CONFIG_WIFI_RESTART_ATTEMPTS_FRIENDLY "Restart attempts"
+  #endif
+  #ifndef CONFIG_WIFI_TIMER_RESTART_DEVICE_KEY
+    #define CONFIG_WIFI_TIMER_RESTART_DEVICE_KEY "rs_device"
+  #endif
+  #ifndef CONFIG_WIFI_TIMER_RESTART_DEVICE_FRIENDLY
+    #define CONFIG_WIFI_TIMER_RESTART_DEVICE_FRIENDLY "Reboot without WiFi, min"
+  #endif
+  #ifndef CONFIG_WIFI_BANDWIDTH_KEY
+    #define CONFIG_WIFI_BANDWIDTH_KEY "bandwidth"
+  #endif
+  #ifndef CONFIG_WIFI_BANDWIDTH_FRIENDLY
+    #define CONFIG_WIFI_BANDWIDTH_FRIENDLY "Bandwidth (0 - default, 1 - HT20, 2 - HT40)"
+  #endif
+  // Time after a change of parameters during which the connection is watched, s
+  #ifndef CONFIG_WIFI_TUNABLES_PROBATION
+    #define CONFIG_WIFI_TUNABLES_PROBATION 600
+  #endif
+  // Previous values are restored if the connection is lost more than this number of times during the probation,
+  // or if there is no IP address at the end of it
+  #ifndef CONFIG_WIFI_TUNABLES_FLAPS
+    #define CONFIG_WIFI_TUNABLES_FLAPS 3
+  #endif
+  // Interval of checking the connection during the probation, s
+  #ifndef CONFIG_WIFI_TUNABLES_CHECK_INTERVAL
+    #define CONFIG_WIFI_TUNABLES_CHECK_INTERVAL 10
+  #endif
+#endif // CONFIG_WIFI_TUNABLES
+
+#if CONFIG_WIFI_STATS
+  // Read-only statistics are published as a subgroup of CONFIG_WIFI_PGROUP_KEY
+  #ifndef CONFIG_WIFI_STATS_PGROUP_KEY
+    #define CONFIG_WIFI_STATS_PGROUP_KEY "stats"
+  #endif
+  #ifndef CONFIG_WIFI_STATS_PGROUP_TOPIC
+    #define CONFIG_WIFI_STATS_PGROUP_TOPIC "stats"
+  #endif
+  #ifndef CONFIG_WIFI_STATS_PGROUP_FRIENDLY
+    #define CONFIG_WIFI_STATS_PGROUP_FRIENDLY "WiFi statistics"
+  #endif
+  #ifndef CONFIG_WIFI_STATS_QOS
+    #define CONFIG_WIFI_STATS_QOS CONFIG_MQTT_PARAMS_QOS
+  #endif
+  // Publication interval, s
+  #ifndef CONFIG_WIFI_STATS_INTERVAL
+    #define CONFIG_WIFI_STATS_INTERVAL 300
+  #endif
+#endif // CONFIG_WIFI_STATS
+
+#if CONFIG_WIFI_AVAILABILITY
+  // Interval of saving lifetime values to NVS, s
+  #ifndef CONFIG_WIFI_AVAILABILITY_SAVE_INTERVAL
+    #define CONFIG_WIFI_AVAILABILITY_SAVE_INTERVAL 3600
+  #endif
+  // 1 - only time with confirmed Internet access (wifiInternetSet()) is counted as available, 0 - time with IP address
+  #ifndef CONFIG_WIFI_AVAILABILITY_VERIFIED
+    #define CONFIG_WIFI_AVAILABILITY_VERIFIED 0
+  #endif
+  static const char * wifiNvsAvailability       = "avl%d";
+#endif // CONFIG_WIFI_AVAILABILITY
+
+#if CONFIG_WIFI_LOG_DEFERRED
+  // Number of records in the ring, must be a power of two
+  #ifndef CONFIG_WIFI_LOG_RING_SIZE
+    #define CONFIG_WIFI_LOG_RING_SIZE 32
+  #endif
+  static_assert((CONFIG_WIFI_LOG_RING_SIZE & (CONFIG_WIFI_LOG_RING_SIZE - 1)) == 0, "CONFIG_WIFI_LOG_RING_SIZE must be a power of two");
+  // Rate limit: records per second (and burst)
+  #ifndef CONFIG_WIFI_LOG_RATE
+    #define CONFIG_WIFI_LOG_RATE 5
+  #endif
+  // Identical messages during this time are counted instead of being written, ms
+  #ifndef CONFIG_WIFI_LOG_AGGREGATE
+    #define CONFIG_WIFI_LOG_AGGREGATE 10000
+  #endif
+  #ifndef CONFIG_WIFI_LOG_STACK_SIZE
+    #define CONFIG_WIFI_LOG_STACK_SIZE 2560
+  #endif
+  #ifndef CONFIG_WIFI_LOG_PRIORITY
+    #define CONFIG_WIFI_LOG_PRIORITY 1
+  #endif
+#endif // CONFIG_WIFI_LOG_DEFERRED
+
+#if CONFIG_WIFI_RECOVERY_LADDER
+  // Driver and netif are reinitialized in a separate short-lived task, not in the event loop
+  #ifndef CONFIG_WIFI_RECOVERY_STACK_SIZE
+    #define CONFIG_WIFI_RECOVERY_STACK_SIZE 3072
+  #endif
+  #ifndef CONFIG_WIFI_RECOVERY_PRIORITY
+    #define CONFIG_WIFI_RECOVERY_PRIORITY 5
+  #endif
+#endif // CONFIG_WIFI_RECOVERY_LADDER
+
+// Reconnection with a delay is performed by a timer instead of vTaskDelay() in the event handler
+#define WIFI_RECONNECT_DELAY_TIMER (CONFIG_WIFI_REASON_POLICY || CONFIG_WIFI_RECOVERY_LADDER)
 
 static uint32_t _wifiAttemptCount = 0;
+static wifi_fsm_state_t _wifiState = WIFI_STATE_OFF;
 static EventGroupHandle_t _wifiStatusBits = nullptr;
 static esp_netif_t *_wifiNetif = nullptr;
 static uint8_t _wifiLastErr = 0;
+static int8_t _wifiLastRssi = 0;
+static uint8_t _wifiRssiThreshold = CONFIG_WIFI_RSSI_THERSHOLD;
+#if CONFIG_WIFI_TUNABLES
+typedef struct {
+  uint32_t timeout;               // ms
+  uint32_t reconnect_delay;       // ms
+  uint16_t reconnect_attempts;
+  uint16_t restart_attempts;
+  uint16_t restart_device;        // min
+  uint8_t  bandwidth;             // wifi_bandwidth_t, 0 - driver default
+  uint8_t  reserved;              // No padding: copies are compared with memcmp()
+} wifi_tunables_t;
+
+// Values in use, read at each use; the parameters are registered on a copy, see wifiTunablesChanged()
+static wifi_tunables_t _wifiTunables = {
+  CONFIG_WIFI_TIMEOUT, CONFIG_WIFI_RECONNECT_DELAY, CONFIG_WIFI_RECONNECT_ATTEMPTS, CONFIG_WIFI_RESTART_ATTEMPTS,
+  #if defined(CONFIG_WIFI_TIMER_RESTART_DEVICE) && CONFIG_WIFI_TIMER_RESTART_DEVICE > 0
+    CONFIG_WIFI_TIMER_RESTART_DEVICE,
+  #else
+    0,
+  #endif // CONFIG_WIFI_TIMER_RESTART_DEVICE
+  #ifdef CONFIG_WIFI_BANDWIDTH
+    CONFIG_WIFI_BANDWIDTH,
+  #else
+    0,
+  #endif // CONFIG_WIFI_BANDWIDTH
+  0
+};
+#define WIFI_TIMEOUT                  _wifiTunables.timeout
+#define WIFI_RECONNECT_DELAY          _wifiTunables.reconnect_delay
+#define WIFI_RECONNECT_ATTEMPTS       _wifiTunables.reconnect_attempts
+#define WIFI_RESTART_ATTEMPTS         _wifiTunables.restart_attempts
+#define WIFI_TIMER_RESTART_DEVICE     _wifiTunables.restart_device
+#else
+#define WIFI_TIMEOUT                  CONFIG_WIFI_TIMEOUT
+#define WIFI_RECONNECT_DELAY          CONFIG_WIFI_RECONNECT_DELAY
+#define WIFI_RECONNECT_ATTEMPTS       CONFIG_WIFI_RECONNECT_ATTEMPTS
+#define WIFI_RESTART_ATTEMPTS         CONFIG_WIFI_RESTART_ATTEMPTS
+#define WIFI_TIMER_RESTART_DEVICE     CONFIG_WIFI_TIMER_RESTART_DEVICE
+#endif // CONFIG_WIFI_TUNABLES
+#if CONFIG_WIFI_TELEMETRY || CONFIG_WIFI_STATS
+static uint32_t _wifiConnectTotal = 0;
+static uint32_t _wifiDisconnectTotal = 0;
+static uint32_t _wifiAttemptTotal = 0;
+static int64_t  _wifiOnlineSince = 0;
+#endif // CONFIG_WIFI_TELEMETRY || CONFIG_WIFI_STATS
+#if CONFIG_WIFI_TELEMETRY
+static int8_t   _wifiRssiMin = 0;
+static int8_t   _wifiRssiMax = 0;
+#endif // CONFIG_WIFI_TELEMETRY
 #ifndef CONFIG_WIFI_SSID
 static uint8_t _wifiMaxIndex = 0;
 static uint8_t _wifiCurrIndex = 0;
@@ -84,7 +596,14 @@ EventBits_t wifiStatusGet()
   return xEventGroupGetBits(_wifiStatusBits);
 }
 
-bool wifiStatusSet(EventBits_t bits)
+#if CONFIG_WIFI_SUBSCRIBERS_MAX > 0
+static void wifiStatusNotify(EventBits_t prev, EventBits_t curr);
+#endif // CONFIG_WIFI_SUBSCRIBERS_MAX
+#if CONFIG_WIFI_AVAILABILITY
+static void wifiAvailabilityUpdate(EventBits_t bits);
+#endif // CONFIG_WIFI_AVAILABILITY
+
+static bool wifiStatusSetBits(EventBits_t bits)
 {
   if (!_wifiStatusBits) {
     rlog_e(logTAG, "Failed to set status bits: %X, _wifiStatusBits is null!", bits);
@@ -99,7 +618,7 @@ bool wifiStatusSet(EventBits_t bits)
   return true;
 }
 
-bool wifiStatusClear(const EventBits_t bits)
+static bool wifiStatusClearBits(const EventBits_t bits)
 {
   if (!_wifiStatusBits) {
     return false;
@@ -115,6 +634,38 @@ bool wifiStatusClear(const EventBits_t bits)
   return true;
 }
 
+// Clears and sets bits, subscribers are notified once about the resulting change
+static bool wifiStatusUpdate(const EventBits_t clear, const EventBits_t set)
+{
+  #if CONFIG_WIFI_SUBSCRIBERS_MAX > 0
+    EventBits_t prev = wifiStatusGet();
+  #endif // CONFIG_WIFI_SUBSCRIBERS_MAX
+  bool ret = true;
+  if (clear != 0) ret = wifiStatusClearBits(clear);
+  if (set != 0) ret = wifiStatusSetBits(set) && ret;
+  #if CONFIG_WIFI_AVAILABILITY || (CONFIG_WIFI_SUBSCRIBERS_MAX > 0)
+    // The actual value of the group: another task may have changed other bits at the same time
+    EventBits_t curr = wifiStatusGet();
+  #endif // CONFIG_WIFI_AVAILABILITY || CONFIG_WIFI_SUBSCRIBERS_MAX
+  #if CONFIG_WIFI_AVAILABILITY
+    wifiAvailabilityUpdate(curr);
+  #endif // CONFIG_WIFI_AVAILABILITY
+  #if CONFIG_WIFI_SUBSCRIBERS_MAX > 0
+    wifiStatusNotify(prev, curr);
+  #endif // CONFIG_WIFI_SUBSCRIBERS_MAX
+  return ret;
+}
+
+bool wifiStatusSet(EventBits_t bits)
+{
+  return wifiStatusUpdate(0, bits);
+}
+
+bool wifiStatusClear(const EventBits_t bits)
+{
+  return wifiStatusUpdate(bits, 0);
+}
+
 bool wifiStatusCheck(const EventBits_t bits, const bool clearOnExit) 
 {
   if (!_wifiStatusBits) {
@@ -150,113 +701,721 @@ EventBits_t wifiStatusWait(const EventBits_t bits, const BaseType_t clearOnExit,
   };
 }
 
-
-// -----------------------------------------------------------------------------------------------------------------------
-// -------------------------------------------------- Debug information --------------------------------------------------
-// -----------------------------------------------------------------------------------------------------------------------
-
-char* wifiStatusGetJsonEx(EventBits_t bits)
-{
-  return malloc_stringf("{\"init_tcpip\":%d,\"init_low\":%d,\"sta_enabled\":%d,\"sta_started\":%d,\"sta_connected\":%d,\"sta_got_ip\":%d,\"disconnect_and_stop\":%d,\"disconnect_and_restore\":%d}",
-    (bits & _WIFI_TCPIP_INIT) == _WIFI_TCPIP_INIT,
-    (bits & _WIFI_LOWLEVEL_INIT) == _WIFI_LOWLEVEL_INIT,
-    (bits & _WIFI_STA_ENABLED) == _WIFI_STA_ENABLED,
-    (bits & _WIFI_STA_STARTED) == _WIFI_STA_STARTED,
-    (bits & _WIFI_STA_CONNECTED) == _WIFI_STA_CONNECTED,
-    (bits & _WIFI_STA_GOT_IP) == _WIFI_STA_GOT_IP,
-    (bits & _WIFI_STA_DISCONNECT_STOP) == _WIFI_STA_DISCONNECT_STOP,
-    (bits & _WIFI_STA_DISCONNECT_RESTORE) == _WIFI_STA_DISCONNECT_RESTORE);
-};
-
-char* wifiStatusGetJson()
+static wifi_wait_condition_t wifiWaitReached(EventBits_t bits)
 {
-  EventBits_t bits = wifiStatusGet();
-  return wifiStatusGetJsonEx(bits);
+  if ((bits & _WIFI_INTERNET) != 0) return WIFI_COND_INTERNET;
+  if ((bits & _WIFI_STA_GOT_IP) != 0) return WIFI_COND_GOT_IP;
+  if ((bits & _WIFI_STA_CONNECTED) != 0) return WIFI_COND_CONNECTED;
+  return WIFI_COND_NONE;
 }
- 
-#if CONFIG_WIFI_DEBUG_ENABLE
 
-void wifiStoreDebugInfo()
+wifi_wait_result_t wifiWaitFor(wifi_wait_condition_t condition, uint32_t timeout_ms, wifi_wait_token_t* token)
 {
-  int64_t  curr = time(nullptr);
-  uint32_t bits = wifiStatusGet();
-  nvsWrite(wifiNvsGroup, wifiNvsDebug, OPT_TYPE_I64, &curr);
-  nvsWrite(wifiNvsGroup, wifiNvsReason, OPT_TYPE_U8, &_wifiLastErr);
-  nvsWrite(wifiNvsGroup, wifiNvsBits, OPT_TYPE_U32, &bits);
-  #ifndef CONFIG_WIFI_SSID
-  nvsWrite(wifiNvsGroup, wifiNvsCurrIndex, OPT_TYPE_U8, &_wifiCurrIndex);
-  #endif // CONFIG_WIFI_SSID
-  nvsWrite(wifiNvsGroup, wifiNvsAttCount, OPT_TYPE_U32, &_wifiAttemptCount);
-};
+  wifi_wait_result_t result;
+  memset(&result, 0, sizeof(wifi_wait_result_t));
+  int64_t start = esp_timer_get_time();
 
-char* wifiGetDebugInfo()
-{
-  uint8_t  last_index = 0;
-  uint8_t  last_reason = 0;
-  time_t   time_restart = 0;
-  time_t   time_clear = 0;
-  uint32_t attempts = 0;
-  uint32_t bits = 0;
+  EventBits_t bit = 0;
+  switch (condition) {
+    case WIFI_COND_CONNECTED: bit = _WIFI_STA_CONNECTED; break;
+    case WIFI_COND_GOT_IP:    bit = _WIFI_STA_GOT_IP;    break;
+    case WIFI_COND_INTERNET:  bit = _WIFI_INTERNET;      break;
+    default: break;
+  };
+  if (!_wifiStatusBits || (bit == 0)) {
+    result.status = WIFI_WAIT_INVALID;
+    return result;
+  };
 
-  nvsRead(wifiNvsGroup, wifiNvsDebug, OPT_TYPE_U64, (uint64_t*)&time_restart);
-  if (time_restart > 0) {
-    nvsWrite(wifiNvsGroup, wifiNvsDebug, OPT_TYPE_U64, (uint64_t*)&time_clear);
-    nvsRead(wifiNvsGroup, wifiNvsReason, OPT_TYPE_U8, &last_reason);
-    nvsRead(wifiNvsGroup, wifiNvsCurrIndex, OPT_TYPE_U8, &last_index);
-    nvsRead(wifiNvsGroup, wifiNvsAttCount, OPT_TYPE_U32, &attempts);
-    nvsRead(wifiNvsGroup, wifiNvsBits, OPT_TYPE_U32, &bits);
+  result.status = WIFI_WAIT_TIMEOUT;
+  while (true) {
+    if (token && token->cancelled) {
+      result.status = WIFI_WAIT_CANCELLED;
+      break;
+    };
+    TickType_t ticks = portMAX_DELAY;
+    if (timeout_ms > 0) {
+      uint32_t elapsed = (uint32_t)((esp_timer_get_time() - start) / 1000);
+      if (elapsed >= timeout_ms) {
+        if ((wifiStatusGet() & bit) != 0) result.status = WIFI_WAIT_OK;
+        break;
+      };
+      ticks = pdMS_TO_TICKS(timeout_ms - elapsed);
+    };
+    EventBits_t bits = xEventGroupWaitBits(_wifiStatusBits, bit | _WIFI_WAIT_CANCEL, pdFALSE, pdFALSE, ticks);
+    if ((bits & bit) != 0) {
+      result.status = WIFI_WAIT_OK;
+      break;
+    };
+    // Timeout; otherwise some token was cancelled, check our own and wait further
+    if ((bits & _WIFI_WAIT_CANCEL) == 0) {
+      break;
+    };
+  };
 
-    char* _json = nullptr;
-    char* _states = wifiStatusGetJsonEx(bits);
-    if (_states) {
-      char timebuf[CONFIG_FORMAT_STRFTIME_DTS_BUFFER_SIZE];
-      time2str(CONFIG_FORMAT_DTS, &time_restart, timebuf, sizeof(timebuf));
-      _json = malloc_stringf("{\"last_error\":%d,\"time_restart\":%s,\"index\":%d,\"attempts\":%d,\"bits\":%d,\"states\":%s}",
-        last_reason, timebuf, last_index, attempts, bits, _states);
-      free(_states);
-      return _json;
+  result.elapsed = (uint32_t)((esp_timer_get_time() - start) / 1000);
+  result.satisfied = wifiWaitReached(wifiStatusGet());
+  result.state = _wifiState;
+  result.reason = _wifiLastErr;
+  return result;
+}
+
+void wifiWaitCancel(wifi_wait_token_t* token)
+{
+  if (token) {
+    token->cancelled = true;
+    if (_wifiStatusBits) {
+      // Setting a bit wakes up all waiting tasks, the pulse does not affect the status
+      xEventGroupSetBits(_wifiStatusBits, _WIFI_WAIT_CANCEL);
+      xEventGroupClearBits(_wifiStatusBits, _WIFI_WAIT_CANCEL);
     };
   };
-  return nullptr;
 }
 
-#endif // CONFIG_WIFI_DEBUG_ENABLE
+void wifiInternetSet(bool available)
+{
+  if (available && wifiStatusCheck(_WIFI_STA_GOT_IP, false)) {
+    wifiStatusUpdate(0, _WIFI_INTERNET);
+  } else {
+    wifiStatusUpdate(_WIFI_INTERNET, 0);
+  };
+}
+
+bool wifiInternetAvailable()
+{
+  return wifiStatusCheck(_WIFI_INTERNET, false);
+}
 
 // -----------------------------------------------------------------------------------------------------------------------
-// ----------------------------------------------- Low-level WiFi functions ----------------------------------------------
+// ----------------------------------------------------- Subscriptions ---------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-static bool wifiRegisterEventHandlers();
-static void wifiUnregisterEventHandlers();
+#if CONFIG_WIFI_SUBSCRIBERS_MAX > 0
 
-// Wi-Fi/LwIP Init Phase
-// https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-lwip-init-phase
+typedef struct {
+  EventBits_t mask;
+  wifi_status_edge_t edge;
+  wifi_status_cb_t callback;
+  void* arg;
+  TaskHandle_t task;
+  uint32_t notify;
+  uint16_t generation;            // Incremented each time the slot is taken, not cleared on unsubscribe
+} wifi_subscriber_t;
 
-bool wifiTcpIpInit()
-{
-  rlog_d(logTAG, "TCP-IP initialization...");
+// Handle = (generation << 8) | slot, so a stale handle does not remove the subscriber that reused the slot
+#define WIFI_SUBSCRIBER_SLOT(handle) ((handle) & 0xFF)
+#define WIFI_SUBSCRIBER_GEN(handle)  (((handle) >> 8) & 0xFFFF)
+static_assert(CONFIG_WIFI_SUBSCRIBERS_MAX <= 0xFF, "CONFIG_WIFI_SUBSCRIBERS_MAX must not exceed 255");
 
-  // MAC address initialization: deprecated since ESP-IDF 5.0.0
-  // uint8_t mac[8];
-  // if (esp_efuse_mac_get_default(mac) == ESP_OK) {
-  //   WIFI_ERROR_CHECK_BOOL(esp_base_mac_addr_set(mac), "set MAC address");
-  // };
+static wifi_subscriber_t _wifiSubscribers[CONFIG_WIFI_SUBSCRIBERS_MAX];
+static portMUX_TYPE _wifiSubscribersLock = portMUX_INITIALIZER_UNLOCKED;
 
-  // Start the system events task
-  esp_err_t err = esp_event_loop_create_default();
-  if (!((err == ESP_OK) || (err == ESP_ERR_INVALID_STATE))) {
-    rlog_e(logTAG, "Failed to create default event loop: %d (%s)", err, esp_err_to_name(err));
-    return false;
+static int wifiSubscribeEx(EventBits_t mask, wifi_status_edge_t edge, wifi_status_cb_t callback, void* arg, TaskHandle_t task, uint32_t notify)
+{
+  if ((mask == 0) || ((edge & WIFI_EDGE_ANY) == 0) || (!callback && !task)) {
+    return -1;
+  };
+  int handle = -1;
+  portENTER_CRITICAL(&_wifiSubscribersLock);
+  for (int i = 0; i < CONFIG_WIFI_SUBSCRIBERS_MAX; i++) {
+    if (_wifiSubscribers[i].mask == 0) {
+      _wifiSubscribers[i].edge = edge;
+      _wifiSubscribers[i].callback = callback;
+      _wifiSubscribers[i].arg = arg;
+      _wifiSubscribers[i].task = task;
+      _wifiSubscribers[i].notify = notify;
+      _wifiSubscribers[i].mask = mask;
+      if (++_wifiSubscribers[i].generation == 0) _wifiSubscribers[i].generation = 1;
+      handle = ((int)_wifiSubscribers[i].generation << 8) | i;
+      break;
+    };
   };
+  portEXIT_CRITICAL(&_wifiSubscribersLock);
+  if (handle < 0) {
+    rlog_e(logTAG, "Failed to subscribe to WiFi status: no free slots");
+  };
+  return handle;
+}
 
-  // Initializing the TCP/IP stack
-  WIFI_ERROR_CHECK_BOOL(esp_netif_init(), "esp netif init");
+int wifiSubscribe(EventBits_t mask, wifi_status_edge_t edge, wifi_status_cb_t callback, void* arg)
+{
+  return wifiSubscribeEx(mask, edge, callback, arg, nullptr, 0);
+}
 
-  // Set initialization bit
-  return wifiStatusSet(_WIFI_TCPIP_INIT);
-};
+int wifiSubscribeTask(EventBits_t mask, wifi_status_edge_t edge, TaskHandle_t task, uint32_t notify)
+{
+  return wifiSubscribeEx(mask, edge, nullptr, nullptr, task, notify);
+}
 
-bool wifiLowLevelInit()
+bool wifiUnsubscribe(int handle)
+{
+  if ((handle < 0) || (WIFI_SUBSCRIBER_SLOT(handle) >= CONFIG_WIFI_SUBSCRIBERS_MAX)) {
+    return false;
+  };
+  bool ret = false;
+  wifi_subscriber_t* sub = &_wifiSubscribers[WIFI_SUBSCRIBER_SLOT(handle)];
+  portENTER_CRITICAL(&_wifiSubscribersLock);
+  if ((sub->mask != 0) && (sub->generation == WIFI_SUBSCRIBER_GEN(handle))) {
+    uint16_t generation = sub->generation;
+    memset(sub, 0, sizeof(wifi_subscriber_t));
+    sub->generation = generation;
+    ret = true;
+  };
+  portEXIT_CRITICAL(&_wifiSubscribersLock);
+  return ret;
+}
+
+// Called in the context of the task that changed the bits (usually the event loop), without an event loop hop
+static void wifiStatusNotify(EventBits_t prev, EventBits_t curr)
+{
+  EventBits_t changed = prev ^ curr;
+  if (changed == 0) return;
+  for (int i = 0; i < CONFIG_WIFI_SUBSCRIBERS_MAX; i++) {
+    portENTER_CRITICAL(&_wifiSubscribersLock);
+    wifi_subscriber_t sub = _wifiSubscribers[i];
+    portEXIT_CRITICAL(&_wifiSubscribersLock);
+    if ((sub.mask & changed) == 0) continue;
+    if ((((sub.edge & WIFI_EDGE_SET) != 0) && ((changed & curr & sub.mask) != 0))
+     || (((sub.edge & WIFI_EDGE_CLEAR) != 0) && ((changed & prev & sub.mask) != 0))) {
+      if (sub.callback) {
+        sub.callback(prev, curr, sub.arg);
+      };
+      if (sub.task) {
+        xTaskNotify(sub.task, sub.notify, eSetBits);
+      };
+    };
+  };
+}
+
+#endif // CONFIG_WIFI_SUBSCRIBERS_MAX
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Transition trace --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_TRACE_ENABLE
+
+#define WIFI_TRACE_MAGIC 0x57545243 // "WTRC"
+
+static_assert(sizeof(wifi_trace_record_t) == 12, "WiFi trace record must be 12 bytes");
+
+// The ring is placed in RTC memory, which is not cleared on software reset, so the records survive a reboot
+typedef struct {
+  uint32_t magic;
+  uint32_t size;
+  uint32_t head;                  // Total number of records written, position = head & (size - 1)
+  uint8_t  boot;                  // Boot number, incremented at each initialization
+  wifi_trace_record_t records[CONFIG_WIFI_TRACE_SIZE];
+  uint32_t check;                 // magic ^ size, guards against a partially overwritten block
+} wifi_trace_ring_t;
+
+static RTC_NOINIT_ATTR wifi_trace_ring_t _wifiTrace;
+static bool _wifiTraceReady = false;
+static bool _wifiTraceSurvived = false;
+
+static void wifiTraceInit()
+{
+  if (!_wifiTraceReady) {
+    if ((_wifiTrace.magic != WIFI_TRACE_MAGIC) || (_wifiTrace.size != CONFIG_WIFI_TRACE_SIZE) 
+     || (_wifiTrace.check != (WIFI_TRACE_MAGIC ^ CONFIG_WIFI_TRACE_SIZE))) {
+      // Power-on or corrupted data
+      memset(&_wifiTrace, 0, sizeof(wifi_trace_ring_t));
+      _wifiTrace.magic = WIFI_TRACE_MAGIC;
+      _wifiTrace.size = CONFIG_WIFI_TRACE_SIZE;
+      _wifiTrace.check = WIFI_TRACE_MAGIC ^ CONFIG_WIFI_TRACE_SIZE;
+    } else {
+      _wifiTrace.boot++;
+      _wifiTraceSurvived = _wifiTrace.head > 0;
+    };
+    _wifiTraceReady = true;
+  };
+}
+
+// A few dozen cycles: one atomic increment and a dozen bytes of stores, no locks
+static void wifiTraceWrite(wifi_fsm_event_t event, wifi_fsm_state_t state)
+{
+  if (!_wifiTraceReady) return;
+  uint32_t pos = __atomic_fetch_add(&_wifiTrace.head, 1, __ATOMIC_RELAXED) & (CONFIG_WIFI_TRACE_SIZE - 1);
+  wifi_trace_record_t* rec = &_wifiTrace.records[pos];
+  rec->time = (uint32_t)(esp_timer_get_time() / 1000);
+  rec->bits = (uint16_t)wifiFsmStateBits(state);
+  rec->event = (uint8_t)event;
+  rec->state = (uint8_t)state;
+  rec->reason = _wifiLastErr;
+  rec->rssi = _wifiLastRssi;
+  #ifdef CONFIG_WIFI_SSID
+    rec->index = 1;
+  #else
+    rec->index = _wifiCurrIndex;
+  #endif // CONFIG_WIFI_SSID
+  rec->boot = _wifiTrace.boot;
+}
+
+uint16_t wifiTraceGet(wifi_trace_record_t* records, uint16_t max_count)
+{
+  if (!_wifiTraceReady || !records) return 0;
+  uint32_t head = __atomic_load_n(&_wifiTrace.head, __ATOMIC_RELAXED);
+  uint32_t count = head < CONFIG_WIFI_TRACE_SIZE ? head : CONFIG_WIFI_TRACE_SIZE;
+  if (count > max_count) count = max_count;
+  // Oldest first
+  for (uint32_t i = 0; i < count; i++) {
+    records[i] = _wifiTrace.records[(head - count + i) & (CONFIG_WIFI_TRACE_SIZE - 1)];
+  };
+  return (uint16_t)count;
+}
+
+void wifiTraceClear()
+{
+  __atomic_store_n(&_wifiTrace.head, 0, __ATOMIC_RELAXED);
+}
+
+char* wifiTraceGetJson(uint16_t max_count)
+{
+  if (!_wifiTraceReady) return nullptr;
+  uint32_t head = __atomic_load_n(&_wifiTrace.head, __ATOMIC_RELAXED);
+  uint32_t count = head < CONFIG_WIFI_TRACE_SIZE ? head : CONFIG_WIFI_TRACE_SIZE;
+  if (count > max_count) count = max_count;
+  // [boot,time,event,state,reason,rssi,index,bits] - at most 46 characters per record
+  const size_t item_max = 48;
+  size_t size = count * item_max + 3;
+  char* json = (char*)malloc(size);
+  if (json) {
+    size_t len = 0;
+    json[len++] = '[';
+    for (uint32_t i = 0; i < count; i++) {
+      wifi_trace_record_t rec = _wifiTrace.records[(head - count + i) & (CONFIG_WIFI_TRACE_SIZE - 1)];
+      len += snprintf(json + len, size - len, "%s[%u,%u,%u,%u,%u,%d,%u,%u]", i > 0 ? "," : "",
+        rec.boot, rec.time, rec.event, rec.state, rec.reason, rec.rssi, rec.index, rec.bits);
+      if (len >= size - 2) break;
+    };
+    json[len++] = ']';
+    json[len] = 0;
+  } else {
+    rlog_e(logTAG, "Failed to allocate memory for WiFi trace");
+  };
+  return json;
+}
+
+#endif // CONFIG_WIFI_TRACE_ENABLE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Availability ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_AVAILABILITY
+
+#define WIFI_AVAIL_HOURS 24
+#define WIFI_AVAIL_HOUR_US (3600LL * 1000000LL)
+
+static wifi_avail_state_t _wifiAvailState = WIFI_AVAIL_DISABLED;
+static int64_t _wifiAvailSince = 0;                             // 0 - accounting is not started
+static uint64_t _wifiAvailBoot[WIFI_AVAIL_MAX];                 // us
+static uint32_t _wifiAvailStored[WIFI_AVAIL_MAX];               // s, lifetime values of previous boots
+static uint32_t _wifiAvailHours[WIFI_AVAIL_HOURS][WIFI_AVAIL_MAX]; // ms, ring of hourly buckets
+static int64_t _wifiAvailHour = 0;                              // Number of the current hour since boot
+static portMUX_TYPE _wifiAvailLock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t _wifiAvailTimer = nullptr;
+
+static wifi_avail_state_t wifiAvailabilityState(EventBits_t bits)
+{
+  if ((bits & _WIFI_STA_ENABLED) == 0) return WIFI_AVAIL_DISABLED;
+  if (bits & _WIFI_STA_GOT_IP) return (bits & _WIFI_INTERNET) ? WIFI_AVAIL_VERIFIED : WIFI_AVAIL_CONNECTED;
+  if (bits & _WIFI_STA_CONNECTED) return WIFI_AVAIL_ASSOCIATED;
+  return WIFI_AVAIL_CONNECTING;
+}
+
+// Called under the lock: adds the time in the current state up to now, splitting it by hours
+static void wifiAvailabilityAccount(int64_t now)
+{
+  while (_wifiAvailSince < now) {
+    int64_t hour = _wifiAvailSince / WIFI_AVAIL_HOUR_US;
+    int64_t end = (hour + 1) * WIFI_AVAIL_HOUR_US;
+    if (end > now) end = now;
+    // Buckets of the hours that have passed since the previous call are reused
+    for (uint8_t i = 0; (_wifiAvailHour < hour) && (i < WIFI_AVAIL_HOURS); i++) {
+      _wifiAvailHour++;
+      memset(_wifiAvailHours[_wifiAvailHour % WIFI_AVAIL_HOURS], 0, sizeof(_wifiAvailHours[0]));
+    };
+    _wifiAvailHour = hour;
+    _wifiAvailHours[hour % WIFI_AVAIL_HOURS][_wifiAvailState] += (uint32_t)((end - _wifiAvailSince) / 1000);
+    _wifiAvailBoot[_wifiAvailState] += (uint64_t)(end - _wifiAvailSince);
+    _wifiAvailSince = end;
+  };
+}
+
+static void wifiAvailabilityUpdate(EventBits_t bits)
+{
+  wifi_avail_state_t state = wifiAvailabilityState(bits);
+  portENTER_CRITICAL(&_wifiAvailLock);
+  if ((_wifiAvailSince > 0) && (state != _wifiAvailState)) {
+    wifiAvailabilityAccount(esp_timer_get_time());
+    _wifiAvailState = state;
+  };
+  portEXIT_CRITICAL(&_wifiAvailLock);
+}
+
+static uint16_t wifiAvailabilityRatio(const uint32_t* time)
+{
+  uint64_t enabled = 0;
+  for (uint8_t i = WIFI_AVAIL_CONNECTING; i < WIFI_AVAIL_MAX; i++) {
+    enabled += time[i];
+  };
+  uint64_t available = time[WIFI_AVAIL_VERIFIED];
+  #if !CONFIG_WIFI_AVAILABILITY_VERIFIED
+    available += time[WIFI_AVAIL_CONNECTED];
+  #endif // CONFIG_WIFI_AVAILABILITY_VERIFIED
+  return enabled > 0 ? (uint16_t)(available * 10000 / enabled) : 0;
+}
+
+wifi_availability_t wifiAvailabilityGet(wifi_avail_scope_t scope)
+{
+  wifi_availability_t ret;
+  memset(&ret, 0, sizeof(wifi_availability_t));
+  uint64_t ms[WIFI_AVAIL_MAX];
+  memset(ms, 0, sizeof(ms));
+  portENTER_CRITICAL(&_wifiAvailLock);
+  if (_wifiAvailSince > 0) {
+    wifiAvailabilityAccount(esp_timer_get_time());
+  };
+  for (uint8_t i = 0; i < WIFI_AVAIL_MAX; i++) {
+    if (scope == WIFI_AVAIL_DAY) {
+      for (uint8_t h = 0; h < WIFI_AVAIL_HOURS; h++) {
+        ms[i] += _wifiAvailHours[h][i];
+      };
+    } else {
+      ms[i] = _wifiAvailBoot[i] / 1000;
+    };
+  };
+  portEXIT_CRITICAL(&_wifiAvailLock);
+  for (uint8_t i = 0; i < WIFI_AVAIL_MAX; i++) {
+    ret.time[i] = (uint32_t)(ms[i] / 1000) + (scope == WIFI_AVAIL_LIFETIME ? _wifiAvailStored[i] : 0);
+  };
+  ret.availability = wifiAvailabilityRatio(ret.time);
+  return ret;
+}
+
+static char* wifiAvailabilityScopeJson(wifi_avail_scope_t scope)
+{
+  wifi_availability_t data = wifiAvailabilityGet(scope);
+  return malloc_stringf("{\"disabled\":%u,\"connecting\":%u,\"associated\":%u,\"connected\":%u,\"verified\":%u,\"availability\":%d.%02d}",
+    data.time[WIFI_AVAIL_DISABLED], data.time[WIFI_AVAIL_CONNECTING], data.time[WIFI_AVAIL_ASSOCIATED], 
+    data.time[WIFI_AVAIL_CONNECTED], data.time[WIFI_AVAIL_VERIFIED], data.availability / 100, data.availability % 100);
+}
+
+char* wifiAvailabilityGetJson()
+{
+  char* json = nullptr;
+  char* boot = wifiAvailabilityScopeJson(WIFI_AVAIL_BOOT);
+  char* day = wifiAvailabilityScopeJson(WIFI_AVAIL_DAY);
+  char* lifetime = wifiAvailabilityScopeJson(WIFI_AVAIL_LIFETIME);
+  if (boot && day && lifetime) {
+    json = malloc_stringf("{\"boot\":%s,\"day\":%s,\"lifetime\":%s}", boot, day, lifetime);
+  };
+  if (boot) free(boot);
+  if (day) free(day);
+  if (lifetime) free(lifetime);
+  return json;
+}
+
+static void wifiAvailabilityStore()
+{
+  wifi_availability_t lifetime = wifiAvailabilityGet(WIFI_AVAIL_LIFETIME);
+  char key[8];
+  for (uint8_t i = 0; i < WIFI_AVAIL_MAX; i++) {
+    snprintf(key, sizeof(key), wifiNvsAvailability, i);
+    nvsWrite(wifiNvsGroup, key, OPT_TYPE_U32, &lifetime.time[i]);
+  };
+  uint16_t boot = wifiAvailabilityGet(WIFI_AVAIL_BOOT).availability;
+  rlog_d(logTAG, "WiFi availability: %d.%02d %% since boot, %d.%02d %% lifetime", 
+    boot / 100, boot % 100, lifetime.availability / 100, lifetime.availability % 100);
+}
+
+static void wifiAvailabilityTimerEnd(void* arg)
+{
+  wifiAvailabilityStore();
+}
+
+static void wifiAvailabilityInit()
+{
+  if (_wifiAvailSince > 0) return;
+  char key[8];
+  for (uint8_t i = 0; i < WIFI_AVAIL_MAX; i++) {
+    snprintf(key, sizeof(key), wifiNvsAvailability, i);
+    nvsRead(wifiNvsGroup, key, OPT_TYPE_U32, &_wifiAvailStored[i]);
+  };
+  portENTER_CRITICAL(&_wifiAvailLock);
+  _wifiAvailSince = esp_timer_get_time();
+  _wifiAvailHour = _wifiAvailSince / WIFI_AVAIL_HOUR_US;
+  _wifiAvailState = wifiAvailabilityState(wifiStatusGet());
+  portEXIT_CRITICAL(&_wifiAvailLock);
+  if (!_wifiAvailTimer) {
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+    timer_args.callback = &wifiAvailabilityTimerEnd;
+    timer_args.name = "timer_wifi_avail";
+    if (esp_timer_create(&timer_args, &_wifiAvailTimer) != ESP_OK) {
+      rlog_e(logTAG, "Failed to create WiFi availability timer");
+      return;
+    };
+    esp_timer_start_periodic(_wifiAvailTimer, (uint64_t)CONFIG_WIFI_AVAILABILITY_SAVE_INTERVAL * 1000000);
+  };
+}
+
+#endif // CONFIG_WIFI_AVAILABILITY
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- State machine ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static portMUX_TYPE _wifiStateLock = portMUX_INITIALIZER_UNLOCKED;
+static wifi_fsm_trace_t _wifiStateTrace = nullptr;
+// wifiSuspend() was called: after STA is stopped, the driver is kept
+static bool _wifiSuspendRequested = false;
+
+wifi_fsm_state_t wifiStateGet()
+{
+  return _wifiState;
+}
+
+void wifiStateSetTrace(wifi_fsm_trace_t trace)
+{
+  _wifiStateTrace = trace;
+}
+
+// Changes the state according to the transition table and returns the action to be performed
+static wifi_fsm_action_t wifiStateDispatch(wifi_fsm_event_t event)
+{
+  portENTER_CRITICAL(&_wifiStateLock);
+  wifi_fsm_state_t prev = _wifiState;
+  wifi_fsm_transition_t transition = wifiFsmTransition(prev, event);
+  _wifiState = (wifi_fsm_state_t)transition.next;
+  portEXIT_CRITICAL(&_wifiStateLock);
+
+  if (transition.next != prev) {
+    EventBits_t bits = wifiFsmStateBits((wifi_fsm_state_t)transition.next);
+    // Bits common to both states are not touched, so waiting tasks do not see a false drop
+    EventBits_t clear = WIFI_FSM_BITS & ~bits;
+    // Internet access must be confirmed again after reconnection
+    if ((bits & _WIFI_STA_GOT_IP) == 0) clear |= _WIFI_INTERNET;
+    wifiStatusUpdate(clear, bits);
+  };
+
+  rlog_v(logTAG, "WiFi state: %s + %s -> %s, action: %s", wifiFsmStateName(prev), wifiFsmEventName(event), 
+    wifiFsmStateName((wifi_fsm_state_t)transition.next), wifiFsmActionName((wifi_fsm_action_t)transition.action));
+  #if CONFIG_WIFI_TRACE_ENABLE
+    wifiTraceWrite(event, (wifi_fsm_state_t)transition.next);
+  #endif // CONFIG_WIFI_TRACE_ENABLE
+  if (_wifiStateTrace) {
+    _wifiStateTrace(prev, event, (wifi_fsm_action_t)transition.action, (wifi_fsm_state_t)transition.next);
+  };
+  return (wifi_fsm_action_t)transition.action;
+}
+
+// Timers run in the esp_timer task, so they only post an event to the default event loop: FSM actions are performed by 
+// the same task as the WiFi and IP event handlers. The payload is the sequence number of the timer, an event of a timer 
+// that was restarted or stopped after posting is ignored
+ESP_EVENT_DEFINE_BASE(WIFI_TIMER_EVENTS);
+
+typedef enum {
+  WIFI_TIMER_TIMEOUT = 0,
+  WIFI_TIMER_RECONNECT,
+  WIFI_TIMER_RECOVERY
+} wifi_timer_event_t;
+
+static void wifiStatePostTimer(wifi_timer_event_t timer, uint32_t seq)
+{
+  WIFI_ERROR_CHECK_LOG(esp_event_post(WIFI_TIMER_EVENTS, timer, &seq, sizeof(seq), portMAX_DELAY), "post a timer event");
+}
+
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Debug information --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+char* wifiStatusGetJsonEx(EventBits_t bits)
+{
+  char* json = malloc_stringf("{\"init_tcpip\":%d,\"init_low\":%d,\"sta_enabled\":%d,\"sta_started\":%d,\"sta_connected\":%d,\"sta_got_ip\":%d,\"disconnect_and_stop\":%d,\"disconnect_and_restore\":%d,\"suspended\":%d,\"internet\":%d}",
+    (bits & _WIFI_TCPIP_INIT) == _WIFI_TCPIP_INIT,
+    (bits & _WIFI_LOWLEVEL_INIT) == _WIFI_LOWLEVEL_INIT,
+    (bits & _WIFI_STA_ENABLED) == _WIFI_STA_ENABLED,
+    (bits & _WIFI_STA_STARTED) == _WIFI_STA_STARTED,
+    (bits & _WIFI_STA_CONNECTED) == _WIFI_STA_CONNECTED,
+    (bits & _WIFI_STA_GOT_IP) == _WIFI_STA_GOT_IP,
+    (bits & _WIFI_STA_DISCONNECT_STOP) == _WIFI_STA_DISCONNECT_STOP,
+    (bits & _WIFI_STA_DISCONNECT_RESTORE) == _WIFI_STA_DISCONNECT_RESTORE,
+    (bits & _WIFI_STA_SUSPENDED) == _WIFI_STA_SUSPENDED,
+    (bits & _WIFI_INTERNET) == _WIFI_INTERNET);
+  #if CONFIG_WIFI_RTT_PROBE
+    // {...} -> {...,"rtt":{...}}
+    char* rtt = wifiRttGetJson();
+    if (json && rtt) {
+      json[strlen(json) - 1] = 0;
+      char* ext = malloc_stringf("%s,\"rtt\":%s}", json, rtt);
+      if (ext) {
+        free(json);
+        json = ext;
+      };
+    };
+    if (rtt) free(rtt);
+  #endif // CONFIG_WIFI_RTT_PROBE
+  return json;
+};
+
+char* wifiStatusGetJson()
+{
+  EventBits_t bits = wifiStatusGet();
+  return wifiStatusGetJsonEx(bits);
+}
+ 
+#if CONFIG_WIFI_DEBUG_ENABLE
+
+void wifiStoreDebugInfo()
+{
+  int64_t  curr = time(nullptr);
+  uint32_t bits = wifiStatusGet();
+  nvsWrite(wifiNvsGroup, wifiNvsDebug, OPT_TYPE_I64, &curr);
+  nvsWrite(wifiNvsGroup, wifiNvsReason, OPT_TYPE_U8, &_wifiLastErr);
+  nvsWrite(wifiNvsGroup, wifiNvsBits, OPT_TYPE_U32, &bits);
+  #ifndef CONFIG_WIFI_SSID
+  nvsWrite(wifiNvsGroup, wifiNvsCurrIndex, OPT_TYPE_U8, &_wifiCurrIndex);
+  #endif // CONFIG_WIFI_SSID
+  nvsWrite(wifiNvsGroup, wifiNvsAttCount, OPT_TYPE_U32, &_wifiAttemptCount);
+};
+
+char* wifiGetDebugInfo()
+{
+  uint8_t  last_index = 0;
+  uint8_t  last_reason = 0;
+  time_t   time_restart = 0;
+  time_t   time_clear = 0;
+  uint32_t attempts = 0;
+  uint32_t bits = 0;
+
+  nvsRead(wifiNvsGroup, wifiNvsDebug, OPT_TYPE_U64, (uint64_t*)&time_restart);
+  #if CONFIG_WIFI_TRACE_ENABLE
+    // The history before a reset is returned once after any reset, not only after a restart by the WiFi watchdog
+    wifiTraceInit();
+    bool trace_survived = _wifiTraceSurvived;
+    _wifiTraceSurvived = false;
+    if ((time_restart == 0) && trace_survived) {
+      char* _json = nullptr;
+      char* _trace = wifiTraceGetJson(CONFIG_WIFI_TRACE_DEBUG_MAX);
+      if (_trace) {
+        _json = malloc_stringf("{\"trace\":%s}", _trace);
+        free(_trace);
+      };
+      return _json;
+    };
+  #endif // CONFIG_WIFI_TRACE_ENABLE
+  if (time_restart > 0) {
+    nvsWrite(wifiNvsGroup, wifiNvsDebug, OPT_TYPE_U64, (uint64_t*)&time_clear);
+    nvsRead(wifiNvsGroup, wifiNvsReason, OPT_TYPE_U8, &last_reason);
+    nvsRead(wifiNvsGroup, wifiNvsCurrIndex, OPT_TYPE_U8, &last_index);
+    nvsRead(wifiNvsGroup, wifiNvsAttCount, OPT_TYPE_U32, &attempts);
+    nvsRead(wifiNvsGroup, wifiNvsBits, OPT_TYPE_U32, &bits);
+
+    char* _json = nullptr;
+    char* _states = wifiStatusGetJsonEx(bits);
+    if (_states) {
+      char timebuf[CONFIG_FORMAT_STRFTIME_DTS_BUFFER_SIZE];
+      time2str(CONFIG_FORMAT_DTS, &time_restart, timebuf, sizeof(timebuf));
+      #if CONFIG_WIFI_TRACE_ENABLE
+        char* _trace = wifiTraceGetJson(CONFIG_WIFI_TRACE_DEBUG_MAX);
+        _json = malloc_stringf("{\"last_error\":%d,\"time_restart\":%s,\"index\":%d,\"attempts\":%d,\"bits\":%d,\"states\":%s,\"trace\":%s}",
+          last_reason, timebuf, last_index, attempts, bits, _states, _trace ? _trace : "[]");
+        if (_trace) free(_trace);
+      #else
+        _json = malloc_stringf("{\"last_error\":%d,\"time_restart\":%s,\"index\":%d,\"attempts\":%d,\"bits\":%d,\"states\":%s}",
+          last_reason, timebuf, last_index, attempts, bits, _states);
+      #endif // CONFIG_WIFI_TRACE_ENABLE
+      free(_states);
+      return _json;
+    };
+  };
+  return nullptr;
+}
+
+#endif // CONFIG_WIFI_DEBUG_ENABLE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------- Low-level WiFi functions ----------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static bool wifiRegisterEventHandlers();
+static void wifiUnregisterEventHandlers();
+
+static wifi_lowlevel_stats_t _wifiLowLevelStats;
+
+static void wifiLowLevelMeasure(int64_t init_start)
+{
+  _wifiLowLevelStats.cycles++;
+  _wifiLowLevelStats.init_last = (uint32_t)(esp_timer_get_time() - init_start);
+  _wifiLowLevelStats.init_total += _wifiLowLevelStats.init_last;
+  _wifiLowLevelStats.heap_free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  _wifiLowLevelStats.heap_largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  if ((_wifiLowLevelStats.heap_largest_min == 0) || (_wifiLowLevelStats.heap_largest < _wifiLowLevelStats.heap_largest_min)) {
+    _wifiLowLevelStats.heap_largest_min = _wifiLowLevelStats.heap_largest;
+  };
+  rlog_d(logTAG, "WiFi low level initialization #%d completed in %d us, free heap: %d, largest free block: %d", 
+    _wifiLowLevelStats.cycles, _wifiLowLevelStats.init_last, _wifiLowLevelStats.heap_free, _wifiLowLevelStats.heap_largest);
+}
+
+wifi_lowlevel_stats_t wifiLowLevelStatsGet()
+{
+  return _wifiLowLevelStats;
+}
+
+// Reset only the DHCP client and IP address of the reused netif
+static void wifiNetifReset()
+{
+  esp_err_t err = esp_netif_dhcpc_stop(_wifiNetif);
+  if ((err != ESP_OK) && (err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED)) {
+    rlog_e(logTAG, "Failed to stop DHCP client: %d (%s)", err, esp_err_to_name(err));
+  };
+  // DHCP client will actually start when the interface is up
+  err = esp_netif_dhcpc_start(_wifiNetif);
+  if ((err != ESP_OK) && (err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED)) {
+    rlog_e(logTAG, "Failed to start DHCP client: %d (%s)", err, esp_err_to_name(err));
+  };
+}
+
+// Complete removal of netif, only possible when the driver is not initialized
+static void wifiNetifDestroy()
+{
+  if (_wifiNetif && !wifiStatusCheck(_WIFI_LOWLEVEL_INIT, false)) {
+    esp_netif_destroy(_wifiNetif);
+    _wifiNetif = nullptr;
+  };
+}
+
+// Wi-Fi/LwIP Init Phase
+// https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-lwip-init-phase
+
+bool wifiTcpIpInit()
+{
+  rlog_d(logTAG, "TCP-IP initialization...");
+
+  // MAC address initialization: deprecated since ESP-IDF 5.0.0
+  // uint8_t mac[8];
+  // if (esp_efuse_mac_get_default(mac) == ESP_OK) {
+  //   WIFI_ERROR_CHECK_BOOL(esp_base_mac_addr_set(mac), "set MAC address");
+  // };
+
+  // Start the system events task
+  esp_err_t err = esp_event_loop_create_default();
+  if (!((err == ESP_OK) || (err == ESP_ERR_INVALID_STATE))) {
+    rlog_e(logTAG, "Failed to create default event loop: %d (%s)", err, esp_err_to_name(err));
+    return false;
+  };
+
+  // Initializing the TCP/IP stack
+  WIFI_ERROR_CHECK_BOOL(esp_netif_init(), "esp netif init");
+
+  // Set initialization bit
+  return wifiStatusSet(_WIFI_TCPIP_INIT);
+};
+
+bool wifiLowLevelInit()
 {
   if (!wifiStatusCheck(_WIFI_LOWLEVEL_INIT, false)) {
     rlog_d(logTAG, "WiFi low level initialization...");
@@ -268,15 +1427,21 @@ bool wifiLowLevelInit()
       if (!wifiTcpIpInit()) return false;
     };
 
-    // Remove netif if it existed (e.g. when changing mode)
+    int64_t init_start = esp_timer_get_time();
+
+    // Netif is created only once and is reattached to the driver on subsequent initializations (e.g. when changing mode)
     if (_wifiNetif) {
-      esp_netif_destroy(_wifiNetif);
-      _wifiNetif = nullptr;
+      WIFI_ERROR_CHECK_BOOL(esp_netif_attach_wifi_station(_wifiNetif), "attach netif to WiFi station");
+      WIFI_ERROR_CHECK_BOOL(esp_wifi_set_default_wifi_sta_handlers(), "set default WiFi STA handlers");
+      wifiNetifReset();
+    } else {
+      _wifiNetif = esp_netif_create_default_wifi_sta();
+      if (!_wifiNetif) {
+        rlog_e(logTAG, "Failed to create WiFi STA netif");
+        return false;
+      };
     };
 
-    // Initializing netif
-    _wifiNetif = esp_netif_create_default_wifi_sta();
-
     // WiFi initialization with default parameters
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     esp_err_t err = esp_wifi_init(&cfg);
@@ -299,8 +1464,11 @@ bool wifiLowLevelInit()
 
     // Register event handlers
     if (wifiRegisterEventHandlers()) {
+      wifiLowLevelMeasure(init_start);
       // Set initialization bit
-      return wifiStatusSet(_WIFI_LOWLEVEL_INIT);
+      bool ret = wifiStatusSet(_WIFI_LOWLEVEL_INIT);
+      wifiStateDispatch(WIFI_FSM_EV_INIT);
+      return ret;
     };
   };
   return false;
@@ -320,14 +1488,15 @@ bool wifiLowLevelDeinit()
     // We free up WiFi resources, we don’t tamper with the TCP-IP stack
     WIFI_ERROR_CHECK_BOOL(esp_wifi_deinit(), "WiFi deinit");
 
-    // Free netif
+    // Detach netif from the driver, netif itself is kept for the next initialization
     if (_wifiNetif) {
-      esp_netif_destroy(_wifiNetif);
-      _wifiNetif = nullptr;
+      WIFI_ERROR_CHECK_LOG(esp_wifi_clear_default_wifi_driver_and_handlers(_wifiNetif), "detach netif from WiFi driver");
     };
 
     // Clear initialization bit
-    return wifiStatusClear(_WIFI_LOWLEVEL_INIT);
+    bool ret = wifiStatusClear(_WIFI_LOWLEVEL_INIT);
+    wifiStateDispatch(WIFI_FSM_EV_DEINIT);
+    return ret;
   };
 
   return true;
@@ -337,19 +1506,175 @@ bool wifiLowLevelDeinit()
 // ------------------------------------------------------- Timeout -------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
+// Phases of the connection, each of them is controlled by its own timeout
+typedef enum {
+  WIFI_PHASE_START = 0,         // esp_wifi_start() -> WIFI_EVENT_STA_START
+  WIFI_PHASE_CONNECT,           // esp_wifi_connect() -> WIFI_EVENT_STA_CONNECTED
+  WIFI_PHASE_GOT_IP,            // WIFI_EVENT_STA_CONNECTED -> IP_EVENT_STA_GOT_IP
+  WIFI_PHASE_DISCONNECT,        // esp_wifi_disconnect() -> WIFI_EVENT_STA_DISCONNECTED
+  WIFI_PHASE_MAX,
+  WIFI_PHASE_NONE = WIFI_PHASE_MAX
+} wifi_phase_t;
+
 static esp_timer_handle_t _wifiTimer = nullptr;
+static uint32_t _wifiTimerSeq = 0;
+static wifi_phase_t _wifiPhase = WIFI_PHASE_NONE;
+static int64_t _wifiPhaseStart = 0;
 
-bool _wifiStopSTA();
-bool _wifiRestoreSTA();
-bool wifiReconnectWiFi();
+static uint8_t wifiNetworkSlot()
+{
+  #ifdef CONFIG_WIFI_SSID
+    return 0;
+  #else
+    return ((_wifiCurrIndex > 0) && (_wifiCurrIndex <= WIFI_NETWORKS_COUNT)) ? _wifiCurrIndex - 1 : 0;
+  #endif // CONFIG_WIFI_SSID
+}
+
+#if CONFIG_WIFI_TIMEOUT_ADAPTIVE
+
+// History of successful durations in 10 ms units (up to 655 seconds)
+typedef struct {
+  uint16_t samples[CONFIG_WIFI_TIMEOUT_SAMPLES];
+  uint8_t  count;
+  uint8_t  next;
+} wifi_phase_history_t;
+
+static wifi_phase_history_t _wifiPhaseHistory[WIFI_NETWORKS_COUNT][WIFI_PHASE_MAX];
+static uint64_t _wifiPhaseStored[WIFI_NETWORKS_COUNT];
+static bool _wifiPhaseChanged = false;
+
+static uint16_t wifiPhasePercentile(uint8_t slot, wifi_phase_t phase)
+{
+  wifi_phase_history_t* hist = &_wifiPhaseHistory[slot][phase];
+  if (hist->count == 0) return 0;
+
+  // Insertion sort of a small copy is cheaper than any selection algorithm here
+  uint16_t sorted[CONFIG_WIFI_TIMEOUT_SAMPLES];
+  for (uint8_t i = 0; i < hist->count; i++) {
+    uint16_t value = hist->samples[i];
+    uint8_t j = i;
+    while ((j > 0) && (sorted[j-1] > value)) {
+      sorted[j] = sorted[j-1];
+      j--;
+    };
+    sorted[j] = value;
+  };
+
+  // Nearest-rank method
+  uint32_t rank = ((uint32_t)hist->count * CONFIG_WIFI_TIMEOUT_PERCENTILE + 99) / 100;
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static uint64_t wifiPhasePack(uint8_t slot)
+{
+  uint64_t packed = 0;
+  for (uint8_t phase = 0; phase < WIFI_PHASE_MAX; phase++) {
+    packed |= (uint64_t)wifiPhasePercentile(slot, (wifi_phase_t)phase) << (16 * phase);
+  };
+  return packed;
+}
+
+static void wifiPhaseLoad()
+{
+  char key[8];
+  memset(&_wifiPhaseHistory, 0, sizeof(_wifiPhaseHistory));
+  for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+    _wifiPhaseStored[slot] = 0;
+    snprintf(key, sizeof(key), wifiNvsTimeouts, slot + 1);
+    nvsRead(wifiNvsGroup, key, OPT_TYPE_U64, &_wifiPhaseStored[slot]);
+    // The stored percentile becomes the first sample of the history
+    for (uint8_t phase = 0; phase < WIFI_PHASE_MAX; phase++) {
+      uint16_t value = (uint16_t)(_wifiPhaseStored[slot] >> (16 * phase));
+      if (value > 0) {
+        _wifiPhaseHistory[slot][phase].samples[0] = value;
+        _wifiPhaseHistory[slot][phase].count = 1;
+        _wifiPhaseHistory[slot][phase].next = 1;
+      };
+    };
+  };
+  _wifiPhaseChanged = false;
+}
+
+static void wifiPhaseStore()
+{
+  if (_wifiPhaseChanged) {
+    char key[8];
+    for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+      uint64_t packed = wifiPhasePack(slot);
+      if (packed != _wifiPhaseStored[slot]) {
+        snprintf(key, sizeof(key), wifiNvsTimeouts, slot + 1);
+        if (nvsWrite(wifiNvsGroup, key, OPT_TYPE_U64, &packed)) {
+          _wifiPhaseStored[slot] = packed;
+          rlog_d(logTAG, "Learned timeouts for network %d: start %d ms, connect %d ms, got ip %d ms, disconnect %d ms", slot + 1,
+            10 * (uint16_t)(packed), 10 * (uint16_t)(packed >> 16), 10 * (uint16_t)(packed >> 32), 10 * (uint16_t)(packed >> 48));
+        };
+      };
+    };
+    _wifiPhaseChanged = false;
+  };
+}
+
+#endif // CONFIG_WIFI_TIMEOUT_ADAPTIVE
+
+static uint32_t wifiPhaseTimeout(wifi_phase_t phase)
+{
+  #if CONFIG_WIFI_TIMEOUT_ADAPTIVE
+    if (phase < WIFI_PHASE_MAX) {
+      uint32_t base = 10 * (uint32_t)wifiPhasePercentile(wifiNetworkSlot(), phase);
+      if (base > 0) {
+        uint32_t timeout = base * CONFIG_WIFI_TIMEOUT_MULTIPLIER / 100;
+        if (timeout < CONFIG_WIFI_TIMEOUT_MIN) timeout = CONFIG_WIFI_TIMEOUT_MIN;
+        if (timeout > CONFIG_WIFI_TIMEOUT_MAX) timeout = CONFIG_WIFI_TIMEOUT_MAX;
+        return timeout;
+      };
+    };
+  #endif // CONFIG_WIFI_TIMEOUT_ADAPTIVE
+  return WIFI_TIMEOUT;
+}
+
+// Register the successful completion of the phase, returns the phase duration in ms
+#if CONFIG_WIFI_TELEMETRY
+// Duration of the last successful phase, ms
+static uint16_t _wifiPhaseLast[WIFI_PHASE_MAX];
+#endif // CONFIG_WIFI_TELEMETRY
+
+static uint32_t wifiPhaseComplete(wifi_phase_t phase)
+{
+  if ((_wifiPhase != phase) || (phase >= WIFI_PHASE_MAX)) {
+    return 0;
+  };
+  _wifiPhase = WIFI_PHASE_NONE;
+  uint32_t duration = (uint32_t)((esp_timer_get_time() - _wifiPhaseStart) / 1000);
+  #if CONFIG_WIFI_TELEMETRY
+    _wifiPhaseLast[phase] = duration > UINT16_MAX ? UINT16_MAX : (uint16_t)duration;
+  #endif // CONFIG_WIFI_TELEMETRY
+  #if CONFIG_WIFI_TIMEOUT_ADAPTIVE
+    uint32_t units = (duration + 9) / 10;
+    if (units == 0) units = 1;
+    if (units > UINT16_MAX) units = UINT16_MAX;
+    wifi_phase_history_t* hist = &_wifiPhaseHistory[wifiNetworkSlot()][phase];
+    hist->samples[hist->next] = (uint16_t)units;
+    if (++hist->next >= CONFIG_WIFI_TIMEOUT_SAMPLES) hist->next = 0;
+    if (hist->count < CONFIG_WIFI_TIMEOUT_SAMPLES) hist->count++;
+    _wifiPhaseChanged = true;
+  #endif // CONFIG_WIFI_TIMEOUT_ADAPTIVE
+  return duration;
+}
+
+static bool wifiStateExecute(wifi_fsm_action_t action);
+static bool wifiStateHandle(wifi_fsm_event_t event);
 
 static void wifiTimeoutEnd(void* arg)
+{
+  wifiStatePostTimer(WIFI_TIMER_TIMEOUT, _wifiTimerSeq);
+}
+
+// Called from the event loop
+static void wifiTimeoutExec()
 {
   rlog_e(logTAG, "WiFi operation time-out!");
-  if (!wifiReconnectWiFi()) {
-    _wifiRestoreSTA();
-    _wifiStopSTA();
-  };
+  _wifiPhase = WIFI_PHASE_NONE;
+  wifiStateHandle(WIFI_FSM_EV_TIMEOUT);
 }
 
 static void wifiTimeoutCreate() 
@@ -370,8 +1695,12 @@ static void wifiTimeoutCreate()
   rlog_v(logTAG, "WiFi timer was created");
 }
 
-static void wifiTimeoutStart(uint32_t ms_timeout) 
+static void wifiTimeoutStart(wifi_phase_t phase) 
 {
+  uint32_t ms_timeout = wifiPhaseTimeout(phase);
+  _wifiPhase = phase;
+  _wifiPhaseStart = esp_timer_get_time();
+  _wifiTimerSeq++;
   if (!_wifiTimer) {
     wifiTimeoutCreate();
   };
@@ -380,7 +1709,7 @@ static void wifiTimeoutStart(uint32_t ms_timeout)
       esp_timer_stop(_wifiTimer);
     };
     if (esp_timer_start_once(_wifiTimer, (uint64_t)ms_timeout * 1000) == ESP_OK) {
-      rlog_v(logTAG, "WiFi timer was started");
+      rlog_v(logTAG, "WiFi timer was started: %d ms", ms_timeout);
     } else {  
       rlog_e(logTAG, "Failed to start timeout timer");
     };
@@ -389,6 +1718,8 @@ static void wifiTimeoutStart(uint32_t ms_timeout)
 
 static void wifiTimeoutStop() 
 {
+  _wifiPhase = WIFI_PHASE_NONE;
+  _wifiTimerSeq++;
   if (_wifiTimer) {
     if (esp_timer_is_active(_wifiTimer)) {
       if (esp_timer_stop(_wifiTimer) == ESP_OK) {
@@ -402,6 +1733,8 @@ static void wifiTimeoutStop()
 
 static void wifiTimeoutDelete()
 {
+  _wifiPhase = WIFI_PHASE_NONE;
+  _wifiTimerSeq++;
   if (_wifiTimer) {
     if (esp_timer_is_active(_wifiTimer)) {
       esp_timer_stop(_wifiTimer);
@@ -413,303 +1746,3658 @@ static void wifiTimeoutDelete()
 }
 
 // -----------------------------------------------------------------------------------------------------------------------
-// --------------------------------------------------- Configure STA mode ------------------------------------------------
+// --------------------------------------------------- Network scoring ---------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-uint8_t wifiGetMaxIndex()
+#if CONFIG_WIFI_NETWORK_SCORING && !defined(CONFIG_WIFI_SSID)
+
+typedef struct {
+  uint16_t attempts;           // Connection attempts in the statistics window
+  uint16_t successes;          // Successful connections (IP received) in the statistics window
+  uint16_t time_to_ip;         // Mean time from esp_wifi_connect() to IP, 100 ms units
+  uint16_t session;            // Mean session duration, minutes
+  uint8_t  rssi;               // Mean RSSI at the time of connection, -dBm
+  bool     changed;
+} wifi_network_stats_t;
+
+static wifi_network_stats_t _wifiNetStats[WIFI_NETWORKS_COUNT];
+static int64_t _wifiConnectStart = 0;
+static int64_t _wifiSessionStart = 0;
+static int64_t _wifiNetStoredAt = 0;
+
+// Exponential moving average with alpha = 1/4, the first sample is taken as is
+static uint16_t wifiNetworkEma(uint16_t average, uint32_t sample, uint16_t limit)
 {
-  #if defined(CONFIG_WIFI_SSID)
-    return (uint8_t)0;
-  #elif defined(CONFIG_WIFI_5_SSID)
-    return (uint8_t)5;
-  #elif defined(CONFIG_WIFI_4_SSID)
-    return (uint8_t)4;
-  #elif defined(CONFIG_WIFI_3_SSID)
-    return (uint8_t)3;
-  #elif defined(CONFIG_WIFI_2_SSID)
-    return (uint8_t)2;
-  #elif defined(CONFIG_WIFI_1_SSID)
-    return (uint8_t)1;
-  #endif
+  if (sample > limit) sample = limit;
+  if (average == 0) return (uint16_t)sample;
+  return (uint16_t)(((uint32_t)average * 3 + sample + 2) / 4);
 }
 
-const char* wifiGetSSID()
+// Compact NVS format: attempts:12 | successes:12 | time_to_ip:12 | session:12 | rssi:8
+static uint64_t wifiNetworkPack(wifi_network_stats_t* stats)
 {
-  #ifdef CONFIG_WIFI_SSID
-    // Single network mode
-    return CONFIG_WIFI_SSID;
-  #else
-    // Multi-network mode
-    switch (_wifiCurrIndex) {
-      case 1: return CONFIG_WIFI_1_SSID;
-      #ifdef CONFIG_WIFI_2_SSID
-      case 2: return CONFIG_WIFI_2_SSID;
-      #endif // CONFIG_WIFI_2_SSID
-      #ifdef CONFIG_WIFI_3_SSID
-      case 3: return CONFIG_WIFI_3_SSID;
-      #endif // CONFIG_WIFI_3_SSID
-      #ifdef CONFIG_WIFI_4_SSID
-      case 4: return CONFIG_WIFI_4_SSID;
-      #endif // CONFIG_WIFI_4_SSID
-      #ifdef CONFIG_WIFI_5_SSID
-      case 5: return CONFIG_WIFI_5_SSID;
-      #endif // CONFIG_WIFI_5_SSID
-      default: return CONFIG_WIFI_1_SSID;
+  return  (uint64_t)(stats->attempts   & 0x0FFF)
+       | ((uint64_t)(stats->successes  & 0x0FFF) << 12)
+       | ((uint64_t)(stats->time_to_ip & 0x0FFF) << 24)
+       | ((uint64_t)(stats->session    & 0x0FFF) << 36)
+       | ((uint64_t)(stats->rssi)                << 48);
+}
+
+static void wifiNetworkLoad()
+{
+  char key[8];
+  for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+    uint64_t packed = 0;
+    snprintf(key, sizeof(key), wifiNvsScores, slot + 1);
+    nvsRead(wifiNvsGroup, key, OPT_TYPE_U64, &packed);
+    _wifiNetStats[slot].attempts   = (uint16_t)(packed & 0x0FFF);
+    _wifiNetStats[slot].successes  = (uint16_t)((packed >> 12) & 0x0FFF);
+    _wifiNetStats[slot].time_to_ip = (uint16_t)((packed >> 24) & 0x0FFF);
+    _wifiNetStats[slot].session    = (uint16_t)((packed >> 36) & 0x0FFF);
+    _wifiNetStats[slot].rssi       = (uint8_t)(packed >> 48);
+    _wifiNetStats[slot].changed    = false;
+  };
+}
+
+static void wifiNetworkStore()
+{
+  char key[8];
+  _wifiNetStoredAt = esp_timer_get_time();
+  for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+    if (_wifiNetStats[slot].changed) {
+      uint64_t packed = wifiNetworkPack(&_wifiNetStats[slot]);
+      snprintf(key, sizeof(key), wifiNvsScores, slot + 1);
+      if (nvsWrite(wifiNvsGroup, key, OPT_TYPE_U64, &packed)) {
+        _wifiNetStats[slot].changed = false;
+      };
     };
-  #endif // CONFIG_WIFI_SSID
+  };
+}
+
+// Network score in the range 0..1
+static float wifiNetworkScore(uint8_t slot)
+{
+  wifi_network_stats_t* stats = &_wifiNetStats[slot];
+  // Success rate with Laplace smoothing, so that an untested network gets 0.5
+  float success = ((float)stats->successes + 1.0f) / ((float)stats->attempts + 2.0f);
+  // The faster the better: 5 seconds gives 0.5
+  float speed = 1.0f / (1.0f + (float)stats->time_to_ip / 50.0f);
+  // The longer the better: 30 minutes gives 0.5
+  float stability = (float)stats->session / ((float)stats->session + 30.0f);
+  // -40 dBm and better gives 1.0, -90 dBm and worse gives 0.0
+  float signal = 0.5f;
+  if (stats->rssi > 0) {
+    signal = (90.0f - (float)stats->rssi) / 50.0f;
+    if (signal < 0.0f) signal = 0.0f;
+    if (signal > 1.0f) signal = 1.0f;
+  };
+  return 0.50f * success + 0.20f * speed + 0.15f * stability + 0.15f * signal;
+}
+
+// Select the network with the best score (UCB1), returns 0 if there is nothing to choose from
+static uint8_t wifiNetworkSelect(uint8_t exclude, bool explore)
+{
+  uint32_t total = 0;
+  for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+    total += _wifiNetStats[slot].attempts;
+  };
+  if (!explore && (total == 0)) {
+    return 0;
+  };
+
+  uint8_t best = 0;
+  float best_value = -1.0f;
+  for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+    if (slot + 1 == exclude) continue;
+    float value = wifiNetworkScore(slot);
+    if (explore) {
+      // Rarely attempted networks get a bonus, so a recovered network will be retried over time
+      value += (float)CONFIG_WIFI_SCORE_EXPLORATION / 100.0f 
+        * sqrtf(logf((float)total + 1.0f) / ((float)_wifiNetStats[slot].attempts + 1.0f));
+    };
+    if (value > best_value) {
+      best_value = value;
+      best = slot + 1;
+    };
+  };
+  return best;
+}
+
+static void wifiNetworkAttempt(uint8_t index)
+{
+  if ((index == 0) || (index > WIFI_NETWORKS_COUNT)) return;
+  wifi_network_stats_t* stats = &_wifiNetStats[index - 1];
+  if (stats->attempts >= CONFIG_WIFI_SCORE_WINDOW) {
+    stats->attempts /= 2;
+    stats->successes /= 2;
+  };
+  stats->attempts++;
+  stats->changed = true;
+  _wifiConnectStart = esp_timer_get_time();
+  _wifiSessionStart = 0;
+}
+
+static void wifiNetworkSuccess(uint8_t index, int8_t rssi)
+{
+  if ((index == 0) || (index > WIFI_NETWORKS_COUNT)) return;
+  wifi_network_stats_t* stats = &_wifiNetStats[index - 1];
+  _wifiSessionStart = esp_timer_get_time();
+  if (stats->successes < stats->attempts) {
+    stats->successes++;
+  };
+  if (_wifiConnectStart > 0) {
+    stats->time_to_ip = wifiNetworkEma(stats->time_to_ip, (uint32_t)((_wifiSessionStart - _wifiConnectStart) / 100000), 0x0FFF);
+    _wifiConnectStart = 0;
+  };
+  if (rssi < 0) {
+    stats->rssi = (uint8_t)wifiNetworkEma(stats->rssi, (uint32_t)(-rssi), 0xFF);
+  };
+  stats->changed = true;
+  wifiNetworkStore();
+}
+
+// The attempt ended without an IP address: the attempt counters are stored with a throttle, so that a long outage does 
+// not wear out the flash, but a series of failures is not lost at reboot
+static void wifiNetworkFailure()
+{
+  if (_wifiConnectStart > 0) {
+    _wifiConnectStart = 0;
+    if ((_wifiNetStoredAt == 0) || (esp_timer_get_time() - _wifiNetStoredAt >= (int64_t)CONFIG_WIFI_SCORE_STORE_INTERVAL * 60000000)) {
+      wifiNetworkStore();
+    };
+  };
+}
+
+static void wifiNetworkSessionEnd(uint8_t index)
+{
+  if ((index == 0) || (index > WIFI_NETWORKS_COUNT) || (_wifiSessionStart == 0)) return;
+  wifi_network_stats_t* stats = &_wifiNetStats[index - 1];
+  uint32_t minutes = (uint32_t)((esp_timer_get_time() - _wifiSessionStart) / 60000000);
+  stats->session = wifiNetworkEma(stats->session, minutes > 0 ? minutes : 1, 0x0FFF);
+  stats->changed = true;
+  _wifiSessionStart = 0;
+}
+
+char* wifiScoresGetJson()
+{
+  char* json = nullptr;
+  for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+    wifi_network_stats_t* stats = &_wifiNetStats[slot];
+    char* item = malloc_stringf("{\"index\":%d,\"attempts\":%d,\"successes\":%d,\"time_to_ip\":%d,\"session\":%d,\"rssi\":%d,\"score\":%d}",
+      slot + 1, stats->attempts, stats->successes, 100 * stats->time_to_ip, stats->session, -(int)stats->rssi, 
+      (int)(wifiNetworkScore(slot) * 1000.0f));
+    if (item) {
+      json = concat_strings_div(json, item, ",");
+      free(item);
+    };
+  };
+  if (json) {
+    char* ret = malloc_stringf("[%s]", json);
+    free(json);
+    return ret;
+  };
+  return nullptr;
+}
+
+#endif // CONFIG_WIFI_NETWORK_SCORING
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Handshake caching -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_PMK_CACHE
+
+// The driver keeps the PMK derived from the password (PBKDF2) and the PMKSA / SAE PMK cache while the configuration
+// is not changed and the driver is not deinitialized. So the configuration is applied only when it actually differs.
+// Key material is not persisted by the library, only the channel of each network (4 bits per network).
+static uint8_t _wifiChannels[WIFI_NETWORKS_COUNT];
+static uint32_t _wifiChannelsStored = 0;
+static bool _wifiConfigCached = false;
+static wifi_handshake_stats_t _wifiHandshakeStats[2];
+
+static void wifiChannelsLoad()
+{
+  nvsRead(wifiNvsGroup, wifiNvsChannels, OPT_TYPE_U32, &_wifiChannelsStored);
+  for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+    _wifiChannels[slot] = (uint8_t)((_wifiChannelsStored >> (4 * slot)) & 0x0F);
+  };
+}
+
+static void wifiChannelsStore(uint8_t channel)
+{
+  if ((channel > 0) && (channel <= 0x0F)) {
+    _wifiChannels[wifiNetworkSlot()] = channel;
+    uint32_t packed = 0;
+    for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+      packed |= (uint32_t)(_wifiChannels[slot] & 0x0F) << (4 * slot);
+    };
+    if (packed != _wifiChannelsStored) {
+      if (nvsWrite(wifiNvsGroup, wifiNvsChannels, OPT_TYPE_U32, &packed)) {
+        _wifiChannelsStored = packed;
+      };
+    };
+  };
+}
+
+static bool wifiConfigEqual(const wifi_sta_config_t* a, const wifi_sta_config_t* b)
+{
+  return (strncmp((const char*)a->ssid, (const char*)b->ssid, sizeof(a->ssid)) == 0)
+      && (strncmp((const char*)a->password, (const char*)b->password, sizeof(a->password)) == 0)
+      && (a->channel == b->channel)
+      && (a->listen_interval == b->listen_interval)
+      && (a->scan_method == b->scan_method)
+      && (a->sort_method == b->sort_method)
+      && (a->pmf_cfg.capable == b->pmf_cfg.capable)
+      && (a->pmf_cfg.required == b->pmf_cfg.required)
+      #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+      && (a->sae_pwe_h2e == b->sae_pwe_h2e)
+      #endif // ESP_IDF_VERSION
+      && (a->rm_enabled == b->rm_enabled);
+}
+
+static esp_err_t wifiConfigApply(wifi_config_t* conf)
+{
+  // Start scanning from the channel where the network was last seen (all channels are still scanned if necessary)
+  if (_wifiChannels[wifiNetworkSlot()] > 0) {
+    conf->sta.channel = _wifiChannels[wifiNetworkSlot()];
+  };
+  #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+    // Hash-to-element: the password element is precomputed once when the configuration is set,
+    // instead of the hunting-and-pecking loop on every SAE commit
+    conf->sta.sae_pwe_h2e = WPA3_SAE_PWE_BOTH;
+  #endif // ESP_IDF_VERSION
+
+  wifi_config_t current;
+  if ((esp_wifi_get_config(WIFI_IF_STA, &current) == ESP_OK) && wifiConfigEqual(&current.sta, &conf->sta)) {
+    _wifiConfigCached = true;
+    return ESP_OK;
+  };
+  _wifiConfigCached = false;
+  return esp_wifi_set_config(WIFI_IF_STA, conf);
+}
+
+static void wifiHandshakeComplete(uint32_t duration, wifi_auth_mode_t authmode)
+{
+  if (duration > 0) {
+    wifi_handshake_stats_t* stats = &_wifiHandshakeStats[_wifiConfigCached ? 1 : 0];
+    stats->count++;
+    stats->last = duration;
+    stats->total += duration;
+    stats->authmode = (uint8_t)authmode;
+    rlog_i(logTAG, "Association and handshake completed in %d ms (auth mode: %d, cached configuration: %d)", duration, authmode, _wifiConfigCached);
+  };
+}
+
+wifi_handshake_stats_t wifiHandshakeStatsGet(bool cached)
+{
+  return _wifiHandshakeStats[cached ? 1 : 0];
+}
+
+#endif // CONFIG_WIFI_PMK_CACHE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Bandwidth selection ------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_BANDWIDTH_AUTO
+
+#ifdef CONFIG_WIFI_BANDWIDTH
+  #define WIFI_BANDWIDTH_INITIAL CONFIG_WIFI_BANDWIDTH
+#else
+  #define WIFI_BANDWIDTH_INITIAL WIFI_BW_HT20
+#endif // CONFIG_WIFI_BANDWIDTH
+
+// Preamble + SIFS + ACK added to each received frame, us
+#define WIFI_BANDWIDTH_OVERHEAD_OFDM 60
+#define WIFI_BANDWIDTH_OVERHEAD_DSSS 500
+
+typedef struct {
+  uint32_t frames;
+  uint32_t retries;
+  uint32_t airtime;               // us
+  uint32_t ap_frames;             // Data frames from the associated AP
+  uint32_t ap_rate;               // Sum of their PHY rates, 100 kbit/s
+  uint32_t ap_retries;            // Retransmitted by the AP, that is, not acknowledged by us
+} wifi_bandwidth_sample_t;
+
+static wifi_bandwidth_stats_t _wifiBwStats[WIFI_NETWORKS_COUNT];
+static uint16_t _wifiBwBefore[WIFI_NETWORKS_COUNT];   // PHY rate before the last change, 0 - no change pending
+static wifi_bandwidth_sample_t _wifiBwSample;
+static uint8_t _wifiBwBssid[6];
+static wifi_ps_type_t _wifiBwPs = WIFI_PS_NONE;
+static esp_timer_handle_t _wifiBwTimer = nullptr;
+static volatile bool _wifiBwSampling = false;
+static bool _wifiBwLoaded = false;
+static bool _wifiBwFresh = false;  // First measurement since the connection
+static uint8_t _wifiBwApRetry = 0;  // Share of frames retransmitted by the AP in the last sample, %
+
+// Legacy rates (wifi_phy_rate_t 0x00..0x0F), 0.5 Mbit/s
+static const uint8_t _wifiBwLegacyRates[16] = { 2, 4, 11, 22, 0, 4, 11, 22, 96, 48, 24, 12, 108, 72, 36, 18 };
+// HT MCS 0..7, one spatial stream, 20 MHz, long GI, 100 kbit/s
+static const uint16_t _wifiBwHtRates[8] = { 65, 130, 195, 260, 390, 520, 585, 650 };
+
+static void wifiBandwidthLoad()
+{
+  if (!_wifiBwLoaded) {
+    uint8_t ht40 = 0;
+    bool stored = nvsRead(wifiNvsGroup, wifiNvsBandwidth, OPT_TYPE_U8, &ht40);
+    for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+      if (stored) {
+        _wifiBwStats[slot].bandwidth = (ht40 & (1 << slot)) ? WIFI_BW_HT40 : WIFI_BW_HT20;
+      } else {
+        _wifiBwStats[slot].bandwidth = WIFI_BANDWIDTH_INITIAL;
+      };
+    };
+    _wifiBwLoaded = true;
+  };
+}
+
+static void wifiBandwidthStore()
+{
+  uint8_t ht40 = 0;
+  for (uint8_t slot = 0; slot < WIFI_NETWORKS_COUNT; slot++) {
+    if (_wifiBwStats[slot].bandwidth == WIFI_BW_HT40) {
+      ht40 |= (1 << slot);
+    };
+  };
+  nvsWrite(wifiNvsGroup, wifiNvsBandwidth, OPT_TYPE_U8, &ht40);
+}
+
+static wifi_bandwidth_t wifiBandwidthSelected()
+{
+  wifiBandwidthLoad();
+  return (wifi_bandwidth_t)_wifiBwStats[wifiNetworkSlot()].bandwidth;
+}
+
+// Called before each connection attempt, since the network may change between attempts
+static void wifiBandwidthRestore()
+{
+  wifi_bandwidth_t bw = wifiBandwidthSelected();
+  esp_err_t err = esp_wifi_set_bandwidth(WIFI_IF_STA, bw);
+  if (err != ESP_OK) {
+    rlog_e(logTAG, "Failed to set the bandwidth: %d (%s)", err, esp_err_to_name(err));
+  };
+}
+
+// PHY rate of the received frame, 100 kbit/s; 0 - unknown modulation
+static uint32_t wifiBandwidthPhyRate(const wifi_pkt_rx_ctrl_t* rx)
+{
+  if (rx->sig_mode == 0) {
+    return (uint32_t)_wifiBwLegacyRates[rx->rate & 0x0F] * 5;
+  } else if (rx->sig_mode == 1) {
+    uint32_t rate = (uint32_t)_wifiBwHtRates[rx->mcs & 0x07] * ((rx->mcs >> 3) + 1);
+    if (rx->cwb) rate = rate * 27 / 13;
+    if (rx->sgi) rate = rate * 10 / 9;
+    return rate;
+  };
+  return 0;
+}
+
+// Runs in the WiFi task: counters only
+static void wifiBandwidthSniffer(void* buf, wifi_promiscuous_pkt_type_t type)
+{
+  const wifi_promiscuous_pkt_t* pkt = (const wifi_promiscuous_pkt_t*)buf;
+  uint32_t len = pkt->rx_ctrl.sig_len;
+  uint32_t rate = wifiBandwidthPhyRate(&pkt->rx_ctrl);
+  _wifiBwSample.frames++;
+  if (rate > 0) {
+    bool dsss = (pkt->rx_ctrl.sig_mode == 0) && ((pkt->rx_ctrl.rate & 0x0F) < 0x08);
+    _wifiBwSample.airtime += len * 80 / rate + (dsss ? WIFI_BANDWIDTH_OVERHEAD_DSSS : WIFI_BANDWIDTH_OVERHEAD_OFDM);
+  };
+  // Frame control: bit 3 of the second byte is the Retry flag; address 2 (transmitter) at offset 10
+  if (len >= 16) {
+    bool retry = (pkt->payload[1] & 0x08) != 0;
+    if (retry) {
+      _wifiBwSample.retries++;
+    };
+    if ((type == WIFI_PKT_DATA) && (rate > 0) && (memcmp(&pkt->payload[10], _wifiBwBssid, sizeof(_wifiBwBssid)) == 0)) {
+      _wifiBwSample.ap_frames++;
+      _wifiBwSample.ap_rate += rate;
+      if (retry) {
+        _wifiBwSample.ap_retries++;
+      };
+    };
+  };
+}
+
+static bool wifiBandwidthSampleStart()
+{
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) return false;
+  memcpy(_wifiBwBssid, ap.bssid, sizeof(_wifiBwBssid));
+  memset(&_wifiBwSample, 0, sizeof(wifi_bandwidth_sample_t));
+  // In power save mode the radio sleeps between beacons and most of the traffic would be missed
+  esp_wifi_get_ps(&_wifiBwPs);
+  esp_wifi_set_ps(WIFI_PS_NONE);
+  wifi_promiscuous_filter_t filter;
+  filter.filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT | WIFI_PROMIS_FILTER_MASK_DATA;
+  esp_wifi_set_promiscuous_filter(&filter);
+  esp_wifi_set_promiscuous_rx_cb(&wifiBandwidthSniffer);
+  esp_err_t err = esp_wifi_set_promiscuous(true);
+  if (err != ESP_OK) {
+    esp_wifi_set_ps(_wifiBwPs);
+    rlog_w(logTAG, "Failed to start channel sampling: %d (%s)", err, esp_err_to_name(err));
+    return false;
+  };
+  _wifiBwSampling = true;
+  return true;
+}
+
+static void wifiBandwidthSampleStop()
+{
+  if (_wifiBwSampling) {
+    esp_wifi_set_promiscuous(false);
+    esp_wifi_set_promiscuous_rx_cb(nullptr);
+    esp_wifi_set_ps(_wifiBwPs);
+    _wifiBwSampling = false;
+  };
+}
+
+// Audible access points whose 20 MHz channel overlaps the 40 MHz pair of the current AP
+static uint8_t wifiBandwidthNeighbors(const wifi_ap_record_t* ap)
+{
+  uint8_t count = 0;
+  #if CONFIG_WIFI_SCAN_ENABLE
+    int lo = ap->primary;
+    int hi = ap->primary;
+    if (ap->second == WIFI_SECOND_CHAN_ABOVE) hi += 4;
+    if (ap->second == WIFI_SECOND_CHAN_BELOW) lo -= 4;
+    wifi_scan_record_t records[CONFIG_WIFI_SCAN_TABLE_SIZE];
+    uint8_t total = wifiScanGetTable(records, CONFIG_WIFI_SCAN_TABLE_SIZE);
+    for (uint8_t i = 0; i < total; i++) {
+      if ((records[i].rssi >= -82) && ((int)records[i].channel > lo - 4) && ((int)records[i].channel < hi + 4)
+       && (memcmp(records[i].bssid, ap->bssid, sizeof(ap->bssid)) != 0)) {
+        count++;
+      };
+    };
+  #endif // CONFIG_WIFI_SCAN_ENABLE
+  return count;
+}
+
+static void wifiBandwidthDecide()
+{
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) return;
+  wifiBandwidthLoad();
+  uint8_t slot = wifiNetworkSlot();
+  wifi_bandwidth_stats_t* stats = &_wifiBwStats[slot];
+  uint32_t window = CONFIG_WIFI_BANDWIDTH_SAMPLE * 1000;
+  stats->busy = _wifiBwSample.airtime >= window ? 100 : (uint8_t)(_wifiBwSample.airtime * 100 / window);
+  stats->retry = _wifiBwSample.frames > 0 ? (uint8_t)(_wifiBwSample.retries * 100 / _wifiBwSample.frames) : 0;
+  stats->rate = _wifiBwSample.ap_frames > 0 ? (uint16_t)(_wifiBwSample.ap_rate / _wifiBwSample.ap_frames) : 0;
+  _wifiBwApRetry = _wifiBwSample.ap_frames > 0 ? (uint8_t)(_wifiBwSample.ap_retries * 100 / _wifiBwSample.ap_frames) : 0;
+  stats->neighbors = wifiBandwidthNeighbors(&ap);
+  stats->measured = (uint32_t)(esp_timer_get_time() / 1000000);
+  rlog_d(logTAG, "Channel %d: busy %d%%, retry %d%%, neighbors %d, PHY rate %d.%d Mbit/s (%d frames)",
+    ap.primary, stats->busy, stats->retry, stats->neighbors, stats->rate / 10, stats->rate % 10, _wifiBwSample.frames);
+
+  // The first measurement after the reassociation shows the result of the previous change
+  if (_wifiBwFresh && (_wifiBwBefore[slot] > 0)) {
+    rlog_i(logTAG, "WiFi bandwidth %s in effect: PHY rate %d.%d Mbit/s, before the change %d.%d Mbit/s",
+      stats->bandwidth == WIFI_BW_HT40 ? "HT40" : "HT20",
+      stats->rate / 10, stats->rate % 10, _wifiBwBefore[slot] / 10, _wifiBwBefore[slot] % 10);
+    _wifiBwBefore[slot] = 0;
+  };
+  _wifiBwFresh = false;
+
+  // HT20 <-> HT40 with hysteresis; HT40 makes no sense if the AP does not use a secondary channel.
+  // While associated at HT20, 40 MHz frames of other stations are not decoded, so the busy time is underestimated:
+  // this is compensated by the neighbors count from the scan table
+  wifi_bandwidth_t next = (wifi_bandwidth_t)stats->bandwidth;
+  if (ap.second == WIFI_SECOND_CHAN_NONE) {
+    next = WIFI_BW_HT20;
+  } else if (next == WIFI_BW_HT40) {
+    if ((stats->busy > CONFIG_WIFI_BANDWIDTH_BUSY_HIGH) || (stats->retry > CONFIG_WIFI_BANDWIDTH_RETRY_HIGH)
+     || (stats->neighbors > CONFIG_WIFI_BANDWIDTH_NEIGHBORS)) {
+      next = WIFI_BW_HT20;
+    };
+  } else {
+    if ((stats->busy < CONFIG_WIFI_BANDWIDTH_BUSY_LOW) && (stats->retry < CONFIG_WIFI_BANDWIDTH_RETRY_LOW)
+     && (stats->neighbors < CONFIG_WIFI_BANDWIDTH_NEIGHBORS)) {
+      next = WIFI_BW_HT40;
+    };
+  };
+  if (next == stats->bandwidth) return;
+
+  rlog_i(logTAG, "WiFi bandwidth changed: %s -> %s (busy %d%%, retry %d%%, neighbors %d), PHY rate before the change %d.%d Mbit/s",
+    stats->bandwidth == WIFI_BW_HT40 ? "HT40" : "HT20", next == WIFI_BW_HT40 ? "HT40" : "HT20",
+    stats->busy, stats->retry, stats->neighbors, stats->rate / 10, stats->rate % 10);
+  stats->bandwidth = next;
+  stats->changes++;
+  _wifiBwBefore[slot] = stats->rate > 0 ? stats->rate : 1;
+  wifiBandwidthStore();
+  // The bandwidth is negotiated during association
+  esp_wifi_set_bandwidth(WIFI_IF_STA, next);
+  #if CONFIG_WIFI_BANDWIDTH_REASSOC
+    esp_wifi_disconnect();
+  #endif // CONFIG_WIFI_BANDWIDTH_REASSOC
+}
+
+static void wifiBandwidthSchedule(uint32_t delay_ms);
+
+static void wifiBandwidthTimerEnd(void* arg)
+{
+  if (_wifiBwSampling) {
+    wifiBandwidthSampleStop();
+    wifiBandwidthDecide();
+    wifiBandwidthSchedule(CONFIG_WIFI_BANDWIDTH_INTERVAL * 1000);
+  } else if (wifiStatusCheck(_WIFI_STA_GOT_IP, false)) {
+    wifiBandwidthSchedule(wifiBandwidthSampleStart() ? CONFIG_WIFI_BANDWIDTH_SAMPLE : CONFIG_WIFI_BANDWIDTH_INTERVAL * 1000);
+  };
+}
+
+static void wifiBandwidthSchedule(uint32_t delay_ms)
+{
+  if (!_wifiBwTimer) {
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+    timer_args.callback = &wifiBandwidthTimerEnd;
+    timer_args.name = "timer_wifi_bw";
+    if (esp_timer_create(&timer_args, &_wifiBwTimer) != ESP_OK) {
+      rlog_e(logTAG, "Failed to create bandwidth timer");
+      return;
+    };
+  };
+  if (esp_timer_is_active(_wifiBwTimer)) {
+    esp_timer_stop(_wifiBwTimer);
+  };
+  esp_timer_start_once(_wifiBwTimer, (uint64_t)delay_ms * 1000);
+}
+
+// Called when IP is received
+static void wifiBandwidthConnected()
+{
+  _wifiBwFresh = true;
+  wifiBandwidthSchedule(CONFIG_WIFI_BANDWIDTH_SETTLE * 1000);
+}
+
+// Called when the connection is lost or STA is stopped
+static void wifiBandwidthCancel()
+{
+  if (_wifiBwTimer && esp_timer_is_active(_wifiBwTimer)) {
+    esp_timer_stop(_wifiBwTimer);
+  };
+  wifiBandwidthSampleStop();
+}
+
+static void wifiBandwidthDelete()
+{
+  wifiBandwidthCancel();
+  if (_wifiBwTimer) {
+    esp_timer_delete(_wifiBwTimer);
+    _wifiBwTimer = nullptr;
+  };
+}
+
+bool wifiBandwidthMeasure()
+{
+  if (!wifiStatusCheck(_WIFI_STA_GOT_IP, false) || _wifiBwSampling) return false;
+  wifiBandwidthSchedule(1);
+  return true;
+}
+
+wifi_bandwidth_stats_t wifiBandwidthStatsGet(uint8_t index)
+{
+  wifiBandwidthLoad();
+  if ((index > 0) && (index <= WIFI_NETWORKS_COUNT)) {
+    return _wifiBwStats[index - 1];
+  };
+  return _wifiBwStats[wifiNetworkSlot()];
+}
+
+#endif // CONFIG_WIFI_BANDWIDTH_AUTO
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Signal strength ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// One moving average of RSSI (alpha 1/16) for all consumers: Long Range fallback, TX power control, link quality and 
+// telemetry. Samples closer than WIFI_RSSI_SAMPLE_PERIOD are not added, so the smoothing does not depend on how many
+// consumers query the signal and how often
+
+#define WIFI_RSSI_SAMPLE_PERIOD 1000000   // us
+
+static int16_t _wifiRssiAvg = 0;          // RSSI * 16
+static int64_t _wifiRssiSampled = 0;      // Time of the last sample added to the average, 0 - no samples in the current connection
+static portMUX_TYPE _wifiRssiLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Adds the RSSI received from the driver
+static void wifiRssiPut(int8_t rssi)
+{
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&_wifiRssiLock);
+  _wifiLastRssi = rssi;
+  #if CONFIG_WIFI_TELEMETRY
+    // Minimum and maximum of RSSI are calculated between telemetry snapshots
+    if ((_wifiRssiSampled == 0) || (rssi < _wifiRssiMin)) _wifiRssiMin = rssi;
+    if ((_wifiRssiSampled == 0) || (rssi > _wifiRssiMax)) _wifiRssiMax = rssi;
+  #endif // CONFIG_WIFI_TELEMETRY
+  if (_wifiRssiSampled == 0) {
+    _wifiRssiAvg = (int16_t)(rssi * 16);
+    _wifiRssiSampled = now;
+  } else if (now - _wifiRssiSampled >= WIFI_RSSI_SAMPLE_PERIOD) {
+    _wifiRssiAvg = (int16_t)(_wifiRssiAvg + rssi - _wifiRssiAvg / 16);
+    _wifiRssiSampled = now;
+  };
+  portEXIT_CRITICAL(&_wifiRssiLock);
+}
+
+// Called when a connection is established: the average starts over for each connection
+static void wifiRssiReset()
+{
+  portENTER_CRITICAL(&_wifiRssiLock);
+  _wifiRssiSampled = 0;
+  portEXIT_CRITICAL(&_wifiRssiLock);
+}
+
+#if CONFIG_WIFI_LONGRANGE_AUTO || CONFIG_WIFI_TXPOWER_AUTO || CONFIG_WIFI_LINK_SCORE
+
+// Returns the smoothed RSSI, dBm, the driver is queried only if the last sample is older than WIFI_RSSI_SAMPLE_PERIOD
+static bool wifiRssiSmoothed(int8_t* rssi)
+{
+  if ((_wifiRssiSampled == 0) || (esp_timer_get_time() - _wifiRssiSampled >= WIFI_RSSI_SAMPLE_PERIOD)) {
+    int value = 0;
+    if (esp_wifi_sta_get_rssi(&value) == ESP_OK) {
+      wifiRssiPut((int8_t)value);
+    };
+  };
+  if (_wifiRssiSampled == 0) return false;
+  *rssi = (int8_t)(_wifiRssiAvg / 16);
+  return true;
+}
+
+#endif // CONFIG_WIFI_LONGRANGE_AUTO || CONFIG_WIFI_TXPOWER_AUTO || CONFIG_WIFI_LINK_SCORE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------- Long Range fallback -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_LONGRANGE_AUTO
+
+#define WIFI_LONGRANGE_PROTOCOL_BGN (WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N)
+
+static bool _wifiLrActive = false;
+static uint16_t _wifiLrSuccess = 10000;  // Share of successful attempts, % * 100
+static uint16_t _wifiLrSwitches = 0;
+static uint64_t _wifiLrTime[2];          // us, [0] - 11b/g/n, [1] - LR
+static int64_t _wifiLrSince = 0;
+static int64_t _wifiLrChanged = 0;
+static bool _wifiLrCapable[WIFI_NETWORKS_COUNT];
+static esp_timer_handle_t _wifiLrTimer = nullptr;
+
+static void wifiLongRangeAccount()
+{
+  int64_t now = esp_timer_get_time();
+  if (_wifiLrSince > 0) {
+    _wifiLrTime[_wifiLrActive ? 1 : 0] += now - _wifiLrSince;
+  };
+  _wifiLrSince = now;
+}
+
+static uint8_t wifiLongRangeProtocol()
+{
+  return _wifiLrActive ? WIFI_PROTOCOL_LR : WIFI_LONGRANGE_PROTOCOL_BGN;
+}
+
+// LR is Espressif proprietary mode: only another ESP32 in LR mode can serve as the AP
+static bool wifiLongRangeCapable()
+{
+  uint8_t slot = wifiNetworkSlot();
+  #if CONFIG_WIFI_SCAN_ENABLE
+    wifi_scan_record_t record;
+    if (wifiScanFind(wifiGetSSID(), &record)) {
+      _wifiLrCapable[slot] = record.phy_lr;
+    };
+  #endif // CONFIG_WIFI_SCAN_ENABLE
+  return _wifiLrCapable[slot];
+}
+
+static bool wifiLongRangeSwitch(bool active, const char* cause)
+{
+  if (active == _wifiLrActive) return false;
+  // Hysteresis in time: the previous switch should have had a chance to show its result
+  int64_t now = esp_timer_get_time();
+  if ((_wifiLrChanged > 0) && (now - _wifiLrChanged < (int64_t)CONFIG_WIFI_LONGRANGE_MIN_TIME * 1000000)) return false;
+  _wifiLrChanged = now;
+  wifiLongRangeAccount();
+  _wifiLrActive = active;
+  _wifiLrSwitches++;
+  rlog_w(logTAG, "WiFi protocol changed to %s: %s (RSSI %d dBm, success %d%%)",
+    active ? "Long Range" : "11b/g/n", cause, _wifiRssiAvg / 16, _wifiLrSuccess / 100);
+  return true;
+}
+
+// Called before each connection attempt
+static void wifiLongRangeRestore()
+{
+  if (_wifiLrSince == 0) {
+    _wifiLrSince = esp_timer_get_time();
+  };
+  // Another network of the list may not support LR
+  if (_wifiLrActive && !wifiLongRangeCapable()) {
+    wifiLongRangeSwitch(false, "AP is not LR-capable");
+  };
+  esp_err_t err = esp_wifi_set_protocol(WIFI_IF_STA, wifiLongRangeProtocol());
+  if (err != ESP_OK) {
+    rlog_e(logTAG, "Failed to set protocol: %d (%s)", err, esp_err_to_name(err));
+  };
+}
+
+// Result of the connection attempt: true - IP received, false - attempt failed
+static void wifiLongRangeAttempt(bool success)
+{
+  _wifiLrSuccess = (uint16_t)(((uint32_t)_wifiLrSuccess * 7 + (success ? 10000 : 0)) / 8);
+  if (!success && (_wifiLrSuccess < CONFIG_WIFI_LONGRANGE_SUCCESS_LOW * 100)) {
+    if (!_wifiLrActive && wifiLongRangeCapable()) {
+      // Takes effect at the next attempt
+      if (wifiLongRangeSwitch(true, "connection attempts fail")) {
+        _wifiLrSuccess = 10000;
+      };
+    } else if (_wifiLrActive) {
+      if (wifiLongRangeSwitch(false, "connection attempts fail")) {
+        _wifiLrSuccess = 10000;
+      };
+    };
+  };
+}
+
+static void wifiLongRangeTimerEnd(void* arg)
+{
+  if (!wifiStatusCheck(_WIFI_STA_GOT_IP, false)) return;
+  int8_t rssi = 0;
+  if (!wifiRssiSmoothed(&rssi)) return;
+  // Protocol is negotiated during association, so the switch requires reconnection
+  bool changed = false;
+  if (!_wifiLrActive && (rssi < CONFIG_WIFI_LONGRANGE_RSSI_LOW) && wifiLongRangeCapable()) {
+    changed = wifiLongRangeSwitch(true, "weak signal");
+  } else if (_wifiLrActive && (rssi > CONFIG_WIFI_LONGRANGE_RSSI_HIGH)) {
+    changed = wifiLongRangeSwitch(false, "signal recovered");
+  };
+  if (changed) {
+    esp_wifi_disconnect();
+  };
+}
+
+// Called when IP is received
+static void wifiLongRangeConnected()
+{
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+    _wifiLrCapable[wifiNetworkSlot()] = ap.phy_lr;
+  };
+  wifiLongRangeAttempt(true);
+  if (!_wifiLrTimer) {
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+    timer_args.callback = &wifiLongRangeTimerEnd;
+    timer_args.name = "timer_wifi_lr";
+    if (esp_timer_create(&timer_args, &_wifiLrTimer) != ESP_OK) {
+      rlog_e(logTAG, "Failed to create Long Range timer");
+      return;
+    };
+  };
+  if (!esp_timer_is_active(_wifiLrTimer)) {
+    esp_timer_start_periodic(_wifiLrTimer, (uint64_t)CONFIG_WIFI_LONGRANGE_CHECK_INTERVAL * 1000000);
+  };
+}
+
+static void wifiLongRangeCancel()
+{
+  if (_wifiLrTimer && esp_timer_is_active(_wifiLrTimer)) {
+    esp_timer_stop(_wifiLrTimer);
+  };
+}
+
+static void wifiLongRangeDelete()
+{
+  wifiLongRangeCancel();
+  if (_wifiLrTimer) {
+    esp_timer_delete(_wifiLrTimer);
+    _wifiLrTimer = nullptr;
+  };
+}
+
+wifi_longrange_stats_t wifiLongRangeStatsGet()
+{
+  wifiLongRangeAccount();
+  wifi_longrange_stats_t stats;
+  stats.active = _wifiLrActive;
+  stats.rssi = (int8_t)(_wifiRssiAvg / 16);
+  stats.success = (uint8_t)(_wifiLrSuccess / 100);
+  stats.switches = _wifiLrSwitches;
+  stats.time_bgn = (uint32_t)(_wifiLrTime[0] / 1000000);
+  stats.time_lr = (uint32_t)(_wifiLrTime[1] / 1000000);
+  return stats;
+}
+
+#endif // CONFIG_WIFI_LONGRANGE_AUTO
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- TX power control -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_TXPOWER_AUTO
+
+static int8_t _wifiTxCeiling = CONFIG_WIFI_TXPOWER_MAX;   // Maximum of the active profile
+static int8_t _wifiTxPower = CONFIG_WIFI_TXPOWER_MAX;     // Current level, 0.25 dBm
+static int8_t _wifiTxMargin = 0;
+static uint8_t _wifiTxHealthy = 0;                        // Consecutive checks with a large margin
+static uint16_t _wifiTxChanges = 0;
+static uint64_t _wifiTxTime[WIFI_TXPOWER_LEVELS];         // us
+static int64_t _wifiTxSince = 0;
+static esp_timer_handle_t _wifiTxTimer = nullptr;
+
+static uint8_t wifiTxPowerLevel(int8_t power)
+{
+  int level = (power - 8) / 8;
+  return level < 0 ? 0 : (level >= WIFI_TXPOWER_LEVELS ? WIFI_TXPOWER_LEVELS - 1 : level);
+}
+
+static void wifiTxPowerAccount()
+{
+  int64_t now = esp_timer_get_time();
+  if (_wifiTxSince > 0) {
+    _wifiTxTime[wifiTxPowerLevel(_wifiTxPower)] += now - _wifiTxSince;
+  };
+  _wifiTxSince = now;
+}
+
+static void wifiTxPowerApply(int8_t power)
+{
+  wifiTxPowerAccount();
+  esp_err_t err = esp_wifi_set_max_tx_power(power);
+  if (err == ESP_OK) {
+    if (power != _wifiTxPower) {
+      rlog_d(logTAG, "WiFi TX power changed: %.2f -> %.2f dBm (margin %d dB)", _wifiTxPower / 4.0, power / 4.0, _wifiTxMargin);
+      _wifiTxChanges++;
+    };
+    _wifiTxPower = power;
+  } else {
+    rlog_e(logTAG, "Failed to set maximum TX power: %d (%s)", err, esp_err_to_name(err));
+  };
+}
+
+// Sets the maximum of the active profile and returns the level to be applied
+static int8_t wifiTxPowerLimit(int8_t ceiling)
+{
+  wifiTxPowerAccount();
+  _wifiTxCeiling = ceiling;
+  if (_wifiTxPower > ceiling) {
+    _wifiTxPower = ceiling;
+  };
+  return _wifiTxPower;
+}
+
+// Called from the WIFI_EVENT_STA_START handler: TX power can only be set after STA is started
+static void wifiTxPowerRestore()
+{
+  wifiTxPowerApply(_wifiTxPower);
+}
+
+static void wifiTxPowerTimerEnd(void* arg)
+{
+  if (!wifiStatusCheck(_WIFI_STA_GOT_IP, false)) return;
+  int8_t rssi = 0;
+  if (!wifiRssiSmoothed(&rssi)) return;
+  // Only the downlink is measured: assuming a symmetric path, the uplink margin is reduced by the TX power reduction
+  int margin = rssi + _wifiRssiThreshold - (_wifiTxCeiling - _wifiTxPower) / 4;
+  _wifiTxMargin = (int8_t)(margin < -128 ? -128 : (margin > 127 ? 127 : margin));
+  #if CONFIG_WIFI_BANDWIDTH_AUTO
+    bool retries = _wifiBwApRetry > CONFIG_WIFI_TXPOWER_RETRY_HIGH;
+  #else
+    bool retries = false;
+  #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+  if ((margin < CONFIG_WIFI_TXPOWER_MARGIN_LOW) || retries) {
+    // Degradation: up quickly, 4 dB per check
+    _wifiTxHealthy = 0;
+    if (_wifiTxPower < _wifiTxCeiling) {
+      wifiTxPowerApply(_wifiTxPower + 16 < _wifiTxCeiling ? _wifiTxPower + 16 : _wifiTxCeiling);
+    };
+  } else if (margin > CONFIG_WIFI_TXPOWER_MARGIN_HIGH) {
+    // Healthy link: down slowly, 1 dB per three checks
+    if ((++_wifiTxHealthy >= 3) && (_wifiTxPower > CONFIG_WIFI_TXPOWER_MIN)) {
+      _wifiTxHealthy = 0;
+      wifiTxPowerApply(_wifiTxPower - 4 > CONFIG_WIFI_TXPOWER_MIN ? _wifiTxPower - 4 : CONFIG_WIFI_TXPOWER_MIN);
+    };
+  } else {
+    _wifiTxHealthy = 0;
+  };
+}
+
+// Called when IP is received
+static void wifiTxPowerConnected()
+{
+  _wifiTxHealthy = 0;
+  if (!_wifiTxTimer) {
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+    timer_args.callback = &wifiTxPowerTimerEnd;
+    timer_args.name = "timer_wifi_txp";
+    if (esp_timer_create(&timer_args, &_wifiTxTimer) != ESP_OK) {
+      rlog_e(logTAG, "Failed to create TX power timer");
+      return;
+    };
+  };
+  if (!esp_timer_is_active(_wifiTxTimer)) {
+    esp_timer_start_periodic(_wifiTxTimer, (uint64_t)CONFIG_WIFI_TXPOWER_INTERVAL * 1000000);
+  };
+}
+
+// Called when the connection is lost or STA is stopped: the next connection attempt is made at the maximum power
+static void wifiTxPowerCancel(bool started)
+{
+  if (_wifiTxTimer && esp_timer_is_active(_wifiTxTimer)) {
+    esp_timer_stop(_wifiTxTimer);
+  };
+  if (_wifiTxPower < _wifiTxCeiling) {
+    if (started) {
+      wifiTxPowerApply(_wifiTxCeiling);
+    } else {
+      // STA is stopped: the level is applied by wifiTxPowerRestore() or wifiProfileApply() at the next start
+      wifiTxPowerAccount();
+      _wifiTxPower = _wifiTxCeiling;
+    };
+  };
+}
+
+static void wifiTxPowerDelete()
+{
+  wifiTxPowerCancel(false);
+  if (_wifiTxTimer) {
+    esp_timer_delete(_wifiTxTimer);
+    _wifiTxTimer = nullptr;
+  };
+}
+
+wifi_txpower_stats_t wifiTxPowerStatsGet()
+{
+  wifiTxPowerAccount();
+  wifi_txpower_stats_t stats;
+  memset(&stats, 0, sizeof(wifi_txpower_stats_t));
+  stats.power = _wifiTxPower;
+  stats.margin = _wifiTxMargin;
+  stats.changes = _wifiTxChanges;
+  // TX current is estimated by a linear fit of ESP32 datasheet values: about 120 mA + 6 mA per dBm
+  double saved = 0;
+  for (uint8_t i = 0; i < WIFI_TXPOWER_LEVELS; i++) {
+    stats.time[i] = (uint32_t)(_wifiTxTime[i] / 1000000);
+    double dbm = 3.0 + 2.0 * i;
+    double delta = 6.0 * (CONFIG_WIFI_TXPOWER_MAX / 4.0 - dbm);
+    if (delta > 0) {
+      saved += delta * (_wifiTxTime[i] / 1000000.0);
+    };
+  };
+  // mA * s -> uAh
+  stats.saved = (uint32_t)(saved * CONFIG_WIFI_TXPOWER_DUTY / 100.0 * 1000.0 / 3600.0);
+  return stats;
+}
+
+#endif // CONFIG_WIFI_TXPOWER_AUTO
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------- Performance profiles ------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_PROFILES
+
+#ifndef CONFIG_WIFI_PROFILE_DEFAULT
+  #define CONFIG_WIFI_PROFILE_DEFAULT WIFI_PROFILE_BALANCED
+#endif
+// 1 - reassociate when the bandwidth or protocol of the profile differs from the current one, 0 - they take effect at 
+// the next connection
+#ifndef CONFIG_WIFI_PROFILE_REASSOC
+  #define CONFIG_WIFI_PROFILE_REASSOC 0
+#endif
+#ifdef CONFIG_WIFI_LONGRANGE
+  #define WIFI_PROFILE_PROTOCOL WIFI_PROTOCOL_LR
+#else
+  #define WIFI_PROFILE_PROTOCOL (WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N)
+#endif // CONFIG_WIFI_LONGRANGE
+#ifdef CONFIG_WIFI_BANDWIDTH
+  #define WIFI_PROFILE_BANDWIDTH CONFIG_WIFI_BANDWIDTH
+#else
+  #define WIFI_PROFILE_BANDWIDTH WIFI_BW_HT20
+#endif // CONFIG_WIFI_BANDWIDTH
+
+static wifi_profile_config_t _wifiProfiles[WIFI_PROFILE_MAX] = {
+  // ps                 listen  bandwidth               protocol                max_tx_power  inactive_time
+  { WIFI_PS_MAX_MODEM,  10,     WIFI_BW_HT20,           WIFI_PROFILE_PROTOCOL,  60,           10 },  // LowPower: 15 dBm
+  { WIFI_PS_MIN_MODEM,  3,      WIFI_PROFILE_BANDWIDTH, WIFI_PROFILE_PROTOCOL,  78,           6 },   // Balanced: 19.5 dBm
+  { WIFI_PS_NONE,       3,      WIFI_BW_HT40,           WIFI_PROFILE_PROTOCOL,  84,           6 }    // Throughput: 21 dBm
+};
+static wifi_profile_t _wifiProfile = CONFIG_WIFI_PROFILE_DEFAULT;
+static uint64_t _wifiProfileTime[WIFI_PROFILE_MAX];
+static int64_t _wifiProfileSince = 0;
+
+static const char* wifiProfileName(wifi_profile_t profile)
+{
+  switch (profile) {
+    case WIFI_PROFILE_LOW_POWER:  return "low_power";
+    case WIFI_PROFILE_BALANCED:   return "balanced";
+    case WIFI_PROFILE_THROUGHPUT: return "throughput";
+    default:                      return "?";
+  };
+}
+
+static void wifiProfileAccount()
+{
+  int64_t now = esp_timer_get_time();
+  if (_wifiProfileSince > 0) {
+    _wifiProfileTime[_wifiProfile] += now - _wifiProfileSince;
+  };
+  _wifiProfileSince = now;
+}
+
+// All parameters are applied or none: on error, the already changed ones are returned to their previous values.
+// PS mode and TX power act immediately, bandwidth and protocol are negotiated during association
+static bool wifiProfileApply(const wifi_profile_config_t* cfg)
+{
+  wifi_ps_type_t old_ps;
+  wifi_bandwidth_t old_bw;
+  uint8_t old_protocol;
+  int8_t old_power;
+  WIFI_ERROR_CHECK_BOOL(esp_wifi_get_ps(&old_ps), "get power save mode");
+  WIFI_ERROR_CHECK_BOOL(esp_wifi_get_bandwidth(WIFI_IF_STA, &old_bw), "get bandwidth");
+  WIFI_ERROR_CHECK_BOOL(esp_wifi_get_protocol(WIFI_IF_STA, &old_protocol), "get protocol");
+  WIFI_ERROR_CHECK_BOOL(esp_wifi_get_max_tx_power(&old_power), "get maximum TX power");
+  // The inactive time is set last, so it never has to be rolled back
+
+  // With automatic selection the bandwidth of the profile is ignored
+  #if CONFIG_WIFI_BANDWIDTH_AUTO
+    wifi_bandwidth_t bandwidth = wifiBandwidthSelected();
+  #else
+    wifi_bandwidth_t bandwidth = cfg->bandwidth;
+  #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+
+  // With automatic fallback the protocol of the profile is ignored
+  #if CONFIG_WIFI_LONGRANGE_AUTO
+    uint8_t protocol = wifiLongRangeProtocol();
+  #else
+    uint8_t protocol = cfg->protocol;
+  #endif // CONFIG_WIFI_LONGRANGE_AUTO
+
+  // With automatic control the maximum TX power of the profile is the upper limit
+  #if CONFIG_WIFI_TXPOWER_AUTO
+    int8_t old_ceiling = _wifiTxCeiling;
+    int8_t old_level = _wifiTxPower;
+    int8_t power = wifiTxPowerLimit(cfg->max_tx_power);
+  #else
+    int8_t power = cfg->max_tx_power;
+  #endif // CONFIG_WIFI_TXPOWER_AUTO
+
+  // The channel sampler keeps the radio awake and restores the saved PS mode when it stops, so the new mode is saved there
+  #if CONFIG_WIFI_BANDWIDTH_AUTO
+    wifi_ps_type_t old_bw_ps = _wifiBwPs;
+    bool sampling = _wifiBwSampling;
+  #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+
+  uint8_t step = 0;
+  esp_err_t err = esp_wifi_set_protocol(WIFI_IF_STA, protocol);
+  if (err == ESP_OK) { step++; err = esp_wifi_set_bandwidth(WIFI_IF_STA, bandwidth); };
+  if (err == ESP_OK) { 
+    step++; 
+    #if CONFIG_WIFI_BANDWIDTH_AUTO
+      if (sampling) {
+        _wifiBwPs = cfg->ps;
+      } else {
+        err = esp_wifi_set_ps(cfg->ps);
+      };
+    #else
+      err = esp_wifi_set_ps(cfg->ps);
+    #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+  };
+  if (err == ESP_OK) { step++; err = esp_wifi_set_max_tx_power(power); };
+  #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    if (err == ESP_OK) { step++; err = esp_wifi_set_inactive_time(WIFI_IF_STA, cfg->inactive_time); };
+  #endif // ESP_IDF_VERSION
+  if (err == ESP_OK) {
+    #if CONFIG_WIFI_PROFILE_REASSOC
+      if (((bandwidth != old_bw) || (protocol != old_protocol)) && wifiStatusCheck(_WIFI_STA_CONNECTED, false)) {
+        rlog_i(logTAG, "WiFi profile: bandwidth or protocol changed, reassociation");
+        esp_wifi_disconnect();
+      };
+    #endif // CONFIG_WIFI_PROFILE_REASSOC
+    return true;
+  };
+
+  rlog_e(logTAG, "Failed to apply WiFi profile at step %d: %d (%s), rollback", step, err, esp_err_to_name(err));
+  switch (step) {
+    case 4: esp_wifi_set_max_tx_power(old_power);             // fall through
+    case 3: esp_wifi_set_ps(old_ps);                          // fall through
+    case 2: esp_wifi_set_bandwidth(WIFI_IF_STA, old_bw);      // fall through
+    case 1: esp_wifi_set_protocol(WIFI_IF_STA, old_protocol); // fall through
+    default: break;
+  };
+  #if CONFIG_WIFI_TXPOWER_AUTO
+    _wifiTxCeiling = old_ceiling;
+    _wifiTxPower = old_level;
+  #endif // CONFIG_WIFI_TXPOWER_AUTO
+  #if CONFIG_WIFI_BANDWIDTH_AUTO
+    _wifiBwPs = old_bw_ps;
+  #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+  return false;
+}
+
+// Called from the WIFI_EVENT_STA_START handler: TX power and protocol can only be set after STA is started
+static void wifiProfileRestore()
+{
+  if (wifiProfileApply(&_wifiProfiles[_wifiProfile])) {
+    rlog_d(logTAG, "WiFi profile [ %s ] applied", wifiProfileName(_wifiProfile));
+  };
+}
+
+bool wifiProfileSet(wifi_profile_t profile)
+{
+  if (profile >= WIFI_PROFILE_MAX) return false;
+  if (profile == _wifiProfile) return true;
+  // STA is not started, the profile will be applied at start
+  if (wifiStatusCheck(_WIFI_STA_STARTED, false)) {
+    if (!wifiProfileApply(&_wifiProfiles[profile])) {
+      return false;
+    };
+  };
+  wifiProfileAccount();
+  rlog_i(logTAG, "WiFi profile changed: %s -> %s", wifiProfileName(_wifiProfile), wifiProfileName(profile));
+  _wifiProfile = profile;
+  return true;
+}
+
+wifi_profile_t wifiProfileGet()
+{
+  return _wifiProfile;
+}
+
+bool wifiProfileConfigSet(wifi_profile_t profile, const wifi_profile_config_t* config)
+{
+  if ((profile >= WIFI_PROFILE_MAX) || !config) return false;
+  if ((profile == _wifiProfile) && wifiStatusCheck(_WIFI_STA_STARTED, false)) {
+    if (!wifiProfileApply(config)) {
+      return false;
+    };
+  };
+  _wifiProfiles[profile] = *config;
+  return true;
+}
+
+wifi_profile_config_t wifiProfileConfigGet(wifi_profile_t profile)
+{
+  return _wifiProfiles[profile < WIFI_PROFILE_MAX ? profile : CONFIG_WIFI_PROFILE_DEFAULT];
+}
+
+uint32_t wifiProfileTimeGet(wifi_profile_t profile)
+{
+  if (profile >= WIFI_PROFILE_MAX) return 0;
+  wifiProfileAccount();
+  return (uint32_t)(_wifiProfileTime[profile] / 1000000);
+}
+
+#endif // CONFIG_WIFI_PROFILES
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Statistics -------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_STATS
+
+#define WIFI_STATS_ENTRIES (7 + WIFI_REASON_CAT_MAX)
+
+// Attempts and connections are counted by _wifiAttemptTotal / _wifiConnectTotal, online time by the availability
+static wifi_stats_t _wifiStats;                   // Updated by the handlers
+static wifi_stats_t _wifiStatsPublished;          // Snapshot registered in the parameters
+static uint64_t _wifiStatsIpTotal = 0;            // ms
+static int64_t _wifiStatsAttemptAt = 0;
+static uint8_t _wifiStatsBssid[6];
+static portMUX_TYPE _wifiStatsLock = portMUX_INITIALIZER_UNLOCKED;
+static paramsEntryHandle_t _wifiStatsEntries[WIFI_STATS_ENTRIES];
+static esp_timer_handle_t _wifiStatsTimer = nullptr;
+
+static void wifiStatsAttempt()
+{
+  portENTER_CRITICAL(&_wifiStatsLock);
+  _wifiStatsAttemptAt = esp_timer_get_time();
+  portEXIT_CRITICAL(&_wifiStatsLock);
+}
+
+static void wifiStatsRestart()
+{
+  portENTER_CRITICAL(&_wifiStatsLock);
+  _wifiStats.restarts++;
+  portEXIT_CRITICAL(&_wifiStatsLock);
+}
+
+static void wifiStatsConnected()
+{
+  wifi_ap_record_t ap;
+  bool roam = false;
+  if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+    static const uint8_t none[6] = { 0 };
+    roam = (memcmp(_wifiStatsBssid, none, sizeof(none)) != 0) && (memcmp(_wifiStatsBssid, ap.bssid, sizeof(_wifiStatsBssid)) != 0);
+    memcpy(_wifiStatsBssid, ap.bssid, sizeof(_wifiStatsBssid));
+  };
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&_wifiStatsLock);
+  if (roam) _wifiStats.roams++;
+  if (_wifiStatsAttemptAt > 0) {
+    _wifiStatsIpTotal += (uint64_t)((now - _wifiStatsAttemptAt) / 1000);
+    _wifiStatsAttemptAt = 0;
+  };
+  portEXIT_CRITICAL(&_wifiStatsLock);
+}
+
+// reason = 0 - requested disconnection, not counted
+static void wifiStatsDisconnected(uint8_t reason)
+{
+  if (reason > 0) {
+    portENTER_CRITICAL(&_wifiStatsLock);
+    _wifiStats.disconnects[wifiReasonCategory(reason)]++;
+    portEXIT_CRITICAL(&_wifiStatsLock);
+  };
+}
+
+wifi_stats_t wifiStatsGet()
+{
+  wifi_stats_t stats;
+  portENTER_CRITICAL(&_wifiStatsLock);
+  stats = _wifiStats;
+  stats.attempts = _wifiAttemptTotal;
+  stats.connects = _wifiConnectTotal;
+  stats.ip_time = stats.connects > 0 ? (uint32_t)(_wifiStatsIpTotal / stats.connects) : 0;
+  portEXIT_CRITICAL(&_wifiStatsLock);
+  #if CONFIG_WIFI_AVAILABILITY
+    stats.online = wifiAvailabilityGet(WIFI_AVAIL_BOOT).availability;
+  #else
+    stats.online = 0;
+  #endif // CONFIG_WIFI_AVAILABILITY
+  return stats;
+}
+
+static void wifiStatsTimerEnd(void* arg)
+{
+  _wifiStatsPublished = wifiStatsGet();
+  for (uint8_t i = 0; i < WIFI_STATS_ENTRIES; i++) {
+    if (_wifiStatsEntries[i]) {
+      paramsValueStore(_wifiStatsEntries[i], false);
+    };
+  };
+}
+
+static void wifiStatsRegister(paramsGroupHandle_t pgWifi)
+{
+  paramsGroupHandle_t pgStats = paramsRegisterGroup(pgWifi, 
+    CONFIG_WIFI_STATS_PGROUP_KEY, CONFIG_WIFI_STATS_PGROUP_TOPIC, CONFIG_WIFI_STATS_PGROUP_FRIENDLY);
+  // Local data: published only, not subscribed and not stored
+  uint8_t i = 0;
+  _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U32, nullptr, pgStats, 
+    "attempts", "Connection attempts", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.attempts);
+  _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U32, nullptr, pgStats, 
+    "connects", "Connections", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.connects);
+  _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U32, nullptr, pgStats, 
+    "disc_other", "Disconnections: other", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.disconnects[WIFI_REASON_CAT_TRANSIENT]);
+  _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U32, nullptr, pgStats, 
+    "disc_beacon", "Disconnections: beacon loss", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.disconnects[WIFI_REASON_CAT_BEACON]);
+  _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U32, nullptr, pgStats, 
+    "disc_auth", "Disconnections: authentication", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.disconnects[WIFI_REASON_CAT_AUTH]);
+  _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U32, nullptr, pgStats, 
+    "disc_ap_full", "Disconnections: AP is full", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.disconnects[WIFI_REASON_CAT_AP_FULL]);
+  _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U32, nullptr, pgStats, 
+    "disc_no_ap", "Disconnections: AP not found", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.disconnects[WIFI_REASON_CAT_NO_AP]);
+  _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U32, nullptr, pgStats, 
+    "roams", "Roams", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.roams);
+  _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U32, nullptr, pgStats, 
+    "restarts", "Restarts", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.restarts);
+  _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U32, nullptr, pgStats, 
+    "ip_time", "Average time to IP, ms", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.ip_time);
+  #if CONFIG_WIFI_AVAILABILITY
+    _wifiStatsEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U16, nullptr, pgStats, 
+      "online", "Online, 0.01%", CONFIG_WIFI_STATS_QOS, &_wifiStatsPublished.online);
+  #endif // CONFIG_WIFI_AVAILABILITY
+
+  if (!_wifiStatsTimer) {
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+    timer_args.callback = &wifiStatsTimerEnd;
+    timer_args.name = "timer_wifi_stats";
+    if (esp_timer_create(&timer_args, &_wifiStatsTimer) != ESP_OK) {
+      rlog_e(logTAG, "Failed to create WiFi statistics timer");
+      return;
+    };
+    esp_timer_start_periodic(_wifiStatsTimer, (uint64_t)CONFIG_WIFI_STATS_INTERVAL * 1000000);
+  };
+}
+
+#endif // CONFIG_WIFI_STATS
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Deferred logging --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_LOG_DEFERRED
+
+typedef enum {
+  WIFI_LOG_STA_STARTED = 0,
+  WIFI_LOG_STA_STOPPED,
+  WIFI_LOG_CONNECTING,            // attempt
+  WIFI_LOG_CONNECTED,             // channel, rssi (last known)
+  WIFI_LOG_GOT_IP,                // ip, mask, gateway
+  WIFI_LOG_LOST_BEACON,
+  WIFI_LOG_FAILED_BEACON,
+  WIFI_LOG_LOST_IP,
+  WIFI_LOG_LOST,                  // reason
+  WIFI_LOG_FAILED,                // reason
+  WIFI_LOG_SUPPRESSED,            // message, count, duration
+  WIFI_LOG_DROPPED                // count
+} wifi_log_msg_t;
+
+// Message id and arguments only, the text is formatted by the logging task
+typedef struct {
+  uint32_t time;                  // ms since boot
+  uint8_t  msg;                   // wifi_log_msg_t
+  uint8_t  slot;                  // Network slot, see wifiNetworkSlot()
+  uint16_t reserved;
+  uint32_t args[3];
+} wifi_log_record_t;
+
+// Aggregation state of one message id
+typedef struct {
+  uint32_t time;                  // Last accepted message
+  uint32_t args[3];
+  uint8_t  slot;                  // 0xFF - no message accepted yet
+  uint32_t suppressed;
+} wifi_log_agg_t;
+
+// Arguments that identify a repeated message (bit per argument), others (attempt counter, RSSI) change every time
+static const uint8_t _wifiLogKeyArgs[WIFI_LOG_SUPPRESSED] = {
+  0x00,                           // WIFI_LOG_STA_STARTED
+  0x00,                           // WIFI_LOG_STA_STOPPED
+  0x00,                           // WIFI_LOG_CONNECTING
+  0x01,                           // WIFI_LOG_CONNECTED
+  0x07,                           // WIFI_LOG_GOT_IP
+  0x00,                           // WIFI_LOG_LOST_BEACON
+  0x00,                           // WIFI_LOG_FAILED_BEACON
+  0x00,                           // WIFI_LOG_LOST_IP
+  0x01,                           // WIFI_LOG_LOST
+  0x01                            // WIFI_LOG_FAILED
+};
+
+static wifi_log_record_t _wifiLogRing[CONFIG_WIFI_LOG_RING_SIZE];
+static uint32_t _wifiLogHead = 0;
+static uint32_t _wifiLogTail = 0;
+static wifi_log_agg_t _wifiLogAgg[WIFI_LOG_SUPPRESSED];
+static uint32_t _wifiLogDropped = 0;
+static uint32_t _wifiLogTokens = CONFIG_WIFI_LOG_RATE * 1000;  // Token bucket, 1/1000 of a record
+static uint32_t _wifiLogRefill = 0;
+static portMUX_TYPE _wifiLogLock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t _wifiLogTask = nullptr;
+
+static const char* wifiNetworkSSID(uint8_t slot);
+
+// Called under the lock
+static bool wifiLogPush(const wifi_log_record_t* rec)
+{
+  if (_wifiLogHead - _wifiLogTail >= CONFIG_WIFI_LOG_RING_SIZE) return false;
+  _wifiLogRing[_wifiLogHead & (CONFIG_WIFI_LOG_RING_SIZE - 1)] = *rec;
+  _wifiLogHead++;
+  return true;
+}
+
+// Called under the lock: summary of similar messages counted since the last accepted one with the same id
+static void wifiLogFlushSuppressed(uint8_t msg)
+{
+  wifi_log_agg_t* agg = &_wifiLogAgg[msg];
+  if (agg->suppressed > 0) {
+    wifi_log_record_t rec;
+    rec.time = (uint32_t)(esp_timer_get_time() / 1000);
+    rec.msg = WIFI_LOG_SUPPRESSED;
+    rec.slot = agg->slot;
+    rec.reserved = 0;
+    rec.args[0] = msg;
+    rec.args[1] = agg->suppressed;
+    rec.args[2] = rec.time - agg->time;
+    if (wifiLogPush(&rec)) {
+      agg->suppressed = 0;
+    };
+  };
+}
+
+// Called under the lock
+static bool wifiLogSimilar(const wifi_log_record_t* rec)
+{
+  const wifi_log_agg_t* agg = &_wifiLogAgg[rec->msg];
+  if ((agg->slot != rec->slot) || (rec->time - agg->time >= CONFIG_WIFI_LOG_AGGREGATE)) return false;
+  for (uint8_t i = 0; i < 3; i++) {
+    if ((_wifiLogKeyArgs[rec->msg] & (1 << i)) && (agg->args[i] != rec->args[i])) return false;
+  };
+  return true;
+}
+
+static void wifiLogPost(wifi_log_msg_t msg, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+  wifi_log_record_t rec;
+  rec.time = (uint32_t)(esp_timer_get_time() / 1000);
+  rec.msg = (uint8_t)msg;
+  rec.slot = wifiNetworkSlot();
+  rec.reserved = 0;
+  rec.args[0] = arg0;
+  rec.args[1] = arg1;
+  rec.args[2] = arg2;
+  bool posted = false;
+  portENTER_CRITICAL(&_wifiLogLock);
+  // Repetition of a message with the same id and key arguments (reconnect storm): only counted
+  if (wifiLogSimilar(&rec)) {
+    _wifiLogAgg[rec.msg].suppressed++;
+  } else {
+    // Token bucket
+    uint32_t elapsed = rec.time - _wifiLogRefill;
+    _wifiLogRefill = rec.time;
+    // A second refills the whole bucket, a longer pause would overflow the product below
+    if (elapsed > 1000) elapsed = 1000;
+    _wifiLogTokens += elapsed * CONFIG_WIFI_LOG_RATE;
+    if (_wifiLogTokens > CONFIG_WIFI_LOG_RATE * 1000) _wifiLogTokens = CONFIG_WIFI_LOG_RATE * 1000;
+    if (_wifiLogTokens >= 1000) {
+      wifiLogFlushSuppressed(rec.msg);
+      if (wifiLogPush(&rec)) {
+        _wifiLogTokens -= 1000;
+        _wifiLogAgg[rec.msg].time = rec.time;
+        _wifiLogAgg[rec.msg].slot = rec.slot;
+        memcpy(_wifiLogAgg[rec.msg].args, rec.args, sizeof(rec.args));
+        posted = true;
+      } else {
+        _wifiLogDropped++;
+      };
+    } else {
+      _wifiLogDropped++;
+    };
+  };
+  portEXIT_CRITICAL(&_wifiLogLock);
+  if (posted && _wifiLogTask) {
+    xTaskNotify(_wifiLogTask, 0, eNoAction);
+  };
+}
+
+static void wifiLogFormat(const wifi_log_record_t* rec)
+{
+  const char* ssid = wifiNetworkSSID(rec->slot);
+  switch (rec->msg) {
+    case WIFI_LOG_STA_STARTED:
+      rlog_i(logTAG, "WiFi STA started");
+      break;
+    case WIFI_LOG_STA_STOPPED:
+      rlog_w(logTAG, "WiFi STA stopped");
+      break;
+    case WIFI_LOG_CONNECTING:
+      rlog_i(logTAG, "Connecting to WiFi network [ %s ], attempt %d...", ssid, rec->args[0]);
+      break;
+    case WIFI_LOG_CONNECTED:
+      rlog_i(logTAG, "WiFi connection [ %s ] established, channel: %d, RSSI: %d dBi", ssid, rec->args[0], (int32_t)rec->args[1]);
+      break;
+    case WIFI_LOG_GOT_IP:
+      {
+        const uint8_t * ip = (const uint8_t*)&rec->args[0];
+        const uint8_t * mask = (const uint8_t*)&rec->args[1];
+        const uint8_t * gw = (const uint8_t*)&rec->args[2];
+        rlog_i(logTAG, "WiFi got IP-address: %d.%d.%d.%d, mask: %d.%d.%d.%d, gateway: %d.%d.%d.%d",
+          ip[0], ip[1], ip[2], ip[3], mask[0], mask[1], mask[2], mask[3], gw[0], gw[1], gw[2], gw[3]);
+      };
+      break;
+    case WIFI_LOG_LOST_BEACON:
+      rlog_e(logTAG, "WiFi connection [ %s ] lost: beacon timeout!", ssid);
+      break;
+    case WIFI_LOG_FAILED_BEACON:
+      rlog_e(logTAG, "Failed to connect to WiFi network: beacon timeout!");
+      break;
+    case WIFI_LOG_LOST_IP:
+      rlog_e(logTAG, "WiFi connection [ %s ] lost WiFi IP address!", ssid);
+      break;
+    case WIFI_LOG_LOST:
+      rlog_e(logTAG, "WiFi connection [ %s ] lost: #%d!", ssid, rec->args[0]);
+      break;
+    case WIFI_LOG_FAILED:
+      rlog_e(logTAG, "Failed to connect to WiFi network: #%d!", rec->args[0]);
+      break;
+    case WIFI_LOG_SUPPRESSED:
+      rlog_w(logTAG, "WiFi: suppressed %d similar messages (#%d) in %d ms", rec->args[1], rec->args[0], rec->args[2]);
+      break;
+    case WIFI_LOG_DROPPED:
+      rlog_w(logTAG, "WiFi: %d log messages dropped (rate limit)", rec->args[0]);
+      break;
+  };
+}
+
+static void wifiLogTaskExec(void* arg)
+{
+  while (true) {
+    xTaskNotifyWait(0, 0, nullptr, pdMS_TO_TICKS(CONFIG_WIFI_LOG_AGGREGATE));
+    wifi_log_record_t rec;
+    bool found = true;
+    while (found) {
+      portENTER_CRITICAL(&_wifiLogLock);
+      found = _wifiLogHead != _wifiLogTail;
+      if (found) {
+        rec = _wifiLogRing[_wifiLogTail & (CONFIG_WIFI_LOG_RING_SIZE - 1)];
+        _wifiLogTail++;
+      } else {
+        // The storm is over: write the summaries of the messages whose window has expired
+        uint32_t now = (uint32_t)(esp_timer_get_time() / 1000);
+        for (uint8_t msg = 0; msg < WIFI_LOG_SUPPRESSED; msg++) {
+          if ((_wifiLogAgg[msg].suppressed > 0) && (now - _wifiLogAgg[msg].time >= CONFIG_WIFI_LOG_AGGREGATE)) {
+            wifiLogFlushSuppressed(msg);
+          };
+        };
+        found = _wifiLogHead != _wifiLogTail;
+        if (!found && (_wifiLogDropped > 0)) {
+          memset(&rec, 0, sizeof(rec));
+          rec.msg = WIFI_LOG_DROPPED;
+          rec.args[0] = _wifiLogDropped;
+          _wifiLogDropped = 0;
+          found = wifiLogPush(&rec);
+        };
+      };
+      portEXIT_CRITICAL(&_wifiLogLock);
+      if (found) {
+        wifiLogFormat(&rec);
+      };
+    };
+  };
+}
+
+static bool wifiLogInit()
+{
+  if (_wifiLogTask) return true;
+  for (uint8_t msg = 0; msg < WIFI_LOG_SUPPRESSED; msg++) {
+    _wifiLogAgg[msg].slot = 0xFF;
+  };
+  if (xTaskCreate(wifiLogTaskExec, "wifi_log", CONFIG_WIFI_LOG_STACK_SIZE, nullptr, CONFIG_WIFI_LOG_PRIORITY, &_wifiLogTask) != pdPASS) {
+    _wifiLogTask = nullptr;
+    rlog_e(logTAG, "Failed to create deferred logging task");
+    return false;
+  };
+  return true;
+}
+
+#endif // CONFIG_WIFI_LOG_DEFERRED
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Configure STA mode ------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+uint8_t wifiGetMaxIndex()
+{
+  #if defined(CONFIG_WIFI_SSID)
+    return (uint8_t)0;
+  #elif defined(CONFIG_WIFI_5_SSID)
+    return (uint8_t)5;
+  #elif defined(CONFIG_WIFI_4_SSID)
+    return (uint8_t)4;
+  #elif defined(CONFIG_WIFI_3_SSID)
+    return (uint8_t)3;
+  #elif defined(CONFIG_WIFI_2_SSID)
+    return (uint8_t)2;
+  #elif defined(CONFIG_WIFI_1_SSID)
+    return (uint8_t)1;
+  #endif
+}
+
+static const char* wifiNetworkSSID(uint8_t slot)
+{
+  #ifdef CONFIG_WIFI_SSID
+    // Single network mode
+    return CONFIG_WIFI_SSID;
+  #else
+    // Multi-network mode
+    switch (slot) {
+      #ifdef CONFIG_WIFI_2_SSID
+      case 1: return CONFIG_WIFI_2_SSID;
+      #endif // CONFIG_WIFI_2_SSID
+      #ifdef CONFIG_WIFI_3_SSID
+      case 2: return CONFIG_WIFI_3_SSID;
+      #endif // CONFIG_WIFI_3_SSID
+      #ifdef CONFIG_WIFI_4_SSID
+      case 3: return CONFIG_WIFI_4_SSID;
+      #endif // CONFIG_WIFI_4_SSID
+      #ifdef CONFIG_WIFI_5_SSID
+      case 4: return CONFIG_WIFI_5_SSID;
+      #endif // CONFIG_WIFI_5_SSID
+      default: return CONFIG_WIFI_1_SSID;
+    };
+  #endif // CONFIG_WIFI_SSID
+}
+
+const char* wifiGetSSID()
+{
+  return wifiNetworkSSID(wifiNetworkSlot());
+}
+
+bool wifiConnectSTA()
+{
+  // Wi-Fi Configuration Phase
+  // https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-configuration-phase
+
+  wifi_config_t conf;
+  memset(&conf, 0, sizeof(wifi_config_t));
+  #ifdef CONFIG_WIFI_SSID
+    // Single network mode
+    strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_SSID);
+    strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_PASS);
+  #else
+    // Multi-network mode
+    if (_wifiCurrIndex == 0) {
+      _wifiMaxIndex = wifiGetMaxIndex();
+      _wifiIndexNeedChange = false;
+      _wifiIndexWasChanged = false;
+      nvsRead(wifiNvsGroup, wifiNvsIndex, OPT_TYPE_U8, &_wifiCurrIndex);
+      #if CONFIG_WIFI_NETWORK_SCORING
+        // Start with the best known network, if there is any history
+        wifiNetworkLoad();
+        uint8_t best = wifiNetworkSelect(0, false);
+        if ((best > 0) && (best != _wifiCurrIndex)) {
+          _wifiCurrIndex = best;
+          _wifiIndexWasChanged = true;
+        };
+      #endif // CONFIG_WIFI_NETWORK_SCORING
+      if (_wifiCurrIndex == 0) {
+        _wifiCurrIndex = 1;
+        _wifiIndexNeedChange = true;
+        _wifiIndexWasChanged = true;
+      };
+    } else {
+      if (_wifiIndexNeedChange) {
+        #if CONFIG_WIFI_NETWORK_SCORING
+          uint8_t next = wifiNetworkSelect(_wifiCurrIndex, true);
+          if (next > 0) {
+            _wifiCurrIndex = next;
+          };
+        #else
+          if (++_wifiCurrIndex > _wifiMaxIndex) {
+            _wifiCurrIndex = 1;
+          };
+        #endif // CONFIG_WIFI_NETWORK_SCORING
+        rlog_d(logTAG, "Attempting to connect to another access point: %d", _wifiCurrIndex);
+        _wifiIndexWasChanged = true;
+      };
+    };
+
+    switch (_wifiCurrIndex) {
+      case 1:
+        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_1_SSID);
+        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_1_PASS);
+        break;
+      #ifdef CONFIG_WIFI_2_SSID
+      case 2:
+        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_2_SSID);
+        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_2_PASS);
+        break;
+      #endif // CONFIG_WIFI_2_SSID
+      #ifdef CONFIG_WIFI_3_SSID
+      case 3:
+        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_3_SSID);
+        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_3_PASS);
+        break;
+      #endif // CONFIG_WIFI_3_SSID
+      #ifdef CONFIG_WIFI_4_SSID
+      case 4:
+        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_4_SSID);
+        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_4_PASS);
+        break;
+      #endif // CONFIG_WIFI_4_SSID
+      #ifdef CONFIG_WIFI_5_SSID
+      case 5:
+        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_5_SSID);
+        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_5_PASS);
+        break;
+      #endif // CONFIG_WIFI_5_SSID
+      default:
+        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_1_SSID);
+        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_1_PASS);
+        break;
+    };
+  #endif // CONFIG_WIFI_SSID
+  
+  // Select the best access point based on signal strength (MESH systems only)
+  conf.sta.rm_enabled = true;
+  conf.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  conf.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+
+  // Support for Protected Management Frame
+  #if CONFIG_WIFI_PROFILES
+    // Used by the AP only with WIFI_PS_MAX_MODEM, takes effect at the next association
+    conf.sta.listen_interval = _wifiProfiles[_wifiProfile].listen_interval;
+  #endif // CONFIG_WIFI_PROFILES
+  conf.sta.pmf_cfg.capable = true;
+  conf.sta.pmf_cfg.required = false;
+
+  // Bandwidth selected for this network
+  #if CONFIG_WIFI_BANDWIDTH_AUTO
+    wifiBandwidthRestore();
+  #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+  #if CONFIG_WIFI_LONGRANGE_AUTO
+    wifiLongRangeRestore();
+  #endif // CONFIG_WIFI_LONGRANGE_AUTO
+
+  // Configure WiFi
+  #if CONFIG_WIFI_PMK_CACHE
+    WIFI_ERROR_CHECK_BOOL(wifiConfigApply(&conf), "set the configuration of the ESP32 STA");
+  #else
+    WIFI_ERROR_CHECK_BOOL(esp_wifi_set_config(WIFI_IF_STA, &conf), "set the configuration of the ESP32 STA");
+  #endif // CONFIG_WIFI_PMK_CACHE
+
+  // Wi-Fi Connect Phase
+  // https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-connect-phase
+  _wifiAttemptCount++;
+  #if CONFIG_WIFI_TELEMETRY || CONFIG_WIFI_STATS
+    _wifiAttemptTotal++;
+  #endif // CONFIG_WIFI_TELEMETRY || CONFIG_WIFI_STATS
+  #if CONFIG_WIFI_STATS
+    wifiStatsAttempt();
+  #endif // CONFIG_WIFI_STATS
+  #if CONFIG_WIFI_NETWORK_SCORING && !defined(CONFIG_WIFI_SSID)
+    wifiNetworkAttempt(_wifiCurrIndex);
+  #endif // CONFIG_WIFI_NETWORK_SCORING
+  #if CONFIG_WIFI_LOG_DEFERRED
+    wifiLogPost(WIFI_LOG_CONNECTING, _wifiAttemptCount, 0, 0);
+  #else
+    rlog_i(logTAG, "Connecting to WiFi network [ %s ], attempt %d...", reinterpret_cast<char*>(conf.sta.ssid), _wifiAttemptCount);
+  #endif // CONFIG_WIFI_LOG_DEFERRED
+  wifiTimeoutStart(WIFI_PHASE_CONNECT);
+  WIFI_ERROR_CHECK_BOOL(esp_wifi_connect(), "сonnect the ESP32 WiFi station to the AP");
+
+  return true;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Internal functions ------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+bool _wifiStartSTA()
+{
+  rlog_i(logTAG, "Start WiFi STA mode...");
+  WIFI_ERROR_CHECK_BOOL(esp_wifi_set_mode(WIFI_MODE_STA), "set the WiFi operating mode");
+  #if CONFIG_WIFI_PROFILES
+    // Bandwidth and protocol are set by the active profile in the WIFI_EVENT_STA_START handler
+    if (_wifiProfileSince == 0) {
+      _wifiProfileSince = esp_timer_get_time();
+    };
+  #else
+  #if CONFIG_WIFI_TUNABLES && !CONFIG_WIFI_BANDWIDTH_AUTO
+    if (_wifiTunables.bandwidth > 0) {
+      WIFI_ERROR_CHECK_BOOL(esp_wifi_set_bandwidth(WIFI_IF_STA, (wifi_bandwidth_t)_wifiTunables.bandwidth), "set the bandwidth");
+    };
+  #elif defined(CONFIG_WIFI_BANDWIDTH) && !CONFIG_WIFI_BANDWIDTH_AUTO
+    // Theoretically the HT40 can gain better throughput because the maximum raw physicial 
+    // (PHY) data rate for HT40 is 150Mbps while it’s 72Mbps for HT20. 
+    // However, if the device is used in some special environment, e.g. there are too many other Wi-Fi devices around the ESP32 device, 
+    // the performance of HT40 may be degraded. So if the applications need to support same or similar scenarios, 
+    // it’s recommended that the bandwidth is always configured to HT20.
+    // https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-ht20-40
+    WIFI_ERROR_CHECK_BOOL(esp_wifi_set_bandwidth(WIFI_IF_STA, CONFIG_WIFI_BANDWIDTH), "set the bandwidth");
+  #endif // CONFIG_WIFI_BANDWIDTH
+  #if defined(CONFIG_WIFI_LONGRANGE) && !CONFIG_WIFI_LONGRANGE_AUTO
+    // Long Range (LR). Since LR is Espressif unique Wi-Fi mode, only ESP32 devices can transmit and receive the LR data
+    // more info: https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-protocol-mode
+    WIFI_ERROR_CHECK_BOOL(esp_wifi_set_protocol(WIFI_IF_STA, WIFI_PROTOCOL_LR), "set protocol Long Range");
+  #endif // CONFIG_WIFI_LONGRANGE
+  #endif // CONFIG_WIFI_PROFILES
+  // The timer is started before the call, since the event handler can fire before esp_wifi_start() returns
+  wifiTimeoutStart(WIFI_PHASE_START);
+  esp_err_t err = esp_wifi_start();
+  if (err != ESP_OK) {
+    wifiTimeoutStop();
+    rlog_e(logTAG, "Failed to start WiFi: %d (%s)", err, esp_err_to_name(err));
+    return false;
+  };
+  return true;
+}
+
+bool _wifiDisconnectSTA()
+{
+  rlog_d(logTAG, "Disconnect from AP...");
+  wifiTimeoutStart(WIFI_PHASE_DISCONNECT);
+  esp_err_t err = esp_wifi_disconnect();
+  if (err != ESP_OK) {
+    wifiTimeoutStop();
+    rlog_e(logTAG, "Failed to WiFi disconnect: %d (%s)", err, esp_err_to_name(err));
+    return false;
+  };
+  return true;
+}
+
+bool _wifiStopSTA()
+{
+  rlog_d(logTAG, "Stop WiFi STA mode...");
+  WIFI_ERROR_CHECK_BOOL(esp_wifi_stop(), "WiFi stop");
+  return true;
+}
+
+bool _wifiRestoreSTA()
+{
+  rlog_w(logTAG, "Restore WiFi stack persistent settings to default values");
+  WIFI_ERROR_CHECK_BOOL(esp_wifi_restore(), "restore WiFi stack persistent settings to default values");
+  // Restoring is rare and not learned, so fixed timeout is used
+  wifiTimeoutStart(WIFI_PHASE_NONE);
+  return true;
+}
+
+#if WIFI_RECONNECT_DELAY_TIMER
+static void wifiReconnectDelayStop();
+#endif // WIFI_RECONNECT_DELAY_TIMER
+
+// Failed connection attempt: restore WiFi stack settings and restart STA mode
+static bool wifiStateRecover()
+{
+  _wifiRestoreSTA();
+  return wifiStateExecute(wifiStateDispatch(WIFI_FSM_EV_RESTART));
+}
+
+bool wifiStartWiFi()
+{
+  return wifiStateHandle(WIFI_FSM_EV_START);
+};
+
+bool wifiStopWiFi()
+{
+  #if WIFI_RECONNECT_DELAY_TIMER
+    wifiReconnectDelayStop();
+  #endif // WIFI_RECONNECT_DELAY_TIMER
+  return wifiStateHandle(WIFI_FSM_EV_STOP);
+}
+
+// If connected: disconnect, restore WiFi stack persistent settings to default values and reconnect;
+// otherwise: stop STA mode and start it again
+bool wifiRestartWiFi()
+{
+  #if CONFIG_WIFI_STATS
+    wifiStatsRestart();
+  #endif // CONFIG_WIFI_STATS
+  return wifiStateHandle(WIFI_FSM_EV_RESTART);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Reconnect policy --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if WIFI_RECONNECT_DELAY_TIMER
+
+static esp_timer_handle_t _wifiDelayTimer = nullptr;
+static uint32_t _wifiDelaySeq = 0;
+
+static void wifiReconnectDelayEnd(void* arg)
+{
+  wifiStatePostTimer(WIFI_TIMER_RECONNECT, _wifiDelaySeq);
+}
+
+// Called from the event loop
+static void wifiReconnectDelayExec()
+{
+  // The situation could change while we were waiting
+  if (_wifiState == WIFI_STATE_CONNECTING) {
+    if (!wifiConnectSTA()) {
+      wifiStateRecover();
+    };
+  };
+}
+
+static void wifiReconnectDelayStop()
+{
+  _wifiDelaySeq++;
+  if (_wifiDelayTimer) {
+    if (esp_timer_is_active(_wifiDelayTimer)) {
+      esp_timer_stop(_wifiDelayTimer);
+    };
+  };
+}
+
+static void wifiReconnectDelayDelete()
+{
+  if (_wifiDelayTimer) {
+    wifiReconnectDelayStop();
+    esp_timer_delete(_wifiDelayTimer);
+    _wifiDelayTimer = nullptr;
+  };
+}
+
+// The delay is done by the timer, so as not to block the event loop for a long time
+static bool wifiReconnectDelayed(uint32_t delay_ms)
+{
+  if (delay_ms == 0) {
+    return wifiConnectSTA();
+  };
+  if (!_wifiDelayTimer) {
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+    timer_args.callback = &wifiReconnectDelayEnd;
+    timer_args.name = "timer_wifi_delay";
+    WIFI_ERROR_CHECK_BOOL(esp_timer_create(&timer_args, &_wifiDelayTimer), "create reconnect delay timer");
+  };
+  wifiReconnectDelayStop();
+  rlog_d(logTAG, "Next connection attempt in %d ms", delay_ms);
+  WIFI_ERROR_CHECK_BOOL(esp_timer_start_once(_wifiDelayTimer, (uint64_t)delay_ms * 1000), "start reconnect delay timer");
+  return true;
+}
+
+// Restore WiFi stack settings; with a delay, the next attempt is made by the timer instead of the restore timeout
+static bool wifiRestoreDelayed(uint32_t delay_ms)
+{
+  if (!_wifiRestoreSTA()) {
+    return false;
+  };
+  if (delay_ms > 0) {
+    wifiTimeoutStop();
+    return wifiReconnectDelayed(delay_ms);
+  };
+  return true;
+}
+
+#endif // WIFI_RECONNECT_DELAY_TIMER
+
+#if CONFIG_WIFI_REASON_POLICY || CONFIG_WIFI_STATS
+
+wifi_reason_category_t wifiReasonCategory(uint8_t reason)
+{
+  switch (reason) {
+    case WIFI_REASON_BEACON_TIMEOUT:
+      return WIFI_REASON_CAT_BEACON;
+    case WIFI_REASON_AUTH_FAIL:
+    case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_MIC_FAILURE:
+    case WIFI_REASON_802_1X_AUTH_FAILED:
+      return WIFI_REASON_CAT_AUTH;
+    case WIFI_REASON_ASSOC_TOOMANY:
+      return WIFI_REASON_CAT_AP_FULL;
+    case WIFI_REASON_NO_AP_FOUND:
+      return WIFI_REASON_CAT_NO_AP;
+    default:
+      return WIFI_REASON_CAT_TRANSIENT;
+  };
+}
+
+#endif // CONFIG_WIFI_REASON_POLICY || CONFIG_WIFI_STATS
+
+#if CONFIG_WIFI_REASON_POLICY
+
+static uint8_t _wifiReasonAttempts[WIFI_REASON_CAT_MAX];
+static bool _wifiReasonCustom[WIFI_REASON_CAT_MAX];   // Set by the application, not overwritten by the connection parameters
+
+static wifi_reason_policy_t _wifiReasonPolicy[WIFI_REASON_CAT_MAX] = {
+  // WIFI_REASON_CAT_TRANSIENT: same as without policy
+  { WIFI_ACTION_RETRY,   CONFIG_WIFI_RECONNECT_DELAY, CONFIG_WIFI_RECONNECT_DELAY, CONFIG_WIFI_RECONNECT_ATTEMPTS },
+  // WIFI_REASON_CAT_BEACON: the AP is most likely still there, reconnect without delay
+  { WIFI_ACTION_RETRY,   0,                           0,                           CONFIG_WIFI_RECONNECT_ATTEMPTS },
+  // WIFI_REASON_CAT_AUTH: wrong password will not fix itself, go to another network or wait long
+  { WIFI_ACTION_SWITCH,  10000,                       300000,                      2 },
+  // WIFI_REASON_CAT_AP_FULL: wait until the AP releases a slot
+  { WIFI_ACTION_BACKOFF, 5000,                        60000,                       5 },
+  // WIFI_REASON_CAT_NO_AP: go to another network or wait
+  { WIFI_ACTION_SWITCH,  5000,                        120000,                      3 },
+};
+
+static const char* wifiReasonCategoryName(wifi_reason_category_t category)
+{
+  switch (category) {
+    case WIFI_REASON_CAT_BEACON:  return "beacon loss";
+    case WIFI_REASON_CAT_AUTH:    return "authentication";
+    case WIFI_REASON_CAT_AP_FULL: return "AP is full";
+    case WIFI_REASON_CAT_NO_AP:   return "AP not found";
+    default:                      return "transient";
+  };
+}
+
+bool wifiReasonPolicySet(wifi_reason_category_t category, const wifi_reason_policy_t* policy)
+{
+  if ((category >= WIFI_REASON_CAT_MAX) || (policy == nullptr) || (policy->delay_max < policy->delay_min)) {
+    return false;
+  };
+  _wifiReasonPolicy[category] = *policy;
+  _wifiReasonCustom[category] = true;
+  return true;
+}
+
+wifi_reason_policy_t wifiReasonPolicyGet(wifi_reason_category_t category)
+{
+  if (category >= WIFI_REASON_CAT_MAX) {
+    category = WIFI_REASON_CAT_TRANSIENT;
+  };
+  return _wifiReasonPolicy[category];
+}
+
+static void wifiReasonPolicyReset()
+{
+  memset(&_wifiReasonAttempts, 0, sizeof(_wifiReasonAttempts));
+}
+
+// Select the action and delay for the last disconnection reason, returns true if the category budget has been exhausted
+static bool wifiReasonDecide(wifi_reconnect_action_t* action, uint32_t* delay)
+{
+  bool exhausted = false;
+  wifi_reason_category_t category = wifiReasonCategory(_wifiLastErr);
+  wifi_reason_policy_t* policy = &_wifiReasonPolicy[category];
+  uint8_t attempt = _wifiReasonAttempts[category] < UINT8_MAX ? ++_wifiReasonAttempts[category] : UINT8_MAX;
+  *action = policy->action;
+
+  // The budget of attempts for this category has been exhausted: escalate
+  if ((policy->attempts > 0) && (attempt > policy->attempts)) {
+    _wifiReasonAttempts[category] = 0;
+    attempt = 1;
+    exhausted = true;
+    #ifdef CONFIG_WIFI_SSID
+      *action = WIFI_ACTION_RESTORE;
+    #else
+      *action = *action < WIFI_ACTION_SWITCH ? WIFI_ACTION_SWITCH : WIFI_ACTION_RESTORE;
+    #endif // CONFIG_WIFI_SSID
+  };
+  // There is nowhere to switch in single network mode
+  #ifdef CONFIG_WIFI_SSID
+    if (*action == WIFI_ACTION_SWITCH) *action = WIFI_ACTION_BACKOFF;
+  #endif // CONFIG_WIFI_SSID
+
+  // The minimum delay applies to all actions, so that a series of switches does not cycle through the networks without a pause
+  *delay = policy->delay_min;
+  if (*action == WIFI_ACTION_BACKOFF) {
+    for (uint8_t i = 1; (i < attempt) && (*delay < policy->delay_max); i++) {
+      *delay = *delay * 2;
+    };
+    if ((*delay == 0) || (*delay > policy->delay_max)) *delay = policy->delay_max;
+  };
+
+  rlog_d(logTAG, "Reconnect policy: reason #%d (%s), attempt %d, action %d, delay %d ms", 
+    _wifiLastErr, wifiReasonCategoryName(category), attempt, *action, *delay);
+  return exhausted;
+}
+
+#if !CONFIG_WIFI_RECOVERY_LADDER
+
+static bool wifiReconnectByPolicy()
+{
+  // Common limit, regardless of the reasons
+  if (_wifiAttemptCount > WIFI_RESTART_ATTEMPTS) {
+    return wifiRestartWiFi();
+  };
+
+  wifi_reconnect_action_t action;
+  uint32_t delay;
+  wifiReasonDecide(&action, &delay);
+  switch (action) {
+    case WIFI_ACTION_RESTORE:
+      return wifiRestoreDelayed(delay);
+    #ifndef CONFIG_WIFI_SSID
+    case WIFI_ACTION_SWITCH:
+      _wifiIndexNeedChange = true;
+      return wifiReconnectDelayed(delay);
+    #endif // CONFIG_WIFI_SSID
+    default:
+      return wifiReconnectDelayed(delay);
+  };
+}
+
+#endif // CONFIG_WIFI_RECOVERY_LADDER
+
+#endif // CONFIG_WIFI_REASON_POLICY
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Recovery ladder --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_RECOVERY_LADDER
+
+typedef struct {
+  uint8_t  attempts;              // Attempts at the tier before moving to the next one (0 - unlimited)
+  uint32_t time;                  // Maximum time at the tier, ms (0 - unlimited)
+} wifi_recovery_budget_t;
+
+static wifi_recovery_budget_t _wifiRecoveryBudget[WIFI_TIER_MAX] = {
+  { CONFIG_WIFI_RECONNECT_ATTEMPTS, 120000 },  // WIFI_TIER_REASSOC
+  { 2 * WIFI_NETWORKS_COUNT,        180000 },  // WIFI_TIER_RESCAN
+  { 2,                              60000  },  // WIFI_TIER_STA_RESTART
+  { 1,                              60000  },  // WIFI_TIER_DRIVER
+  { 1,                              60000  },  // WIFI_TIER_NETIF
+  { 1,                              120000 },  // WIFI_TIER_RESTORE
+  { 0,                              0      },  // WIFI_TIER_REBOOT
+};
+
+static bool _wifiRecoveryCustom[WIFI_TIER_MAX];      // Set by the application, not overwritten by the connection parameters
+static wifi_recovery_stats_t _wifiRecoveryStats[WIFI_TIER_MAX];
+static wifi_recovery_tier_t _wifiRecoveryTier = WIFI_TIER_REASSOC;
+static wifi_recovery_tier_t _wifiRecoveryPending = WIFI_TIER_MAX;
+static uint8_t _wifiRecoveryAttempts = 0;
+static int64_t _wifiRecoveryStart = 0;
+static int64_t _wifiRecoveryTierStart = 0;
+// Only the loss of an established connection is an incident, failures before the first connection are not counted
+static bool _wifiRecoveryCounted = false;
+static esp_timer_handle_t _wifiRecoveryTimer = nullptr;
+static uint32_t _wifiRecoverySeq = 0;
+
+static void wifiRecoveryEnter(wifi_recovery_tier_t tier);
+static bool wifiRecoveryExecute(uint32_t delay);
+
+static const char* wifiRecoveryTierName(wifi_recovery_tier_t tier)
+{
+  switch (tier) {
+    case WIFI_TIER_REASSOC:     return "reassociate";
+    case WIFI_TIER_RESCAN:      return "rescan";
+    case WIFI_TIER_STA_RESTART: return "sta restart";
+    case WIFI_TIER_DRIVER:      return "driver reinit";
+    case WIFI_TIER_NETIF:       return "netif recreate";
+    case WIFI_TIER_RESTORE:     return "restore";
+    default:                    return "reboot";
+  };
+}
+
+static void wifiRecoveryTimerStop()
+{
+  _wifiRecoverySeq++;
+  if (_wifiRecoveryTimer) {
+    if (esp_timer_is_active(_wifiRecoveryTimer)) {
+      esp_timer_stop(_wifiRecoveryTimer);
+    };
+  };
+}
+
+static void wifiRecoveryTimerDelete()
+{
+  if (_wifiRecoveryTimer) {
+    wifiRecoveryTimerStop();
+    esp_timer_delete(_wifiRecoveryTimer);
+    _wifiRecoveryTimer = nullptr;
+  };
+}
+
+// The time budget of the tier has expired: if we are waiting for the next attempt, escalate now instead of after the delay.
+// If an attempt is in progress, its result (or timeout) will escalate in wifiRecoveryNext()
+static void wifiRecoveryTimerEnd(void* arg)
+{
+  wifiStatePostTimer(WIFI_TIMER_RECOVERY, _wifiRecoverySeq);
+}
+
+// Called from the event loop
+static void wifiRecoveryTimerExec()
+{
+  if ((_wifiRecoveryStart > 0) && (_wifiState == WIFI_STATE_CONNECTING) 
+   && _wifiDelayTimer && esp_timer_is_active(_wifiDelayTimer)) {
+    wifiReconnectDelayStop();
+    rlog_w(logTAG, "WiFi recovery: time at tier %d (%s) is over", _wifiRecoveryTier, wifiRecoveryTierName(_wifiRecoveryTier));
+    wifiRecoveryEnter((wifi_recovery_tier_t)(_wifiRecoveryTier + 1));
+    if (!wifiRecoveryExecute(0)) {
+      wifiStateRecover();
+    };
+  };
+}
+
+static void wifiRecoveryEnter(wifi_recovery_tier_t tier)
+{
+  if (tier >= WIFI_TIER_MAX) tier = WIFI_TIER_REBOOT;
+  _wifiRecoveryTier = tier;
+  _wifiRecoveryAttempts = 1;
+  _wifiRecoveryTierStart = esp_timer_get_time();
+  if (_wifiRecoveryCounted) {
+    _wifiRecoveryStats[tier].reached++;
+  };
+  if (tier > WIFI_TIER_REASSOC) {
+    rlog_w(logTAG, "WiFi recovery: escalation to tier %d (%s)", tier, wifiRecoveryTierName(tier));
+  };
+  // The time budget is controlled by the timer, regardless of the events
+  wifiRecoveryTimerStop();
+  if (_wifiRecoveryBudget[tier].time > 0) {
+    if (!_wifiRecoveryTimer) {
+      esp_timer_create_args_t timer_args;
+      memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+      timer_args.callback = &wifiRecoveryTimerEnd;
+      timer_args.name = "timer_wifi_recovery";
+      WIFI_ERROR_CHECK_LOG(esp_timer_create(&timer_args, &_wifiRecoveryTimer), "create recovery timer");
+    };
+    if (_wifiRecoveryTimer) {
+      WIFI_ERROR_CHECK_LOG(esp_timer_start_once(_wifiRecoveryTimer, (uint64_t)_wifiRecoveryBudget[tier].time * 1000), "start recovery timer");
+    };
+  };
+}
+
+// Start of an incident: the connection is lost (counted), or could not be established (not counted)
+static void wifiRecoveryBegin(bool counted)
+{
+  if (_wifiRecoveryStart == 0) {
+    _wifiRecoveryStart = esp_timer_get_time();
+    _wifiRecoveryCounted = counted;
+    _wifiRecoveryPending = WIFI_TIER_MAX;
+    wifiRecoveryEnter(WIFI_TIER_REASSOC);
+  };
+}
+
+// End of an incident: the tier on which the connection was restored gets the credit
+static void wifiRecoveryEnd(bool success)
+{
+  wifiRecoveryTimerStop();
+  if (_wifiRecoveryStart > 0) {
+    if (success && _wifiRecoveryCounted) {
+      uint32_t duration = (uint32_t)((esp_timer_get_time() - _wifiRecoveryStart) / 1000);
+      wifi_recovery_stats_t* stats = &_wifiRecoveryStats[_wifiRecoveryTier];
+      stats->recovered++;
+      stats->time_total += duration;
+      if (duration > stats->time_max) stats->time_max = duration;
+      rlog_i(logTAG, "WiFi recovered at tier %d (%s) in %d ms", _wifiRecoveryTier, wifiRecoveryTierName(_wifiRecoveryTier), duration);
+    };
+    _wifiRecoveryStart = 0;
+  };
+  _wifiRecoveryCounted = false;
+  _wifiRecoveryTier = WIFI_TIER_REASSOC;
+  _wifiRecoveryPending = WIFI_TIER_MAX;
+  _wifiRecoveryAttempts = 0;
+}
+
+static bool wifiRecoveryExecute(uint32_t delay)
+{
+  #if CONFIG_WIFI_REASON_POLICY
+    // The minimum delay of the policy also applies to switching networks and restoring
+    uint32_t policy_delay = delay;
+  #else
+    uint32_t policy_delay = 0;
+  #endif // CONFIG_WIFI_REASON_POLICY
+  switch (_wifiRecoveryTier) {
+    case WIFI_TIER_REASSOC:
+      return wifiReconnectDelayed(delay);
+    case WIFI_TIER_RESCAN:
+      // Full channel scan is always performed by esp_wifi_connect(), here we also change the network
+      #ifndef CONFIG_WIFI_SSID
+        _wifiIndexNeedChange = true;
+      #endif // CONFIG_WIFI_SSID
+      return wifiReconnectDelayed(policy_delay);
+    case WIFI_TIER_STA_RESTART:
+      // STA will be started again in the event handler
+      return _wifiStopSTA();
+    case WIFI_TIER_DRIVER:
+    case WIFI_TIER_NETIF:
+      // Reinitialization is performed in a separate task after STA is stopped, see wifiRecoveryReinitPost()
+      _wifiRecoveryPending = _wifiRecoveryTier;
+      return _wifiStopSTA();
+    case WIFI_TIER_RESTORE:
+      return wifiRestoreDelayed(policy_delay);
+    default:
+      rlog_e(logTAG, "WiFi recovery failed, restarting the device...");
+      // The device restart timer must not restart the device a second time while the debug info is being saved
+      #if defined(CONFIG_WIFI_TIMER_RESTART_DEVICE) && CONFIG_WIFI_TIMER_RESTART_DEVICE > 0
+        espRestartTimerBreak(&_wdtRestartWiFi);
+      #endif // CONFIG_WIFI_TIMER_RESTART_DEVICE
+      #if CONFIG_WIFI_DEBUG_ENABLE
+        wifiStoreDebugInfo();
+      #endif // CONFIG_WIFI_DEBUG_ENABLE
+      espRestart(RR_WIFI_TIMEOUT);
+      return true;
+  };
+}
+
+// The driver can't be deinitialized from the event loop: the event handlers being executed are unregistered.
+// So it is done in a separate task, which then starts STA again
+static void wifiRecoveryReinitTask(void* arg)
+{
+  wifi_recovery_tier_t tier = (wifi_recovery_tier_t)(intptr_t)arg;
+  rlog_w(logTAG, "WiFi recovery: %s", wifiRecoveryTierName(tier));
+  if (wifiLowLevelDeinit()) {
+    if (tier == WIFI_TIER_NETIF) {
+      wifiNetifDestroy();
+      if (_wifiNetif) {
+        rlog_e(logTAG, "WiFi recovery: failed to destroy netif, only the driver is reinitialized");
+      };
+    };
+  };
+  if (!wifiLowLevelInit() || !_wifiStartSTA()) {
+    rlog_e(logTAG, "WiFi recovery: failed to reinitialize WiFi");
+  };
+  vTaskDelete(nullptr);
+}
+
+// Called from WIFI_EVENT_STA_STOP handler instead of starting STA, returns false if there is nothing to reinitialize
+static bool wifiRecoveryReinitPost()
+{
+  wifi_recovery_tier_t tier = _wifiRecoveryPending;
+  _wifiRecoveryPending = WIFI_TIER_MAX;
+  if ((tier == WIFI_TIER_DRIVER) || (tier == WIFI_TIER_NETIF)) {
+    if (xTaskCreate(wifiRecoveryReinitTask, "wifi_reinit", CONFIG_WIFI_RECOVERY_STACK_SIZE, (void*)(intptr_t)tier, 
+          CONFIG_WIFI_RECOVERY_PRIORITY, nullptr) == pdPASS) {
+      return true;
+    };
+    rlog_e(logTAG, "WiFi recovery: failed to create reinitialization task");
+  };
+  return false;
+}
+
+static bool wifiRecoveryNext()
+{
+  wifi_reconnect_action_t action = WIFI_ACTION_RETRY;
+  uint32_t delay = WIFI_RECONNECT_DELAY;
+  bool escalate = false;
+  #if CONFIG_WIFI_REASON_POLICY
+    escalate = wifiReasonDecide(&action, &delay);
+  #endif // CONFIG_WIFI_REASON_POLICY
+
+  if (_wifiRecoveryStart == 0) {
+    wifiRecoveryBegin(false);
+  } else {
+    _wifiRecoveryAttempts++;
+  };
+
+  // The reason of disconnection may require starting from a higher tier
+  wifi_recovery_tier_t floor = WIFI_TIER_REASSOC;
+  if (escalate) {
+    floor = (wifi_recovery_tier_t)(_wifiRecoveryTier + 1);
+  } else if (action == WIFI_ACTION_SWITCH) {
+    floor = WIFI_TIER_RESCAN;
+  } else if (action == WIFI_ACTION_RESTORE) {
+    floor = WIFI_TIER_RESTORE;
+  };
+
+  if (floor > _wifiRecoveryTier) {
+    wifiRecoveryEnter(floor);
+  } else {
+    wifi_recovery_budget_t* budget = &_wifiRecoveryBudget[_wifiRecoveryTier];
+    if (((budget->attempts > 0) && (_wifiRecoveryAttempts > budget->attempts))
+     || ((budget->time > 0) && ((esp_timer_get_time() - _wifiRecoveryTierStart) > (int64_t)budget->time * 1000))) {
+      wifiRecoveryEnter((wifi_recovery_tier_t)(_wifiRecoveryTier + 1));
+    };
+  };
+
+  return wifiRecoveryExecute(delay);
+}
+
+bool wifiRecoveryBudgetSet(wifi_recovery_tier_t tier, uint8_t attempts, uint32_t time_ms)
+{
+  if (tier >= WIFI_TIER_MAX) return false;
+  _wifiRecoveryBudget[tier].attempts = attempts;
+  _wifiRecoveryBudget[tier].time = time_ms;
+  _wifiRecoveryCustom[tier] = true;
+  return true;
+}
+
+wifi_recovery_stats_t wifiRecoveryStatsGet(wifi_recovery_tier_t tier)
+{
+  wifi_recovery_stats_t stats;
+  memset(&stats, 0, sizeof(wifi_recovery_stats_t));
+  if (tier < WIFI_TIER_MAX) {
+    stats = _wifiRecoveryStats[tier];
+  };
+  return stats;
+}
+
+char* wifiRecoveryGetJson()
+{
+  char* json = nullptr;
+  for (uint8_t tier = 0; tier < WIFI_TIER_MAX; tier++) {
+    wifi_recovery_stats_t* stats = &_wifiRecoveryStats[tier];
+    char* item = malloc_stringf("{\"tier\":\"%s\",\"reached\":%d,\"recovered\":%d,\"success_rate\":%d,\"time_avg\":%d,\"time_max\":%d}",
+      wifiRecoveryTierName((wifi_recovery_tier_t)tier), stats->reached, stats->recovered,
+      stats->reached > 0 ? 100 * stats->recovered / stats->reached : 0,
+      stats->recovered > 0 ? stats->time_total / stats->recovered : 0,
+      stats->time_max);
+    if (item) {
+      json = concat_strings_div(json, item, ",");
+      free(item);
+    };
+  };
+  if (json) {
+    char* ret = malloc_stringf("[%s]", json);
+    free(json);
+    return ret;
+  };
+  return nullptr;
+}
+
+#endif // CONFIG_WIFI_RECOVERY_LADDER
+
+// Next connection attempt, STA is started and not connected
+bool wifiReconnectWiFi()
+{
+  rlog_d(logTAG, "WiFi reconnect...");
+  #if CONFIG_WIFI_RECOVERY_LADDER
+    return wifiRecoveryNext();
+  #elif CONFIG_WIFI_REASON_POLICY
+    return wifiReconnectByPolicy();
+  #else
+    // Restore WiFi (if connected) OR stop STA with restart in event handler
+    if (_wifiAttemptCount > WIFI_RESTART_ATTEMPTS) {
+      return wifiRestartWiFi();
+    } else {
+      // Try connecting to another network
+      if (_wifiAttemptCount > WIFI_RECONNECT_ATTEMPTS) {
+        #ifndef CONFIG_WIFI_SSID
+        _wifiIndexNeedChange = true;
+        #endif // CONFIG_WIFI_SSID
+      };
+      #ifdef CONFIG_WIFI_SSID
+        vTaskDelay(pdMS_TO_TICKS(WIFI_RECONNECT_DELAY));
+      #else
+        if (!_wifiIndexNeedChange) {
+          vTaskDelay(pdMS_TO_TICKS(WIFI_RECONNECT_DELAY));
+        };
+      #endif // CONFIG_WIFI_SSID
+      return wifiConnectSTA();
+    };
+  #endif // CONFIG_WIFI_RECOVERY_LADDER
+}
+
+#if CONFIG_WIFI_LINK_SCORE
+static void wifiLinkDelete();
+#endif // CONFIG_WIFI_LINK_SCORE
+
+// After STA is stopped: release the driver or keep it in suspended mode
+static bool wifiStateRelease()
+{
+  if (_wifiSuspendRequested) {
+    wifiStateDispatch(WIFI_FSM_EV_SUSPENDED);
+    #if defined(CONFIG_WIFI_TIMER_RESTART_DEVICE) && CONFIG_WIFI_TIMER_RESTART_DEVICE > 0
+      espRestartTimerBreak(&_wdtRestartWiFi);
+    #endif // CONFIG_WIFI_TIMER_RESTART_DEVICE
+    rlog_i(logTAG, "WiFi STA suspended");
+    return true;
+  };
+  // Delete device restart timer
+  #if defined(CONFIG_WIFI_TIMER_RESTART_DEVICE) && CONFIG_WIFI_TIMER_RESTART_DEVICE > 0
+    espRestartTimerStartM(&_wdtRestartWiFi, RR_WIFI_TIMEOUT, WIFI_TIMER_RESTART_DEVICE, false);
+  #endif // CONFIG_WIFI_TIMER_RESTART_DEVICE
+  wifiTimeoutDelete();
+  #if WIFI_RECONNECT_DELAY_TIMER
+    wifiReconnectDelayDelete();
+  #endif // WIFI_RECONNECT_DELAY_TIMER
+  #if CONFIG_WIFI_BANDWIDTH_AUTO
+    wifiBandwidthDelete();
+  #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+  #if CONFIG_WIFI_LONGRANGE_AUTO
+    wifiLongRangeDelete();
+  #endif // CONFIG_WIFI_LONGRANGE_AUTO
+  #if CONFIG_WIFI_TXPOWER_AUTO
+    wifiTxPowerDelete();
+  #endif // CONFIG_WIFI_TXPOWER_AUTO
+  #if CONFIG_WIFI_LINK_SCORE
+    wifiLinkDelete();
+  #endif // CONFIG_WIFI_LINK_SCORE
+  #if CONFIG_WIFI_RECOVERY_LADDER
+    wifiRecoveryTimerDelete();
+  #endif // CONFIG_WIFI_RECOVERY_LADDER
+  // Low-level deinit
+  return wifiLowLevelDeinit();
+}
+
+static bool wifiStateExecute(wifi_fsm_action_t action)
+{
+  switch (action) {
+    case WIFI_FSM_ACT_START_STA:
+      return _wifiStartSTA();
+    case WIFI_FSM_ACT_RESTART_STA:
+      #if CONFIG_WIFI_RECOVERY_LADDER
+        if (wifiRecoveryReinitPost()) {
+          return true;
+        };
+      #endif // CONFIG_WIFI_RECOVERY_LADDER
+      return _wifiStartSTA();
+    case WIFI_FSM_ACT_CONNECT:
+      return wifiConnectSTA();
+    case WIFI_FSM_ACT_RECONNECT:
+      return wifiReconnectWiFi();
+    case WIFI_FSM_ACT_DISCONNECT:
+      return _wifiDisconnectSTA();
+    case WIFI_FSM_ACT_RESTORE:
+      return _wifiRestoreSTA();
+    case WIFI_FSM_ACT_STOP_STA:
+      return _wifiStopSTA();
+    case WIFI_FSM_ACT_RELEASE:
+      return wifiStateRelease();
+    default:
+      return true;
+  };
+}
+
+// Dispatch the event and perform the action of the transition
+static bool wifiStateHandle(wifi_fsm_event_t event)
+{
+  wifi_fsm_action_t action = wifiStateDispatch(event);
+  if (wifiStateExecute(action)) {
+    return true;
+  };
+  // Failed connection attempt
+  if ((action == WIFI_FSM_ACT_CONNECT) || (action == WIFI_FSM_ACT_RECONNECT) || (action == WIFI_FSM_ACT_RESTORE)) {
+    return wifiStateRecover();
+  };
+  return false;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Background scan --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_SCAN_ENABLE
+
+// The table is sorted by (ssid_hash, bssid) and contains the strongest access points
+static wifi_scan_record_t _wifiScanTable[CONFIG_WIFI_SCAN_TABLE_SIZE];
+static uint8_t _wifiScanCount = 0;
+static portMUX_TYPE _wifiScanLock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t _wifiScanTimer = nullptr;
+static uint32_t _wifiScanInterval = CONFIG_WIFI_SCAN_INTERVAL;
+static volatile bool _wifiScanActive = false;
+// The scan was started by us (and may already be cancelled): WIFI_EVENT_SCAN_DONE is still expected
+static volatile bool _wifiScanOwned = false;
+
+// FNV-1a
+uint32_t wifiSsidHash(const char* ssid)
+{
+  uint32_t hash = 2166136261UL;
+  if (ssid) {
+    while (*ssid) {
+      hash ^= (uint8_t)*ssid++;
+      hash *= 16777619UL;
+    };
+  };
+  return hash;
+}
+
+static int wifiScanCompare(uint32_t hash, const uint8_t* bssid, const wifi_scan_record_t* record)
+{
+  if (hash != record->ssid_hash) {
+    return hash < record->ssid_hash ? -1 : 1;
+  };
+  return memcmp(bssid, record->bssid, sizeof(record->bssid));
+}
+
+static uint32_t wifiScanNow()
+{
+  return (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+// Add or update a record, when the table is full the weakest record is displaced (top-K by RSSI)
+static void wifiScanInsert(const wifi_ap_record_t* ap, uint32_t now)
+{
+  uint32_t hash = wifiSsidHash((const char*)ap->ssid);
+  portENTER_CRITICAL(&_wifiScanLock);
+  // Binary search for position
+  uint8_t lo = 0, hi = _wifiScanCount;
+  while (lo < hi) {
+    uint8_t mid = (lo + hi) / 2;
+    if (wifiScanCompare(hash, ap->bssid, &_wifiScanTable[mid]) > 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    };
+  };
+  wifi_scan_record_t* record = nullptr;
+  if ((lo < _wifiScanCount) && (wifiScanCompare(hash, ap->bssid, &_wifiScanTable[lo]) == 0)) {
+    // Already known access point
+    record = &_wifiScanTable[lo];
+  } else {
+    if (_wifiScanCount >= CONFIG_WIFI_SCAN_TABLE_SIZE) {
+      uint8_t weakest = 0;
+      for (uint8_t i = 1; i < _wifiScanCount; i++) {
+        if (_wifiScanTable[i].rssi < _wifiScanTable[weakest].rssi) weakest = i;
+      };
+      if (_wifiScanTable[weakest].rssi >= ap->rssi) {
+        portEXIT_CRITICAL(&_wifiScanLock);
+        return;
+      };
+      memmove(&_wifiScanTable[weakest], &_wifiScanTable[weakest + 1], (_wifiScanCount - weakest - 1) * sizeof(wifi_scan_record_t));
+      _wifiScanCount--;
+      if (lo > weakest) lo--;
+    };
+    memmove(&_wifiScanTable[lo + 1], &_wifiScanTable[lo], (_wifiScanCount - lo) * sizeof(wifi_scan_record_t));
+    _wifiScanCount++;
+    record = &_wifiScanTable[lo];
+    record->ssid_hash = hash;
+    memcpy(record->bssid, ap->bssid, sizeof(record->bssid));
+  };
+  record->rssi = ap->rssi;
+  record->channel = ap->primary;
+  record->second = (uint8_t)ap->second;
+  record->authmode = (uint8_t)ap->authmode;
+  record->phy_11n = ap->phy_11n;
+  record->phy_lr = ap->phy_lr;
+  record->last_seen = now;
+  portEXIT_CRITICAL(&_wifiScanLock);
+}
+
+static void wifiScanExpire(uint32_t now)
+{
+  portENTER_CRITICAL(&_wifiScanLock);
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < _wifiScanCount; i++) {
+    if ((now - _wifiScanTable[i].last_seen) <= CONFIG_WIFI_SCAN_MAX_AGE) {
+      if (count != i) _wifiScanTable[count] = _wifiScanTable[i];
+      count++;
+    };
+  };
+  _wifiScanCount = count;
+  portEXIT_CRITICAL(&_wifiScanLock);
+}
+
+static void wifiScanTimerEnd(void* arg)
+{
+  // Scanning only while connected, connection procedure performs its own scan
+  #if CONFIG_WIFI_BANDWIDTH_AUTO
+    if (_wifiBwSampling) return;
+  #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+  if (!_wifiScanActive && wifiStatusCheck(_WIFI_STA_CONNECTED | _WIFI_STA_GOT_IP, false)) {
+    wifi_scan_config_t cfg;
+    memset(&cfg, 0, sizeof(wifi_scan_config_t));
+    cfg.show_hidden = false;
+    cfg.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+    cfg.scan_time.passive = CONFIG_WIFI_SCAN_PASSIVE_TIME;
+    #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+      // Return to the home channel between the scanned channels, so as not to disrupt the traffic
+      cfg.home_chan_dwell_time = CONFIG_WIFI_SCAN_HOME_DWELL;
+    #endif // ESP_IDF_VERSION
+    _wifiScanActive = true;
+    _wifiScanOwned = true;
+    esp_err_t err = esp_wifi_scan_start(&cfg, false);
+    if (err != ESP_OK) {
+      _wifiScanActive = false;
+      _wifiScanOwned = false;
+      rlog_w(logTAG, "Failed to start background scan: %d (%s)", err, esp_err_to_name(err));
+    };
+  };
+}
+
+static void wifiScanCancel()
+{
+  if (_wifiScanActive) {
+    esp_wifi_scan_stop();
+    _wifiScanActive = false;
+  };
+}
+
+static void wifiEventHandler_ScanDone(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  if (!_wifiScanOwned) {
+    // Someone else's scan: results are not ours
+    return;
+  };
+  _wifiScanOwned = false;
+  if (!_wifiScanActive) {
+    // Our scan was cancelled: results are not needed, but the driver keeps the list until the next scan
+    #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)
+      esp_wifi_clear_ap_list();
+    #endif // ESP_IDF_VERSION
+    return;
+  };
+  _wifiScanActive = false;
+  uint32_t now = wifiScanNow();
+  uint16_t count = 0;
+  esp_wifi_scan_get_ap_num(&count);
+  #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+    // Records are taken one at a time, the full array of records is never allocated
+    wifi_ap_record_t ap;
+    for (uint16_t i = 0; i < count; i++) {
+      if (esp_wifi_scan_get_ap_record(&ap) != ESP_OK) break;
+      wifiScanInsert(&ap, now);
+    };
+    esp_wifi_clear_ap_list();
+  #else
+    // Older versions can only return an array, limit it to the table size
+    static wifi_ap_record_t records[CONFIG_WIFI_SCAN_TABLE_SIZE];
+    uint16_t number = CONFIG_WIFI_SCAN_TABLE_SIZE;
+    if (esp_wifi_scan_get_ap_records(&number, records) == ESP_OK) {
+      for (uint16_t i = 0; i < number; i++) {
+        wifiScanInsert(&records[i], now);
+      };
+    };
+  #endif // ESP_IDF_VERSION
+  wifiScanExpire(now);
+  rlog_d(logTAG, "Background scan completed: %d access points found, %d in table", count, _wifiScanCount);
+}
+
+bool wifiScanStart(uint32_t interval_s)
+{
+  if (interval_s == 0) interval_s = CONFIG_WIFI_SCAN_INTERVAL;
+  if (interval_s == 0) return false;
+  _wifiScanInterval = interval_s;
+  if (!_wifiScanTimer) {
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+    timer_args.callback = &wifiScanTimerEnd;
+    timer_args.name = "timer_wifi_scan";
+    WIFI_ERROR_CHECK_BOOL(esp_timer_create(&timer_args, &_wifiScanTimer), "create scan timer");
+  };
+  if (esp_timer_is_active(_wifiScanTimer)) {
+    esp_timer_stop(_wifiScanTimer);
+  };
+  WIFI_ERROR_CHECK_BOOL(esp_timer_start_periodic(_wifiScanTimer, (uint64_t)interval_s * 1000000), "start scan timer");
+  return true;
+}
+
+void wifiScanStop()
+{
+  if (_wifiScanTimer) {
+    if (esp_timer_is_active(_wifiScanTimer)) {
+      esp_timer_stop(_wifiScanTimer);
+    };
+    esp_timer_delete(_wifiScanTimer);
+    _wifiScanTimer = nullptr;
+  };
+  wifiScanCancel();
+}
+
+uint8_t wifiScanGetTable(wifi_scan_record_t* records, uint8_t max_count)
+{
+  if (!records) return 0;
+  portENTER_CRITICAL(&_wifiScanLock);
+  uint8_t count = _wifiScanCount < max_count ? _wifiScanCount : max_count;
+  memcpy(records, _wifiScanTable, count * sizeof(wifi_scan_record_t));
+  portEXIT_CRITICAL(&_wifiScanLock);
+  return count;
+}
+
+bool wifiScanFind(const char* ssid, wifi_scan_record_t* record)
+{
+  uint32_t hash = wifiSsidHash(ssid);
+  int16_t best = -1;
+  portENTER_CRITICAL(&_wifiScanLock);
+  for (uint8_t i = 0; i < _wifiScanCount; i++) {
+    if (_wifiScanTable[i].ssid_hash == hash) {
+      // Several BSSIDs of the same network: the strongest one
+      if ((best < 0) || (_wifiScanTable[i].rssi > _wifiScanTable[best].rssi)) {
+        best = i;
+      };
+    } else if (_wifiScanTable[i].ssid_hash > hash) {
+      break;
+    };
+  };
+  if ((best >= 0) && record) {
+    *record = _wifiScanTable[best];
+  };
+  portEXIT_CRITICAL(&_wifiScanLock);
+  return best >= 0;
+}
+
+char* wifiScanGetJson()
+{
+  wifi_scan_record_t records[CONFIG_WIFI_SCAN_TABLE_SIZE];
+  uint8_t count = wifiScanGetTable(records, CONFIG_WIFI_SCAN_TABLE_SIZE);
+  uint32_t now = wifiScanNow();
+  char* json = nullptr;
+  for (uint8_t i = 0; i < count; i++) {
+    char* item = malloc_stringf("{\"ssid_hash\":%u,\"bssid\":\"%02x:%02x:%02x:%02x:%02x:%02x\",\"rssi\":%d,\"channel\":%d,\"auth\":%d,\"age\":%u}",
+      records[i].ssid_hash, records[i].bssid[0], records[i].bssid[1], records[i].bssid[2], records[i].bssid[3], records[i].bssid[4], records[i].bssid[5],
+      records[i].rssi, records[i].channel, records[i].authmode, now - records[i].last_seen);
+    if (item) {
+      json = concat_strings_div(json, item, ",");
+      free(item);
+    };
+  };
+  if (json) {
+    char* ret = malloc_stringf("[%s]", json);
+    free(json);
+    return ret;
+  };
+  return malloc_stringf("[]");
+}
+
+#endif // CONFIG_WIFI_SCAN_ENABLE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Start statistics --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// Cold start (driver and netif are created from scratch) and warm start (resume from suspended mode) are counted separately
+static wifi_start_stats_t _wifiStartStats[2];
+static int64_t _wifiStartRequest = 0;
+static size_t _wifiStartHeap = 0;
+static bool _wifiStartWarm = false;
+// STA can be started several times per request (recovery restarts), only the first start is counted
+static bool _wifiStartCounted = false;
+
+static void wifiStartMeasureBegin(bool warm)
+{
+  _wifiStartWarm = warm;
+  _wifiStartCounted = false;
+  _wifiStartHeap = esp_get_free_heap_size();
+  _wifiStartRequest = esp_timer_get_time();
+}
+
+static void wifiStartMeasureStarted()
+{
+  if ((_wifiStartRequest > 0) && !_wifiStartCounted) {
+    _wifiStartCounted = true;
+    wifi_start_stats_t* stats = &_wifiStartStats[_wifiStartWarm ? 1 : 0];
+    stats->count++;
+    stats->start_last = (uint32_t)((esp_timer_get_time() - _wifiStartRequest) / 1000);
+    stats->start_total += stats->start_last;
+  };
+}
+
+// The start was cancelled by wifiStop() / wifiSuspend() before the IP address was received
+static void wifiStartMeasureCancel()
+{
+  _wifiStartRequest = 0;
+}
+
+static void wifiStartMeasureGotIP()
+{
+  if (_wifiStartRequest > 0) {
+    wifi_start_stats_t* stats = &_wifiStartStats[_wifiStartWarm ? 1 : 0];
+    stats->ip_last = (uint32_t)((esp_timer_get_time() - _wifiStartRequest) / 1000);
+    stats->ip_total += stats->ip_last;
+    stats->heap_delta = (int32_t)_wifiStartHeap - (int32_t)esp_get_free_heap_size();
+    _wifiStartRequest = 0;
+    rlog_i(logTAG, "WiFi %s start: STA started in %d ms, IP received in %d ms, heap used: %d bytes", 
+      _wifiStartWarm ? "warm" : "cold", stats->start_last, stats->ip_last, stats->heap_delta);
+  };
+}
+
+wifi_start_stats_t wifiStartStatsGet(bool warm)
+{
+  return _wifiStartStats[warm ? 1 : 0];
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Gateway latency --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_RTT_PROBE
+
+#define WIFI_RTT_ENTRIES 5
+
+static uint16_t _wifiRttInterval = CONFIG_WIFI_RTT_INTERVAL;
+static uint16_t _wifiRttThreshold = CONFIG_WIFI_RTT_THRESHOLD;
+static wifi_rtt_hist_t _wifiRttHist;     // Replies and timeouts in the window, see reWiFiRtt.h
+static uint32_t _wifiRttSamples = 0;     // Replies since boot
+static uint32_t _wifiRttLast = 0;
+static uint32_t _wifiRttJitter = 0;      // ms * 16 (RFC 3550 estimator)
+static portMUX_TYPE _wifiRttLock = portMUX_INITIALIZER_UNLOCKED;
+static esp_ping_handle_t _wifiRttPing = nullptr;
+static wifi_rtt_stats_t _wifiRttPublished;        // Snapshot registered in the parameters
+static paramsEntryHandle_t _wifiRttEntries[WIFI_RTT_ENTRIES];
+static esp_timer_handle_t _wifiRttTimer = nullptr;
+
+// Called from the ping task
+static void wifiRttOnSuccess(esp_ping_handle_t hdl, void* args)
+{
+  uint32_t elapsed = 0;
+  esp_ping_get_profile(hdl, ESP_PING_PROF_TIMEGAP, &elapsed, sizeof(elapsed));
+  portENTER_CRITICAL(&_wifiRttLock);
+  if (_wifiRttSamples > 0) {
+    uint32_t d = elapsed > _wifiRttLast ? elapsed - _wifiRttLast : _wifiRttLast - elapsed;
+    _wifiRttJitter = _wifiRttJitter + d - _wifiRttJitter / 16;
+  };
+  _wifiRttLast = elapsed;
+  _wifiRttSamples++;
+  wifiRttHistPut(&_wifiRttHist, elapsed, CONFIG_WIFI_RTT_WINDOW);
+  portEXIT_CRITICAL(&_wifiRttLock);
+}
+
+static void wifiRttOnTimeout(esp_ping_handle_t hdl, void* args)
+{
+  portENTER_CRITICAL(&_wifiRttLock);
+  wifiRttHistLost(&_wifiRttHist, CONFIG_WIFI_RTT_WINDOW);
+  portEXIT_CRITICAL(&_wifiRttLock);
+}
+
+// Called when IP is received
+static void wifiRttStart(uint32_t gateway)
+{
+  if (_wifiRttPing || (gateway == 0)) return;
+  esp_ping_config_t config = ESP_PING_DEFAULT_CONFIG();
+  ip_addr_set_ip4_u32_val(config.target_addr, gateway);
+  config.count = ESP_PING_COUNT_INFINITE;
+  config.interval_ms = (uint32_t)(_wifiRttInterval > 0 ? _wifiRttInterval : CONFIG_WIFI_RTT_INTERVAL) * 1000;
+  config.timeout_ms = CONFIG_WIFI_RTT_TIMEOUT;
+  config.data_size = 8;
+  esp_ping_callbacks_t cbs;
+  memset(&cbs, 0, sizeof(esp_ping_callbacks_t));
+  cbs.on_ping_success = wifiRttOnSuccess;
+  cbs.on_ping_timeout = wifiRttOnTimeout;
+  esp_err_t err = esp_ping_new_session(&config, &cbs, &_wifiRttPing);
+  if (err == ESP_OK) {
+    err = esp_ping_start(_wifiRttPing);
+  };
+  if (err != ESP_OK) {
+    rlog_e(logTAG, "Failed to start gateway RTT probe: %d (%s)", err, esp_err_to_name(err));
+    if (_wifiRttPing) {
+      esp_ping_delete_session(_wifiRttPing);
+      _wifiRttPing = nullptr;
+    };
+    return;
+  };
+  if (_wifiRttTimer && !esp_timer_is_active(_wifiRttTimer)) {
+    esp_timer_start_periodic(_wifiRttTimer, (uint64_t)CONFIG_WIFI_RTT_PUBLISH_INTERVAL * 1000000);
+  };
+}
+
+// Called when the connection is lost or STA is stopped
+static void wifiRttStop()
+{
+  if (_wifiRttTimer && esp_timer_is_active(_wifiRttTimer)) {
+    esp_timer_stop(_wifiRttTimer);
+  };
+  if (_wifiRttPing) {
+    esp_ping_stop(_wifiRttPing);
+    esp_ping_delete_session(_wifiRttPing);
+    _wifiRttPing = nullptr;
+  };
+}
+
+wifi_rtt_stats_t wifiRttStatsGet()
+{
+  wifi_rtt_hist_t hist;
+  wifi_rtt_stats_t stats;
+  portENTER_CRITICAL(&_wifiRttLock);
+  hist = _wifiRttHist;
+  stats.last = (uint16_t)_wifiRttLast;
+  stats.jitter = (uint16_t)((_wifiRttJitter + 8) / 16);
+  stats.samples = _wifiRttSamples;
+  portEXIT_CRITICAL(&_wifiRttLock);
+  stats.p50 = wifiRttHistPercentile(&hist, 50, CONFIG_WIFI_RTT_TIMEOUT);
+  stats.p95 = wifiRttHistPercentile(&hist, 95, CONFIG_WIFI_RTT_TIMEOUT);
+  stats.p99 = wifiRttHistPercentile(&hist, 99, CONFIG_WIFI_RTT_TIMEOUT);
+  stats.loss = wifiRttHistLoss(&hist);
+  return stats;
+}
+
+char* wifiRttGetJson()
+{
+  wifi_rtt_stats_t stats = wifiRttStatsGet();
+  return malloc_stringf("{\"p50\":%d,\"p95\":%d,\"p99\":%d,\"jitter\":%d,\"last\":%d,\"loss\":%d,\"samples\":%u}",
+    stats.p50, stats.p95, stats.p99, stats.jitter, stats.last, stats.loss, stats.samples);
+}
+
+bool wifiRttIsOk()
+{
+  if (!wifiStatusCheck(_WIFI_STA_GOT_IP, false)) return false;
+  wifi_rtt_stats_t stats = wifiRttStatsGet();
+  return (stats.samples > 0) && (stats.p95 <= _wifiRttThreshold);
+}
+
+static void wifiRttTimerEnd(void* arg)
+{
+  _wifiRttPublished = wifiRttStatsGet();
+  for (uint8_t i = 0; i < WIFI_RTT_ENTRIES; i++) {
+    if (_wifiRttEntries[i]) {
+      paramsValueStore(_wifiRttEntries[i], false);
+    };
+  };
+}
+
+static void wifiRttRegister(paramsGroupHandle_t pgWifi)
+{
+  paramsGroupHandle_t pgRtt = paramsRegisterGroup(pgWifi, 
+    CONFIG_WIFI_RTT_PGROUP_KEY, CONFIG_WIFI_RTT_PGROUP_TOPIC, CONFIG_WIFI_RTT_PGROUP_FRIENDLY);
+  // Local data: published only, not subscribed and not stored
+  uint8_t i = 0;
+  _wifiRttEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U16, nullptr, pgRtt, 
+    "p50", "RTT p50, ms", CONFIG_WIFI_RTT_QOS, &_wifiRttPublished.p50);
+  _wifiRttEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U16, nullptr, pgRtt, 
+    "p95", "RTT p95, ms", CONFIG_WIFI_RTT_QOS, &_wifiRttPublished.p95);
+  _wifiRttEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U16, nullptr, pgRtt, 
+    "p99", "RTT p99, ms", CONFIG_WIFI_RTT_QOS, &_wifiRttPublished.p99);
+  _wifiRttEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U16, nullptr, pgRtt, 
+    "jitter", "RTT jitter, ms", CONFIG_WIFI_RTT_QOS, &_wifiRttPublished.jitter);
+  _wifiRttEntries[i++] = paramsRegisterValue(OPT_KIND_LOCDATA_ONLINE, OPT_TYPE_U8, nullptr, pgRtt, 
+    "loss", "RTT loss, %", CONFIG_WIFI_RTT_QOS, &_wifiRttPublished.loss);
+
+  // The timer runs only while the probe is active, see wifiRttStart()
+  if (!_wifiRttTimer) {
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+    timer_args.callback = &wifiRttTimerEnd;
+    timer_args.name = "timer_wifi_rtt";
+    if (esp_timer_create(&timer_args, &_wifiRttTimer) != ESP_OK) {
+      rlog_e(logTAG, "Failed to create WiFi RTT timer");
+    };
+  };
+}
+
+#endif // CONFIG_WIFI_RTT_PROBE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ Link quality ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_LINK_SCORE
+
+#define WIFI_LINK_FLAPS 4
+
+static wifi_link_quality_t _wifiLink;
+static int64_t _wifiLinkFlaps[WIFI_LINK_FLAPS];   // Time of the last disconnections, us
+static uint8_t _wifiLinkFlapNext = 0;
+static portMUX_TYPE _wifiLinkLock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t _wifiLinkTimer = nullptr;
+
+static uint8_t wifiLinkClamp(int32_t value)
+{
+  return value < 0 ? 0 : (value > 100 ? 100 : (uint8_t)value);
+}
+
+static uint8_t wifiLinkFlapCount()
+{
+  int64_t since = esp_timer_get_time() - (int64_t)CONFIG_WIFI_LINK_FLAP_WINDOW * 1000000;
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < WIFI_LINK_FLAPS; i++) {
+    if ((_wifiLinkFlaps[i] > 0) && (_wifiLinkFlaps[i] > since)) count++;
+  };
+  return count;
+}
+
+// connected = false - the connection is being closed, only the flap history is kept and the score is zero
+static void wifiLinkUpdate(bool connected)
+{
+  wifi_link_quality_t link;
+  memset(&link, 0, sizeof(wifi_link_quality_t));
+  link.retry = WIFI_LINK_NA;
+  link.rtt = WIFI_LINK_NA;
+  link.flap_count = wifiLinkFlapCount();
+
+  if (connected && wifiStatusCheck(_WIFI_STA_GOT_IP, false) && wifiRssiSmoothed(&link.rssi_avg)) {
+    // Signal: 50 at the RSSI threshold, 0..100 within +/- CONFIG_WIFI_LINK_RSSI_SPAN dB
+    int32_t margin = (int32_t)link.rssi_avg + _wifiRssiThreshold;
+    link.rssi = wifiLinkClamp(50 + margin * 50 / CONFIG_WIFI_LINK_RSSI_SPAN);
+    uint32_t weighted = (uint32_t)link.rssi * 3;
+    uint8_t weights = 3;
+    #if CONFIG_WIFI_BANDWIDTH_AUTO
+      if (_wifiBwStats[wifiNetworkSlot()].measured > 0) {
+        link.retry = wifiLinkClamp(100 - (int32_t)_wifiBwApRetry * 100 / CONFIG_WIFI_LINK_RETRY_MAX);
+        weighted += (uint32_t)link.retry * 2;
+        weights += 2;
+      };
+    #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+    #if CONFIG_WIFI_RTT_PROBE
+      wifi_rtt_stats_t rtt = wifiRttStatsGet();
+      if (rtt.samples > 0) {
+        // 100 at zero delay, 50 at the RTT threshold parameter; each lost request costs 2 points
+        uint16_t threshold = _wifiRttThreshold > 0 ? _wifiRttThreshold : 1;
+        link.rtt = wifiLinkClamp(100 - (int32_t)rtt.p95 * 50 / threshold - (int32_t)rtt.loss * 2);
+        weighted += (uint32_t)link.rtt * 2;
+        weights += 2;
+      };
+    #endif // CONFIG_WIFI_RTT_PROBE
+    link.flaps = wifiLinkClamp(100 - (int32_t)link.flap_count * 34);
+    weighted += (uint32_t)link.flaps * 3;
+    weights += 3;
+    // Power save delays the delivery of buffered frames until the next beacon
+    wifi_ps_type_t ps = WIFI_PS_NONE;
+    esp_wifi_get_ps(&ps);
+    link.power = ps == WIFI_PS_MAX_MODEM ? 75 : (ps == WIFI_PS_MIN_MODEM ? 90 : 100);
+    link.score = (uint8_t)(weighted / weights * link.power / 100);
+  };
+
+  portENTER_CRITICAL(&_wifiLinkLock);
+  _wifiLink = link;
+  portEXIT_CRITICAL(&_wifiLinkLock);
+}
+
+static void wifiLinkTimerEnd(void* arg)
+{
+  wifiLinkUpdate(true);
+}
+
+// Called when IP is received
+static void wifiLinkConnected()
+{
+  wifiLinkUpdate(true);
+  if (!_wifiLinkTimer) {
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+    timer_args.callback = &wifiLinkTimerEnd;
+    timer_args.name = "timer_wifi_link";
+    if (esp_timer_create(&timer_args, &_wifiLinkTimer) != ESP_OK) {
+      rlog_e(logTAG, "Failed to create link quality timer");
+      return;
+    };
+  };
+  if (!esp_timer_is_active(_wifiLinkTimer)) {
+    esp_timer_start_periodic(_wifiLinkTimer, (uint64_t)CONFIG_WIFI_LINK_SCORE_INTERVAL * 1000000);
+  };
+}
+
+// Called when the connection is lost or STA is stopped; flap - the established connection was lost
+static void wifiLinkCancel(bool flap)
+{
+  if (_wifiLinkTimer && esp_timer_is_active(_wifiLinkTimer)) {
+    esp_timer_stop(_wifiLinkTimer);
+  };
+  if (flap) {
+    _wifiLinkFlaps[_wifiLinkFlapNext] = esp_timer_get_time();
+    _wifiLinkFlapNext = (_wifiLinkFlapNext + 1) % WIFI_LINK_FLAPS;
+  };
+  // GOT_IP may still be set at this moment, so the score is zeroed explicitly
+  wifiLinkUpdate(false);
+}
+
+static void wifiLinkDelete()
+{
+  wifiLinkCancel(false);
+  if (_wifiLinkTimer) {
+    esp_timer_delete(_wifiLinkTimer);
+    _wifiLinkTimer = nullptr;
+  };
+}
+
+uint8_t wifiLinkScore()
+{
+  return _wifiLink.score;
+}
+
+wifi_link_quality_t wifiLinkQualityGet()
+{
+  wifi_link_quality_t link;
+  portENTER_CRITICAL(&_wifiLinkLock);
+  link = _wifiLink;
+  portEXIT_CRITICAL(&_wifiLinkLock);
+  return link;
+}
+
+uint32_t wifiLinkAdmit(size_t bytes)
+{
+  if (!wifiStatusCheck(_WIFI_STA_GOT_IP, false)) return CONFIG_WIFI_LINK_RETRY_DELAY_MAX;
+  uint8_t required = bytes >= CONFIG_WIFI_LINK_BULK_SIZE ? CONFIG_WIFI_LINK_BULK_SCORE : CONFIG_WIFI_LINK_ADMIT_SCORE;
+  uint8_t score = _wifiLink.score;
+  if (score >= required) return 0;
+  // The score changes no faster than once per interval: the larger the deficit, the more intervals to wait
+  uint32_t delay = (uint32_t)CONFIG_WIFI_LINK_SCORE_INTERVAL * 1000 * (1 + (required - score) / 10);
+  return delay < CONFIG_WIFI_LINK_RETRY_DELAY_MAX ? delay : CONFIG_WIFI_LINK_RETRY_DELAY_MAX;
+}
+
+#endif // CONFIG_WIFI_LINK_SCORE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Deferred queue ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_DEFER_QUEUE
+
+typedef enum {
+  WIFI_DEFER_FILLING = 0,         // Payload is being copied by the sender
+  WIFI_DEFER_READY,
+  WIFI_DEFER_RUNNING,
+  WIFI_DEFER_DONE                 // Waiting for the release of the buffer in the order of allocation
+} wifi_defer_state_t;
+
+typedef struct {
+  wifi_defer_cb_t callback;
+  void* arg;
+  int64_t posted;
+  uint16_t offset;
+  uint16_t size;
+  uint16_t pad;                   // Unused tail of the buffer skipped when wrapping
+  uint8_t priority;
+  uint8_t state;
+  uint8_t attempts;
+} wifi_defer_job_t;
+
+// Jobs are stored in the order of allocation, so the payload buffer is released as a ring
+static wifi_defer_job_t _wifiDeferJobs[CONFIG_WIFI_DEFER_JOBS];
+static uint8_t _wifiDeferBuf[CONFIG_WIFI_DEFER_BUFFER];
+static uint16_t _wifiDeferFirst = 0;
+static uint16_t _wifiDeferCount = 0;
+static uint32_t _wifiDeferHead = 0;
+static uint32_t _wifiDeferTail = 0;
+static uint32_t _wifiDeferUsed = 0;
+static uint64_t _wifiDeferWaitTotal = 0;
+static wifi_defer_stats_t _wifiDeferStats;
+static portMUX_TYPE _wifiDeferLock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t _wifiDeferTask = nullptr;
+static volatile bool _wifiDeferFlush = false;
+
+// Called under the lock; returns the offset or -1 if there is no contiguous space
+static int32_t wifiDeferAlloc(uint32_t size, uint16_t* pad)
+{
+  *pad = 0;
+  // Zero-size jobs take no space, but their release still follows the order of allocation
+  if (_wifiDeferCount == 0) {
+    _wifiDeferHead = 0;
+    _wifiDeferTail = 0;
+  };
+  if (size == 0) return (int32_t)_wifiDeferHead;
+  if ((_wifiDeferUsed > 0) && (_wifiDeferHead == _wifiDeferTail)) return -1;
+  if (_wifiDeferHead >= _wifiDeferTail) {
+    if (size <= CONFIG_WIFI_DEFER_BUFFER - _wifiDeferHead) return (int32_t)_wifiDeferHead;
+    if (size <= _wifiDeferTail) {
+      *pad = (uint16_t)(CONFIG_WIFI_DEFER_BUFFER - _wifiDeferHead);
+      return 0;
+    };
+    return -1;
+  };
+  return size <= _wifiDeferTail - _wifiDeferHead ? (int32_t)_wifiDeferHead : -1;
+}
+
+// Called under the lock
+static void wifiDeferRelease()
+{
+  while ((_wifiDeferCount > 0) && (_wifiDeferJobs[_wifiDeferFirst].state == WIFI_DEFER_DONE)) {
+    wifi_defer_job_t* job = &_wifiDeferJobs[_wifiDeferFirst];
+    if (job->size > 0) {
+      _wifiDeferTail = (uint32_t)job->offset + job->size;
+    };
+    _wifiDeferUsed -= (uint32_t)job->pad + job->size;
+    _wifiDeferFirst = (_wifiDeferFirst + 1) % CONFIG_WIFI_DEFER_JOBS;
+    _wifiDeferCount--;
+  };
+  _wifiDeferStats.depth = _wifiDeferCount;
+  _wifiDeferStats.bytes = _wifiDeferUsed;
+}
+
+bool wifiDeferPost(wifi_defer_cb_t callback, const void* data, size_t size, wifi_defer_priority_t priority, void* arg)
+{
+  if (!callback || (size > CONFIG_WIFI_DEFER_BUFFER) || (size && !data)) return false;
+  uint16_t pad = 0;
+  int32_t offset = -1;
+  wifi_defer_job_t* job = nullptr;
+  portENTER_CRITICAL(&_wifiDeferLock);
+  if (_wifiDeferCount < CONFIG_WIFI_DEFER_JOBS) {
+    offset = wifiDeferAlloc(size, &pad);
+  };
+  if (offset >= 0) {
+    job = &_wifiDeferJobs[(_wifiDeferFirst + _wifiDeferCount) % CONFIG_WIFI_DEFER_JOBS];
+    job->callback = callback;
+    job->arg = arg;
+    job->posted = esp_timer_get_time();
+    job->offset = (uint16_t)offset;
+    job->size = (uint16_t)size;
+    job->pad = pad;
+    job->priority = (uint8_t)priority;
+    job->state = WIFI_DEFER_FILLING;
+    job->attempts = 0;
+    _wifiDeferHead = (uint32_t)offset + size;
+    _wifiDeferUsed += (uint32_t)pad + size;
+    _wifiDeferCount++;
+    _wifiDeferStats.posted++;
+    _wifiDeferStats.depth = _wifiDeferCount;
+    _wifiDeferStats.bytes = _wifiDeferUsed;
+    if (_wifiDeferStats.depth_max < _wifiDeferCount) _wifiDeferStats.depth_max = _wifiDeferCount;
+  } else {
+    _wifiDeferStats.dropped++;
+  };
+  portEXIT_CRITICAL(&_wifiDeferLock);
+  if (!job) {
+    rlog_w(logTAG, "Deferred queue is full, job dropped");
+    return false;
+  };
+
+  // The region is reserved, the payload is copied outside the critical section
+  if (size) {
+    memcpy(&_wifiDeferBuf[job->offset], data, size);
+  };
+  portENTER_CRITICAL(&_wifiDeferLock);
+  job->state = WIFI_DEFER_READY;
+  portEXIT_CRITICAL(&_wifiDeferLock);
+  if (_wifiDeferTask && (priority >= WIFI_DEFER_HIGH)) {
+    xTaskNotify(_wifiDeferTask, 0, eNoAction);
+  };
+  return true;
+}
+
+void wifiDeferFlush()
+{
+  _wifiDeferFlush = true;
+  if (_wifiDeferTask) {
+    xTaskNotify(_wifiDeferTask, 0, eNoAction);
+  };
+}
+
+wifi_defer_stats_t wifiDeferStatsGet()
+{
+  wifi_defer_stats_t stats;
+  portENTER_CRITICAL(&_wifiDeferLock);
+  stats = _wifiDeferStats;
+  uint32_t done = _wifiDeferStats.executed + _wifiDeferStats.failed;
+  stats.wait_avg = done > 0 ? (uint32_t)(_wifiDeferWaitTotal / done) : 0;
+  portEXIT_CRITICAL(&_wifiDeferLock);
+  return stats;
+}
+
+// Whether the batch should be started now: enough jobs, an urgent job, or the oldest job waits too long
+static bool wifiDeferDue(uint32_t* bytes)
+{
+  bool due = _wifiDeferFlush;
+  int64_t expired = esp_timer_get_time() - (int64_t)CONFIG_WIFI_DEFER_MAX_DELAY * 1000000;
+  uint16_t ready = 0;
+  *bytes = 0;
+  portENTER_CRITICAL(&_wifiDeferLock);
+  for (uint16_t i = 0; i < _wifiDeferCount; i++) {
+    wifi_defer_job_t* job = &_wifiDeferJobs[(_wifiDeferFirst + i) % CONFIG_WIFI_DEFER_JOBS];
+    if (job->state != WIFI_DEFER_READY) continue;
+    ready++;
+    *bytes += job->size;
+    if ((job->priority >= WIFI_DEFER_HIGH) || (job->posted < expired)) due = true;
+  };
+  portEXIT_CRITICAL(&_wifiDeferLock);
+  if (ready == 0) {
+    _wifiDeferFlush = false;
+    return false;
+  };
+  return due || (ready >= CONFIG_WIFI_DEFER_BATCH) || (*bytes >= CONFIG_WIFI_DEFER_BUFFER / 2);
 }
 
-bool wifiConnectSTA()
+static bool wifiDeferLinkOk(uint32_t bytes)
 {
-  // Wi-Fi Configuration Phase
-  // https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-configuration-phase
-
-  wifi_config_t conf;
-  memset(&conf, 0, sizeof(wifi_config_t));
-  #ifdef CONFIG_WIFI_SSID
-    // Single network mode
-    strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_SSID);
-    strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_PASS);
+  #if CONFIG_WIFI_LINK_SCORE
+    return wifiLinkAdmit(bytes) == 0;
   #else
-    // Multi-network mode
-    if (_wifiCurrIndex == 0) {
-      _wifiMaxIndex = wifiGetMaxIndex();
-      _wifiIndexNeedChange = false;
-      _wifiIndexWasChanged = false;
-      nvsRead(wifiNvsGroup, wifiNvsIndex, OPT_TYPE_U8, &_wifiCurrIndex);
-      if (_wifiCurrIndex == 0) {
-        _wifiCurrIndex = 1;
-        _wifiIndexNeedChange = true;
-        _wifiIndexWasChanged = true;
-      };
-    } else {
-      if (_wifiIndexNeedChange) {
-        if (++_wifiCurrIndex > _wifiMaxIndex) {
-          _wifiCurrIndex = 1;
-        };
-        rlog_d(logTAG, "Attempting to connect to another access point: %d", _wifiCurrIndex);
-        _wifiIndexWasChanged = true;
+    return wifiRSSIIsOk();
+  #endif // CONFIG_WIFI_LINK_SCORE
+}
+
+// Executes ready jobs in order of priority (older first among equal), returns false if a job has failed
+static bool wifiDeferRunBatch()
+{
+  while (true) {
+    wifi_defer_job_t* job = nullptr;
+    portENTER_CRITICAL(&_wifiDeferLock);
+    for (uint16_t i = 0; i < _wifiDeferCount; i++) {
+      wifi_defer_job_t* item = &_wifiDeferJobs[(_wifiDeferFirst + i) % CONFIG_WIFI_DEFER_JOBS];
+      if ((item->state == WIFI_DEFER_READY) && (!job || (item->priority > job->priority))) {
+        job = item;
       };
     };
-
-    switch (_wifiCurrIndex) {
-      case 1:
-        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_1_SSID);
-        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_1_PASS);
-        break;
-      #ifdef CONFIG_WIFI_2_SSID
-      case 2:
-        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_2_SSID);
-        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_2_PASS);
-        break;
-      #endif // CONFIG_WIFI_2_SSID
-      #ifdef CONFIG_WIFI_3_SSID
-      case 3:
-        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_3_SSID);
-        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_3_PASS);
-        break;
-      #endif // CONFIG_WIFI_3_SSID
-      #ifdef CONFIG_WIFI_4_SSID
-      case 4:
-        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_4_SSID);
-        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_4_PASS);
-        break;
-      #endif // CONFIG_WIFI_4_SSID
-      #ifdef CONFIG_WIFI_5_SSID
-      case 5:
-        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_5_SSID);
-        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_5_PASS);
-        break;
-      #endif // CONFIG_WIFI_5_SSID
-      default:
-        strcpy(reinterpret_cast<char*>(conf.sta.ssid), CONFIG_WIFI_1_SSID);
-        strcpy(reinterpret_cast<char*>(conf.sta.password), CONFIG_WIFI_1_PASS);
-        break;
+    if (job) {
+      job->state = WIFI_DEFER_RUNNING;
     };
-  #endif // CONFIG_WIFI_SSID
-  
-  // Select the best access point based on signal strength (MESH systems only)
-  conf.sta.rm_enabled = true;
-  conf.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
-  conf.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    portEXIT_CRITICAL(&_wifiDeferLock);
+    if (!job) return true;
 
-  // Support for Protected Management Frame
-  conf.sta.pmf_cfg.capable = true;
-  conf.sta.pmf_cfg.required = false;
+    uint32_t wait = (uint32_t)((esp_timer_get_time() - job->posted) / 1000);
+    bool ok = job->callback(job->size ? &_wifiDeferBuf[job->offset] : nullptr, job->size, job->arg);
 
-  // Configure WiFi
-  WIFI_ERROR_CHECK_BOOL(esp_wifi_set_config(WIFI_IF_STA, &conf), "set the configuration of the ESP32 STA");
+    portENTER_CRITICAL(&_wifiDeferLock);
+    if (ok || (++job->attempts >= CONFIG_WIFI_DEFER_ATTEMPTS)) {
+      job->state = WIFI_DEFER_DONE;
+      if (ok) {
+        _wifiDeferStats.executed++;
+      } else {
+        _wifiDeferStats.failed++;
+      };
+      _wifiDeferWaitTotal += wait;
+      if (_wifiDeferStats.wait_max < wait) _wifiDeferStats.wait_max = wait;
+      wifiDeferRelease();
+    } else {
+      job->state = WIFI_DEFER_READY;
+    };
+    portEXIT_CRITICAL(&_wifiDeferLock);
+    if (!ok) return false;
+    // The quality may change during the batch
+    if (!wifiStatusCheck(_WIFI_STA_GOT_IP, false)) return false;
+  };
+}
 
-  // Wi-Fi Connect Phase
-  // https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-connect-phase
-  _wifiAttemptCount++;
-  rlog_i(logTAG, "Connecting to WiFi network [ %s ], attempt %d...", reinterpret_cast<char*>(conf.sta.ssid), _wifiAttemptCount);
-  wifiTimeoutStart(CONFIG_WIFI_TIMEOUT);
-  WIFI_ERROR_CHECK_BOOL(esp_wifi_connect(), "сonnect the ESP32 WiFi station to the AP");
+static void wifiDeferTaskExec(void* arg)
+{
+  int64_t online = 0;
+  while (true) {
+    xTaskNotifyWait(0, 0, nullptr, pdMS_TO_TICKS(CONFIG_WIFI_DEFER_CHECK_INTERVAL));
+    // The task is no longer registered, see wifiDeferFree()
+    if (_wifiDeferTask != xTaskGetCurrentTaskHandle()) break;
+    if (!wifiStatusCheck(_WIFI_STA_GOT_IP, false)) {
+      online = 0;
+      continue;
+    };
+    int64_t now = esp_timer_get_time();
+    if (online == 0) online = now;
+    if (now - online < (int64_t)CONFIG_WIFI_DEFER_STABLE * 1000000) continue;
+    uint32_t bytes = 0;
+    if (wifiDeferDue(&bytes) && wifiDeferLinkOk(bytes)) {
+      _wifiDeferFlush = false;
+      portENTER_CRITICAL(&_wifiDeferLock);
+      _wifiDeferStats.batches++;
+      portEXIT_CRITICAL(&_wifiDeferLock);
+      wifiDeferRunBatch();
+    };
+  };
+  vTaskDelete(nullptr);
+}
 
+static bool wifiDeferInit()
+{
+  if (_wifiDeferTask) return true;
+  if (xTaskCreate(wifiDeferTaskExec, "wifi_defer", CONFIG_WIFI_DEFER_STACK_SIZE, nullptr, CONFIG_WIFI_DEFER_PRIORITY, &_wifiDeferTask) != pdPASS) {
+    _wifiDeferTask = nullptr;
+    rlog_e(logTAG, "Failed to create deferred queue task");
+    return false;
+  };
   return true;
 }
 
+// The task finishes the current batch and deletes itself; jobs left in the queue are executed after the next wifiInit()
+static void wifiDeferFree()
+{
+  if (_wifiDeferTask) {
+    // Notified before clearing: the task exits only after the handle is cleared, so the handle is still valid here
+    xTaskNotify(_wifiDeferTask, 0, eNoAction);
+    _wifiDeferTask = nullptr;
+  };
+}
+
+#endif // CONFIG_WIFI_DEFER_QUEUE
+
 // -----------------------------------------------------------------------------------------------------------------------
-// --------------------------------------------------- Internal functions ------------------------------------------------
+// ------------------------------------------------- Connection parameters -----------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-bool _wifiStartSTA()
+#if CONFIG_WIFI_TUNABLES
+
+#define WIFI_TUNABLES_COUNT 6
+
+static wifi_tunables_t _wifiTunablesParams;      // Registered as parameters, becomes live only after validation
+static wifi_tunables_t _wifiTunablesGood;        // Last values confirmed by a stable connection
+static int64_t _wifiTunablesChanged = 0;         // Start of the probation, 0 - no probation
+static volatile uint8_t _wifiTunablesFlaps = 0;
+static bool _wifiTunablesGotIP = false;
+static uint16_t _wifiTunablesRollbacks = 0;
+static paramsEntryHandle_t _wifiTunablesEntries[WIFI_TUNABLES_COUNT];
+static esp_timer_handle_t _wifiTunablesTimer = nullptr;
+static portMUX_TYPE _wifiTunablesLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Makes the values live: the WIFI_* macros read _wifiTunables, the tables are updated here
+static void wifiTunablesApply(const wifi_tunables_t* value)
 {
-  rlog_i(logTAG, "Start WiFi STA mode...");
-  WIFI_ERROR_CHECK_BOOL(esp_wifi_set_mode(WIFI_MODE_STA), "set the WiFi operating mode");
-  #ifdef CONFIG_WIFI_BANDWIDTH
-    // Theoretically the HT40 can gain better throughput because the maximum raw physicial 
-    // (PHY) data rate for HT40 is 150Mbps while it’s 72Mbps for HT20. 
-    // However, if the device is used in some special environment, e.g. there are too many other Wi-Fi devices around the ESP32 device, 
-    // the performance of HT40 may be degraded. So if the applications need to support same or similar scenarios, 
-    // it’s recommended that the bandwidth is always configured to HT20.
-    // https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-ht20-40
-    WIFI_ERROR_CHECK_BOOL(esp_wifi_set_bandwidth(WIFI_IF_STA, CONFIG_WIFI_BANDWIDTH), "set the bandwidth");
-  #endif // CONFIG_WIFI_BANDWIDTH
-  #ifdef CONFIG_WIFI_LONGRANGE
-    // Long Range (LR). Since LR is Espressif unique Wi-Fi mode, only ESP32 devices can transmit and receive the LR data
-    // more info: https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-protocol-mode
-    WIFI_ERROR_CHECK_BOOL(esp_wifi_set_protocol(WIFI_IF_STA, WIFI_PROTOCOL_LR), "set protocol Long Range");
-  #endif // CONFIG_WIFI_LONGRANGE
-  WIFI_ERROR_CHECK_BOOL(esp_wifi_start(), "start WiFi");
-  wifiTimeoutStart(CONFIG_WIFI_TIMEOUT);
-  return true;
+  uint8_t bandwidth = _wifiTunables.bandwidth;
+  _wifiTunables = *value;
+  // Categories and tiers changed by the application keep its values
+  #if CONFIG_WIFI_REASON_POLICY
+    if (!_wifiReasonCustom[WIFI_REASON_CAT_TRANSIENT]) {
+      _wifiReasonPolicy[WIFI_REASON_CAT_TRANSIENT].delay_min = value->reconnect_delay;
+      _wifiReasonPolicy[WIFI_REASON_CAT_TRANSIENT].delay_max = value->reconnect_delay;
+      _wifiReasonPolicy[WIFI_REASON_CAT_TRANSIENT].attempts = (uint8_t)value->reconnect_attempts;
+    };
+    if (!_wifiReasonCustom[WIFI_REASON_CAT_BEACON]) {
+      _wifiReasonPolicy[WIFI_REASON_CAT_BEACON].attempts = (uint8_t)value->reconnect_attempts;
+    };
+  #endif // CONFIG_WIFI_REASON_POLICY
+  #if CONFIG_WIFI_RECOVERY_LADDER
+    if (!_wifiRecoveryCustom[WIFI_TIER_REASSOC]) {
+      _wifiRecoveryBudget[WIFI_TIER_REASSOC].attempts = (uint8_t)value->reconnect_attempts;
+    };
+  #endif // CONFIG_WIFI_RECOVERY_LADDER
+  #if !CONFIG_WIFI_PROFILES && !CONFIG_WIFI_BANDWIDTH_AUTO
+    // The driver uses the new bandwidth from the next association
+    if ((value->bandwidth > 0) && (value->bandwidth != bandwidth) && wifiStatusCheck(_WIFI_STA_STARTED, false)) {
+      esp_err_t err = esp_wifi_set_bandwidth(WIFI_IF_STA, (wifi_bandwidth_t)value->bandwidth);
+      if (err != ESP_OK) {
+        rlog_e(logTAG, "Failed to set bandwidth: %d (%s)", err, esp_err_to_name(err));
+      };
+    };
+  #else
+    (void)bandwidth;
+  #endif // CONFIG_WIFI_PROFILES
 }
 
-bool _wifiDisconnectSTA(EventBits_t next_stage)
+// The parameter subsystem checks the limits, here - the values that would break the state machine; 
+// invalid values are replaced with the ones in use. Returns true if something has been corrected
+static bool wifiTunablesValidate(wifi_tunables_t* value)
 {
-  rlog_d(logTAG, "Disconnect from AP...");
-  if (next_stage > 0) wifiStatusSet(next_stage);
-  WIFI_ERROR_CHECK_BOOL(esp_wifi_disconnect(), "WiFi disconnect");
-  wifiTimeoutStart(CONFIG_WIFI_TIMEOUT);
-  return true;
+  wifi_tunables_t checked = *value;
+  if (checked.timeout < 1000) checked.timeout = _wifiTunables.timeout;
+  if (checked.restart_attempts < checked.reconnect_attempts) {
+    checked.restart_attempts = checked.reconnect_attempts;
+  };
+  if ((checked.bandwidth != 0) && (checked.bandwidth != WIFI_BW_HT20) && (checked.bandwidth != WIFI_BW_HT40)) {
+    checked.bandwidth = _wifiTunables.bandwidth;
+  };
+  checked.reserved = 0;
+  bool corrected = memcmp(&checked, value, sizeof(wifi_tunables_t)) != 0;
+  *value = checked;
+  return corrected;
 }
 
-bool _wifiStopSTA()
+// Saves and publishes the registered values
+static void wifiTunablesStore()
 {
-  rlog_d(logTAG, "Stop WiFi STA mode...");
-  WIFI_ERROR_CHECK_BOOL(esp_wifi_stop(), "WiFi stop");
-  return true;
+  for (uint8_t i = 0; i < WIFI_TUNABLES_COUNT; i++) {
+    if (_wifiTunablesEntries[i]) {
+      paramsValueStore(_wifiTunablesEntries[i], false);
+    };
+  };
 }
 
-bool _wifiRestoreSTA()
+static void wifiTunablesRollback()
 {
-  rlog_w(logTAG, "Restore WiFi stack persistent settings to default values");
-  WIFI_ERROR_CHECK_BOOL(esp_wifi_restore(), "restore WiFi stack persistent settings to default values");
-  wifiTimeoutStart(CONFIG_WIFI_TIMEOUT);
-  return true;
+  _wifiTunablesRollbacks++;
+  rlog_w(logTAG, "WiFi connection degraded after the parameters change (%d disconnections), previous values restored", _wifiTunablesFlaps);
+  wifiTunablesApply(&_wifiTunablesGood);
+  _wifiTunablesParams = _wifiTunablesGood;
+  wifiTunablesStore();
 }
 
-bool wifiStartWiFi()
+// Called by the parameter subsystem after a value has been changed (in its task context)
+static void wifiTunablesChanged()
 {
-  if (!wifiStatusCheck(_WIFI_STA_STARTED, false)) {
-    return _wifiStartSTA();
+  wifi_tunables_t value = _wifiTunablesParams;
+  if (wifiTunablesValidate(&value)) {
+    // Corrected values are written back, so that the saved and published values are the ones in use
+    _wifiTunablesParams = value;
+    wifiTunablesStore();
   };
-  return true;
+  if (memcmp(&value, &_wifiTunables, sizeof(wifi_tunables_t)) == 0) return;
+  rlog_i(logTAG, "WiFi parameters changed: timeout %d ms, reconnect delay %d ms, attempts %d / %d, bandwidth %d",
+    value.timeout, value.reconnect_delay, value.reconnect_attempts, value.restart_attempts, value.bandwidth);
+  // A new change during the probation is compared with the last confirmed values too
+  portENTER_CRITICAL(&_wifiTunablesLock);
+  _wifiTunablesChanged = esp_timer_get_time();
+  _wifiTunablesFlaps = 0;
+  _wifiTunablesGotIP = false;
+  portEXIT_CRITICAL(&_wifiTunablesLock);
+  wifiTunablesApply(&value);
+  if (_wifiTunablesTimer && !esp_timer_is_active(_wifiTunablesTimer)) {
+    esp_timer_start_periodic(_wifiTunablesTimer, (uint64_t)CONFIG_WIFI_TUNABLES_CHECK_INTERVAL * 1000000);
+  };
+}
+
+class wifiTunablesHandler_t: public param_handler_t {
+  public:
+    void onChange(param_change_mode_t mode) override
+    {
+      wifiTunablesChanged();
+    };
 };
 
-bool wifiStopWiFi()
+static wifiTunablesHandler_t _wifiTunablesHandler;
+
+// The timer runs only during the probation
+static void wifiTunablesTimerEnd(void* arg)
 {
-  if (wifiStatusCheck(_WIFI_STA_CONNECTED, false)) {
-    return _wifiDisconnectSTA(_WIFI_STA_DISCONNECT_STOP);
-  } else {
-    if (wifiStatusCheck(_WIFI_STA_STARTED, false)) {
-      return _wifiStopSTA();
+  bool online = wifiStatusCheck(_WIFI_STA_GOT_IP, false);
+  bool rollback = false;
+  bool confirm = false;
+  portENTER_CRITICAL(&_wifiTunablesLock);
+  if (_wifiTunablesChanged > 0) {
+    if (online) _wifiTunablesGotIP = true;
+    if (_wifiTunablesFlaps > CONFIG_WIFI_TUNABLES_FLAPS) {
+      rollback = true;
+    } else if (esp_timer_get_time() - _wifiTunablesChanged >= (int64_t)CONFIG_WIFI_TUNABLES_PROBATION * 1000000) {
+      confirm = _wifiTunablesGotIP && online;
+      rollback = !confirm;
+    };
+    if (rollback || confirm) {
+      _wifiTunablesChanged = 0;
     };
   };
-  return true;
+  bool finished = _wifiTunablesChanged == 0;
+  portEXIT_CRITICAL(&_wifiTunablesLock);
+  if (finished) {
+    esp_timer_stop(_wifiTunablesTimer);
+  };
+  if (rollback) {
+    wifiTunablesRollback();
+  } else if (confirm) {
+    _wifiTunablesGood = _wifiTunables;
+    rlog_i(logTAG, "WiFi parameters confirmed");
+  };
 }
 
-bool wifiRestartWiFi()
+// Called when the connection is lost
+static void wifiTunablesFlap()
 {
-  if (wifiStatusCheck(_WIFI_STA_CONNECTED, false)) {
-    // Restore WiFi stack persistent settings to default values AND reconnect in event handler
-    return _wifiDisconnectSTA(_WIFI_STA_DISCONNECT_RESTORE);
-  } else {
-    if (wifiStatusCheck(_WIFI_STA_STARTED, false)) {
-      // Stop STA mode AND restart in event handler
-      return _wifiStopSTA();
-    } else {
-      // Start STA Mode
-      return _wifiStartSTA();
-    };
+  if (_wifiTunablesChanged > 0) {
+    _wifiTunablesFlaps++;
   };
 }
 
-bool wifiReconnectWiFi()
+// Called after the parameters are registered (and loaded from NVS)
+static void wifiTunablesInit()
 {
-  rlog_d(logTAG, "WiFi reconnect...");
-  // Disable STA completely
-  if (wifiStatusCheck(_WIFI_STA_DISCONNECT_STOP, true)) {
-    return _wifiStopSTA();
-  // Restore WiFi stack persistent settings to default values
-  } else if (wifiStatusCheck(_WIFI_STA_DISCONNECT_RESTORE, true)) {
-    return _wifiRestoreSTA();
-  } else {
-    if (wifiStatusCheck(_WIFI_STA_ENABLED, false)) {
-      // STA is started
-      if (wifiStatusCheck(_WIFI_STA_STARTED, false)) {
-        // Restore WiFi (if connected) OR stop STA with restart in event handler
-        if (_wifiAttemptCount > CONFIG_WIFI_RESTART_ATTEMPTS) {
-          return wifiRestartWiFi();
-        } else {
-          // Try connecting to another network
-          if (_wifiAttemptCount > CONFIG_WIFI_RECONNECT_ATTEMPTS) {
-            #ifndef CONFIG_WIFI_SSID
-            _wifiIndexNeedChange = true;
-            #endif // CONFIG_WIFI_SSID
-          };
-          #ifdef CONFIG_WIFI_SSID
-            vTaskDelay(pdMS_TO_TICKS(CONFIG_WIFI_RECONNECT_DELAY));
-          #else
-            if (!_wifiIndexNeedChange) {
-              vTaskDelay(pdMS_TO_TICKS(CONFIG_WIFI_RECONNECT_DELAY));
-            };
-          #endif // CONFIG_WIFI_SSID
-          return wifiConnectSTA();
-        };
-      } else {
-        return _wifiStartSTA();
-      };
-    } else {
-      wifiStopWiFi();
+  wifi_tunables_t value = _wifiTunablesParams;
+  if (wifiTunablesValidate(&value)) {
+    _wifiTunablesParams = value;
+    wifiTunablesStore();
+  };
+  wifiTunablesApply(&value);
+  _wifiTunablesGood = value;
+  if (!_wifiTunablesTimer) {
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+    timer_args.callback = &wifiTunablesTimerEnd;
+    timer_args.name = "timer_wifi_params";
+    if (esp_timer_create(&timer_args, &_wifiTunablesTimer) != ESP_OK) {
+      rlog_e(logTAG, "Failed to create WiFi parameters timer");
     };
   };
-  return false;
 }
 
+uint16_t wifiTunablesRollbacks()
+{
+  return _wifiTunablesRollbacks;
+}
+
+#endif // CONFIG_WIFI_TUNABLES
+
 // -----------------------------------------------------------------------------------------------------------------------
 // ------------------------------------------------- WiFi event handlers -------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
 static void wifiEventHandler_Start(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
-  // Set status bits
-  wifiStatusSet(_WIFI_STA_ENABLED | _WIFI_STA_STARTED);
-  wifiStatusClear(_WIFI_STA_CONNECTED | _WIFI_STA_GOT_IP | _WIFI_STA_DISCONNECT_STOP | _WIFI_STA_DISCONNECT_RESTORE);
+  wifiPhaseComplete(WIFI_PHASE_START);
+  wifiStartMeasureStarted();
   // Reset attempts count
   _wifiAttemptCount = 0;
   _wifiLastErr = 0;
+  #if CONFIG_WIFI_REASON_POLICY
+    wifiReasonPolicyReset();
+  #endif // CONFIG_WIFI_REASON_POLICY
   // Re-dispatch event to another loop
   eventLoopPost(RE_WIFI_EVENTS, RE_WIFI_STA_STARTED, nullptr, 0, portMAX_DELAY);  
   // Log
-  rlog_i(logTAG, "WiFi STA started");
+  #if CONFIG_WIFI_LOG_DEFERRED
+    wifiLogPost(WIFI_LOG_STA_STARTED, 0, 0, 0);
+  #else
+    rlog_i(logTAG, "WiFi STA started");
+  #endif // CONFIG_WIFI_LOG_DEFERRED
   // Start device restart timer
   #if defined(CONFIG_WIFI_TIMER_RESTART_DEVICE) && CONFIG_WIFI_TIMER_RESTART_DEVICE > 0
-    espRestartTimerStartM(&_wdtRestartWiFi, RR_WIFI_TIMEOUT, CONFIG_WIFI_TIMER_RESTART_DEVICE, false);
+    espRestartTimerStartM(&_wdtRestartWiFi, RR_WIFI_TIMEOUT, WIFI_TIMER_RESTART_DEVICE, false);
   #endif // CONFIG_WIFI_TIMER_RESTART_DEVICE
+  // Reapply the active profile after each (re)start
+  #if CONFIG_WIFI_PROFILES
+    wifiProfileRestore();
+  #elif CONFIG_WIFI_TXPOWER_AUTO
+    wifiTxPowerRestore();
+  #endif // CONFIG_WIFI_PROFILES
   // Start connection
-  if (!wifiConnectSTA()) {
-    _wifiStopSTA();
-  };
+  wifiStateHandle(WIFI_FSM_EV_STA_START);
 }
 
 static void wifiEventHandler_Connect(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
-  // Set status bits
-  wifiStatusSet(_WIFI_STA_CONNECTED);
-  wifiStatusClear(_WIFI_STA_GOT_IP | _WIFI_STA_DISCONNECT_STOP | _WIFI_STA_DISCONNECT_RESTORE);
+  #if CONFIG_WIFI_PMK_CACHE
+    uint32_t duration = wifiPhaseComplete(WIFI_PHASE_CONNECT);
+    if (event_data) {
+      wifi_event_sta_connected_t * data = (wifi_event_sta_connected_t*)event_data;
+      wifiHandshakeComplete(duration, data->authmode);
+      wifiChannelsStore(data->channel);
+    };
+  #else
+    wifiPhaseComplete(WIFI_PHASE_CONNECT);
+  #endif // CONFIG_WIFI_PMK_CACHE
+  wifiRssiReset();
+  // Change state
+  wifiStateDispatch(WIFI_FSM_EV_CONNECTED);
   // Save successful connection number
   #ifndef CONFIG_WIFI_SSID
     _wifiIndexNeedChange = false;
@@ -719,14 +5407,19 @@ static void wifiEventHandler_Connect(void* arg, esp_event_base_t event_base, int
     };
   #endif // CONFIG_WIFI_SSID
   // Log
-  #if CONFIG_RLOG_PROJECT_LEVEL >= RLOG_LEVEL_INFO
+  // The event does not carry RSSI: the last known value is logged, the driver is not queried in the event loop
+  #if CONFIG_WIFI_LOG_DEFERRED
+    wifiLogPost(WIFI_LOG_CONNECTED, event_data ? ((wifi_event_sta_connected_t*)event_data)->channel : 0, (uint32_t)_wifiLastRssi, 0);
+  #elif CONFIG_RLOG_PROJECT_LEVEL >= RLOG_LEVEL_INFO
     if (event_data) {
       wifi_event_sta_connected_t * data = (wifi_event_sta_connected_t*)event_data;
-      rlog_i(logTAG, "WiFi connection [ %s ] established, RSSI: %d dBi", (char*)data->ssid, wifiRSSI());
+      rlog_i(logTAG, "WiFi connection [ %s ] established, channel: %d, RSSI: %d dBi", (char*)data->ssid, data->channel, _wifiLastRssi);
     };
   #endif
   // Restart timer
-  wifiTimeoutStart(CONFIG_WIFI_TIMEOUT);
+  if (_wifiState == WIFI_STATE_CONNECTED) {
+    wifiTimeoutStart(WIFI_PHASE_GOT_IP);
+  };
 }
 
 static void wifiEventHandler_Disconnect(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
@@ -735,40 +5428,92 @@ static void wifiEventHandler_Disconnect(void* arg, esp_event_base_t event_base,
   EventBits_t prevStatusBits = wifiStatusGet();
   bool isWasConnected = (prevStatusBits & _WIFI_STA_CONNECTED) == _WIFI_STA_CONNECTED;
   bool isWasIP = (prevStatusBits & _WIFI_STA_GOT_IP) == _WIFI_STA_GOT_IP;
-  // Reset status bits
-  wifiStatusClear(_WIFI_STA_CONNECTED | _WIFI_STA_GOT_IP);
+  #if CONFIG_WIFI_NETWORK_SCORING && !defined(CONFIG_WIFI_SSID)
+    if (isWasIP) {
+      wifiNetworkSessionEnd(_wifiCurrIndex);
+    } else {
+      wifiNetworkFailure();
+    };
+  #endif // CONFIG_WIFI_NETWORK_SCORING
+  #if CONFIG_WIFI_RECOVERY_LADDER
+    if (isWasIP) {
+      wifiRecoveryBegin(true);
+    };
+  #endif // CONFIG_WIFI_RECOVERY_LADDER
+  #if CONFIG_WIFI_TELEMETRY || CONFIG_WIFI_STATS
+    if (_wifiOnlineSince > 0) {
+      _wifiDisconnectTotal++;
+      _wifiOnlineSince = 0;
+    };
+  #endif // CONFIG_WIFI_TELEMETRY || CONFIG_WIFI_STATS
+  // Only a requested disconnection completes the phase, in other cases the phase has failed
+  if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    wifiPhaseComplete(WIFI_PHASE_DISCONNECT);
+  };
+  #if CONFIG_WIFI_SCAN_ENABLE
+    wifiScanCancel();
+  #endif // CONFIG_WIFI_SCAN_ENABLE
+  #if CONFIG_WIFI_BANDWIDTH_AUTO
+    wifiBandwidthCancel();
+  #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+  #if CONFIG_WIFI_LONGRANGE_AUTO
+    wifiLongRangeCancel();
+  #endif // CONFIG_WIFI_LONGRANGE_AUTO
+  #if CONFIG_WIFI_TXPOWER_AUTO
+    wifiTxPowerCancel((prevStatusBits & _WIFI_STA_ENABLED) == _WIFI_STA_ENABLED);
+  #endif // CONFIG_WIFI_TXPOWER_AUTO
+  #if CONFIG_WIFI_RTT_PROBE
+    wifiRttStop();
+  #endif // CONFIG_WIFI_RTT_PROBE
+  #if CONFIG_WIFI_LINK_SCORE
+    wifiLinkCancel(isWasIP && ((prevStatusBits & _WIFI_STA_ENABLED) == _WIFI_STA_ENABLED));
+  #endif // CONFIG_WIFI_LINK_SCORE
+  #if CONFIG_WIFI_TUNABLES
+    if (isWasIP && ((prevStatusBits & _WIFI_STA_ENABLED) == _WIFI_STA_ENABLED)) {
+      wifiTunablesFlap();
+    };
+  #endif // CONFIG_WIFI_TUNABLES
   // Stop timer
   wifiTimeoutStop();
   // Start device restart timer
   #if defined(CONFIG_WIFI_TIMER_RESTART_DEVICE) && CONFIG_WIFI_TIMER_RESTART_DEVICE > 0
-    espRestartTimerStartM(&_wdtRestartWiFi, RR_WIFI_TIMEOUT, CONFIG_WIFI_TIMER_RESTART_DEVICE, false);
+    espRestartTimerStartM(&_wdtRestartWiFi, RR_WIFI_TIMEOUT, WIFI_TIMER_RESTART_DEVICE, false);
   #endif // CONFIG_WIFI_TIMER_RESTART_DEVICE
   // Check for forced (manual) WiFi disconnection
-  if (wifiStatusCheck(_WIFI_STA_ENABLED, false)) {
+  if ((prevStatusBits & _WIFI_STA_ENABLED) == _WIFI_STA_ENABLED) {
+    #if CONFIG_WIFI_LONGRANGE_AUTO
+      if (!isWasIP) {
+        wifiLongRangeAttempt(false);
+      };
+    #endif // CONFIG_WIFI_LONGRANGE_AUTO
     // Different reconnection scenarios
     if (event_id == WIFI_EVENT_STA_BEACON_TIMEOUT) {
       _wifiLastErr = WIFI_REASON_BEACON_TIMEOUT;
       if (isWasConnected && isWasIP) {
         // Re-dispatch event to another loop
         eventLoopPost(RE_WIFI_EVENTS, RE_WIFI_STA_DISCONNECTED, nullptr, 0, portMAX_DELAY);  
-        rlog_e(logTAG, "WiFi connection [ %s ] lost: beacon timeout!", wifiGetSSID());
+        #if CONFIG_WIFI_LOG_DEFERRED
+          wifiLogPost(WIFI_LOG_LOST_BEACON, 0, 0, 0);
+        #else
+          rlog_e(logTAG, "WiFi connection [ %s ] lost: beacon timeout!", wifiGetSSID());
+        #endif // CONFIG_WIFI_LOG_DEFERRED
       } else {
-        rlog_e(logTAG, "Failed to connect to WiFi network: beacon timeout!");
-      };
-      // Next connection attempt
-      if (!wifiReconnectWiFi()) {
-        _wifiRestoreSTA();
-        _wifiStopSTA();
+        #if CONFIG_WIFI_LOG_DEFERRED
+          wifiLogPost(WIFI_LOG_FAILED_BEACON, 0, 0, 0);
+        #else
+          rlog_e(logTAG, "Failed to connect to WiFi network: beacon timeout!");
+        #endif // CONFIG_WIFI_LOG_DEFERRED
       };
     } else if (event_id == IP_EVENT_STA_LOST_IP) {
+      // There is no reason code for the lost IP address, the reconnect policy treats it as a transient failure
+      _wifiLastErr = WIFI_REASON_UNSPECIFIED;
       // Re-dispatch event to another loop
       eventLoopPost(RE_WIFI_EVENTS, RE_WIFI_STA_DISCONNECTED, nullptr, 0, portMAX_DELAY);
-      rlog_e(logTAG, "WiFi connection [ %s ] lost WiFi IP address!", wifiGetSSID());
-      // Next connection attempt
-      if (!wifiReconnectWiFi()) {
-        _wifiRestoreSTA();
-        _wifiStopSTA();
-      };
+      #if CONFIG_WIFI_LOG_DEFERRED
+        wifiLogPost(WIFI_LOG_LOST_IP, 0, 0, 0);
+      #else
+        rlog_e(logTAG, "WiFi connection [ %s ] lost WiFi IP address!", wifiGetSSID());
+      #endif // CONFIG_WIFI_LOG_DEFERRED
     } else {
       wifi_event_sta_disconnected_t * data = (wifi_event_sta_disconnected_t*)event_data;
       if (data) {
@@ -783,59 +5528,120 @@ static void wifiEventHandler_Disconnect(void* arg, esp_event_base_t event_base,
         } else {
           eventLoopPost(RE_WIFI_EVENTS, RE_WIFI_STA_DISCONNECTED, nullptr, 0, portMAX_DELAY);
         };
-        rlog_e(logTAG, "WiFi connection [ %s ] lost: #%d!", wifiGetSSID(), _wifiLastErr);
+        #if CONFIG_WIFI_LOG_DEFERRED
+          wifiLogPost(WIFI_LOG_LOST, _wifiLastErr, 0, 0);
+        #else
+          rlog_e(logTAG, "WiFi connection [ %s ] lost: #%d!", wifiGetSSID(), _wifiLastErr);
+        #endif // CONFIG_WIFI_LOG_DEFERRED
       } else {
-        rlog_e(logTAG, "Failed to connect to WiFi network: #%d!", _wifiLastErr);
-      };
-      // Next connection attempt
-      if (!wifiReconnectWiFi()) {
-        _wifiRestoreSTA();
-        _wifiStopSTA();
+        #if CONFIG_WIFI_LOG_DEFERRED
+          wifiLogPost(WIFI_LOG_FAILED, _wifiLastErr, 0, 0);
+        #else
+          rlog_e(logTAG, "Failed to connect to WiFi network: #%d!", _wifiLastErr);
+        #endif // CONFIG_WIFI_LOG_DEFERRED
       };
     };
-  } else {
-    // Stop WiFi
-    wifiStopWiFi();
-  }
+  };
+  #if CONFIG_WIFI_STATS
+    if ((prevStatusBits & _WIFI_STA_ENABLED) == _WIFI_STA_ENABLED) {
+      wifiStatsDisconnected(_wifiLastErr);
+    } else {
+      wifiStatsDisconnected(0);
+    };
+  #endif // CONFIG_WIFI_STATS
+  // Next connection attempt, or stop / restore STA, if it was requested
+  wifiStateHandle(event_base == IP_EVENT ? WIFI_FSM_EV_LOST_IP : WIFI_FSM_EV_DISCONNECTED);
 }
 
 static void wifiEventHandler_Stop(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
-  // Reset status bits
-  wifiStatusClear(_WIFI_STA_STARTED | _WIFI_STA_CONNECTED | _WIFI_STA_GOT_IP);
   // Log
-  rlog_w(logTAG, "WiFi STA stopped");
+  #if CONFIG_WIFI_LOG_DEFERRED
+    wifiLogPost(WIFI_LOG_STA_STOPPED, 0, 0, 0);
+  #else
+    rlog_w(logTAG, "WiFi STA stopped");
+  #endif // CONFIG_WIFI_LOG_DEFERRED
   // Re-dispatch event to another loop
   eventLoopPost(RE_WIFI_EVENTS, RE_WIFI_STA_STOPPED, nullptr, 0, portMAX_DELAY);  
-  // Delete timer
-  wifiTimeoutDelete();
-  // If WiFi is enabled, restart it
-  if (wifiStatusCheck(_WIFI_STA_ENABLED, false)) {
-    wifiStartWiFi();
-  // ... otherwise we turn off everything
-  } else {
-    // Delete device restart timer
-    #if defined(CONFIG_WIFI_TIMER_RESTART_DEVICE) && CONFIG_WIFI_TIMER_RESTART_DEVICE > 0
-      espRestartTimerStartM(&_wdtRestartWiFi, RR_WIFI_TIMEOUT, CONFIG_WIFI_TIMER_RESTART_DEVICE, false);
-    #endif // CONFIG_WIFI_TIMER_RESTART_DEVICE
-    // Low-level deinit
-    wifiLowLevelDeinit();
-  };
+  // Stop timers (they are deleted when the driver is released)
+  wifiTimeoutStop();
+  #if WIFI_RECONNECT_DELAY_TIMER
+    wifiReconnectDelayStop();
+  #endif // WIFI_RECONNECT_DELAY_TIMER
+  #if CONFIG_WIFI_BANDWIDTH_AUTO
+    wifiBandwidthCancel();
+  #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+  #if CONFIG_WIFI_LONGRANGE_AUTO
+    wifiLongRangeCancel();
+  #endif // CONFIG_WIFI_LONGRANGE_AUTO
+  #if CONFIG_WIFI_TXPOWER_AUTO
+    wifiTxPowerCancel(false);
+  #endif // CONFIG_WIFI_TXPOWER_AUTO
+  #if CONFIG_WIFI_RTT_PROBE
+    wifiRttStop();
+  #endif // CONFIG_WIFI_RTT_PROBE
+  #if CONFIG_WIFI_LINK_SCORE
+    wifiLinkCancel(false);
+  #endif // CONFIG_WIFI_LINK_SCORE
+  // If WiFi is enabled, restart it, otherwise release the driver (or keep it in suspended mode)
+  wifiStateHandle(WIFI_FSM_EV_STA_STOP);
 }
 
 static void wifiEventHandler_GotIP(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
-  // Set status bits
-  wifiStatusSet(_WIFI_STA_GOT_IP);
+  wifiPhaseComplete(WIFI_PHASE_GOT_IP);
+  wifiStartMeasureGotIP();
+  #if CONFIG_WIFI_TIMEOUT_ADAPTIVE
+    wifiPhaseStore();
+  #endif // CONFIG_WIFI_TIMEOUT_ADAPTIVE
+  #if CONFIG_WIFI_NETWORK_SCORING && !defined(CONFIG_WIFI_SSID)
+    wifiNetworkSuccess(_wifiCurrIndex, wifiRSSI());
+  #endif // CONFIG_WIFI_NETWORK_SCORING
+  #if CONFIG_WIFI_RECOVERY_LADDER
+    wifiRecoveryEnd(true);
+  #endif // CONFIG_WIFI_RECOVERY_LADDER
+  // Change state
+  wifiStateDispatch(WIFI_FSM_EV_GOT_IP);
+  #if CONFIG_WIFI_TELEMETRY || CONFIG_WIFI_STATS
+    _wifiConnectTotal++;
+    _wifiOnlineSince = esp_timer_get_time();
+  #endif // CONFIG_WIFI_TELEMETRY || CONFIG_WIFI_STATS
+  #if CONFIG_WIFI_STATS
+    wifiStatsConnected();
+  #endif // CONFIG_WIFI_STATS
+  #if CONFIG_WIFI_BANDWIDTH_AUTO
+    wifiBandwidthConnected();
+  #endif // CONFIG_WIFI_BANDWIDTH_AUTO
+  #if CONFIG_WIFI_LONGRANGE_AUTO
+    wifiLongRangeConnected();
+  #endif // CONFIG_WIFI_LONGRANGE_AUTO
+  #if CONFIG_WIFI_TXPOWER_AUTO
+    wifiTxPowerConnected();
+  #endif // CONFIG_WIFI_TXPOWER_AUTO
+  #if CONFIG_WIFI_RTT_PROBE
+    if (event_data) {
+      wifiRttStart(((ip_event_got_ip_t*)event_data)->ip_info.gw.addr);
+    } else {
+      wifiRttStart(wifiLocalIP().gw.addr);
+    };
+  #endif // CONFIG_WIFI_RTT_PROBE
+  #if CONFIG_WIFI_LINK_SCORE
+    wifiLinkConnected();
+  #endif // CONFIG_WIFI_LINK_SCORE
   // Reset attempts count
   _wifiAttemptCount = 0;
   _wifiLastErr = 0;
+  #if CONFIG_WIFI_REASON_POLICY
+    wifiReasonPolicyReset();
+  #endif // CONFIG_WIFI_REASON_POLICY
   // Re-dispatch event to another loop
   if (event_data) {
     ip_event_got_ip_t * data = (ip_event_got_ip_t*)event_data;
     eventLoopPost(RE_WIFI_EVENTS, RE_WIFI_STA_GOT_IP, data, sizeof(ip_event_got_ip_t), portMAX_DELAY);  
     // Log
-    #if CONFIG_RLOG_PROJECT_LEVEL >= RLOG_LEVEL_INFO
+    #if CONFIG_WIFI_LOG_DEFERRED
+      wifiLogPost(WIFI_LOG_GOT_IP, data->ip_info.ip.addr, data->ip_info.netmask.addr, data->ip_info.gw.addr);
+    #elif CONFIG_RLOG_PROJECT_LEVEL >= RLOG_LEVEL_INFO
       uint8_t * ip = (uint8_t*)&(data->ip_info.ip.addr);
       uint8_t * mask = (uint8_t*)&(data->ip_info.netmask.addr);
       uint8_t * gw = (uint8_t*)&(data->ip_info.gw.addr);
@@ -853,6 +5659,27 @@ static void wifiEventHandler_GotIP(void* arg, esp_event_base_t event_base, int32
   #endif // CONFIG_WIFI_TIMER_RESTART_DEVICE
 }
 
+static void wifiEventHandler_Timer(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  if (!event_data) return;
+  uint32_t seq = *(uint32_t*)event_data;
+  switch (event_id) {
+    case WIFI_TIMER_TIMEOUT:
+      if (seq == _wifiTimerSeq) wifiTimeoutExec();
+      break;
+    #if WIFI_RECONNECT_DELAY_TIMER
+    case WIFI_TIMER_RECONNECT:
+      if (seq == _wifiDelaySeq) wifiReconnectDelayExec();
+      break;
+    #endif // WIFI_RECONNECT_DELAY_TIMER
+    #if CONFIG_WIFI_RECOVERY_LADDER
+    case WIFI_TIMER_RECOVERY:
+      if (seq == _wifiRecoverySeq) wifiRecoveryTimerExec();
+      break;
+    #endif // CONFIG_WIFI_RECOVERY_LADDER
+  };
+}
+
 static bool wifiRegisterEventHandlers()
 {
   WIFI_ERROR_CHECK_BOOL(
@@ -876,6 +5703,14 @@ static bool wifiRegisterEventHandlers()
   WIFI_ERROR_CHECK_BOOL(
     esp_event_handler_register(IP_EVENT, IP_EVENT_STA_LOST_IP, &wifiEventHandler_Disconnect, nullptr), 
     "register an event handler for IP_EVENT_STA_LOST_IP");
+  #if CONFIG_WIFI_SCAN_ENABLE
+    WIFI_ERROR_CHECK_BOOL(
+      esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &wifiEventHandler_ScanDone, nullptr), 
+      "register an event handler for WIFI_EVENT_SCAN_DONE");
+  #endif // CONFIG_WIFI_SCAN_ENABLE
+  WIFI_ERROR_CHECK_BOOL(
+    esp_event_handler_register(WIFI_TIMER_EVENTS, ESP_EVENT_ANY_ID, &wifiEventHandler_Timer, nullptr), 
+    "register an event handler for WIFI_TIMER_EVENTS");
 
   return true;
 }
@@ -903,6 +5738,14 @@ static void wifiUnregisterEventHandlers()
   WIFI_ERROR_CHECK_LOG(
     esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_LOST_IP, &wifiEventHandler_Disconnect), 
     "unregister an event handler for IP_EVENT_STA_LOST_IP");
+  #if CONFIG_WIFI_SCAN_ENABLE
+    WIFI_ERROR_CHECK_LOG(
+      esp_event_handler_unregister(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &wifiEventHandler_ScanDone), 
+      "unregister an event handler for WIFI_EVENT_SCAN_DONE");
+  #endif // CONFIG_WIFI_SCAN_ENABLE
+  WIFI_ERROR_CHECK_LOG(
+    esp_event_handler_unregister(WIFI_TIMER_EVENTS, ESP_EVENT_ANY_ID, &wifiEventHandler_Timer), 
+    "unregister an event handler for WIFI_TIMER_EVENTS");
 }
 
 // -----------------------------------------------------------------------------------------------------------------------
@@ -924,7 +5767,28 @@ bool wifiInit()
     };
     xEventGroupClearBits(_wifiStatusBits, 0x00FFFFFF);
   };
+  #if CONFIG_WIFI_TRACE_ENABLE
+    wifiTraceInit();
+  #endif // CONFIG_WIFI_TRACE_ENABLE
+  #if CONFIG_WIFI_AVAILABILITY
+    wifiAvailabilityInit();
+  #endif // CONFIG_WIFI_AVAILABILITY
+  #if CONFIG_WIFI_DEFER_QUEUE
+    wifiDeferInit();
+  #endif // CONFIG_WIFI_DEFER_QUEUE
+  #if CONFIG_WIFI_LOG_DEFERRED
+    wifiLogInit();
+  #endif // CONFIG_WIFI_LOG_DEFERRED
   wifiRegisterParameters();
+  #if CONFIG_WIFI_TIMEOUT_ADAPTIVE
+    wifiPhaseLoad();
+  #endif // CONFIG_WIFI_TIMEOUT_ADAPTIVE
+  #if CONFIG_WIFI_PMK_CACHE
+    wifiChannelsLoad();
+  #endif // CONFIG_WIFI_PMK_CACHE
+  #if CONFIG_WIFI_SCAN_ENABLE && (CONFIG_WIFI_SCAN_INTERVAL > 0)
+    wifiScanStart(CONFIG_WIFI_SCAN_INTERVAL);
+  #endif // CONFIG_WIFI_SCAN_ENABLE
   #if defined(CONFIG_WIFI_TIMER_RESTART_DEVICE) && CONFIG_WIFI_TIMER_RESTART_DEVICE > 0
     espRestartTimerInit(&_wdtRestartWiFi, RR_WIFI_TIMEOUT, "wdt_wifi");
   #endif // CONFIG_WIFI_TIMER_RESTART_DEVICE
@@ -936,28 +5800,79 @@ bool wifiStart()
   bool ret = true;
   // Initialization WiFi, if not done earlier
   if (!_wifiStatusBits) ret = wifiInit();
-  // Stop the previous mode if it was activated
-  if (ret) ret = wifiStop();
+  // Driver is already initialized, there is no need to repeat it
+  if (ret && (_wifiState == WIFI_STATE_SUSPENDED)) {
+    return wifiResume();
+  };
+  // Stop the previous mode if it was activated (STA will be started again in the event handler)
+  if (ret && (_wifiState > WIFI_STATE_SUSPENDED)) {
+    ret = wifiStop();
+  };
+  _wifiSuspendRequested = false;
   // Low level init
-  if (ret) ret = wifiLowLevelInit();
-  // Allow reconnection
-  if (ret) ret = wifiStatusSet(_WIFI_STA_ENABLED);
-  // Start WiFi
+  if (ret && (_wifiState == WIFI_STATE_OFF)) {
+    wifiStartMeasureBegin(false);
+    ret = wifiLowLevelInit();
+  };
+  // Start WiFi (if STA is being stopped now, it will be started again in the event handler)
   if (ret) ret = wifiStartWiFi();
   return ret;
 }
 
 bool wifiStop()
 {
-  wifiStatusClear(_WIFI_STA_ENABLED);
+  _wifiSuspendRequested = false;
+  #if CONFIG_WIFI_RECOVERY_LADDER
+    wifiRecoveryEnd(false);
+  #endif // CONFIG_WIFI_RECOVERY_LADDER
+  wifiStartMeasureCancel();
+  // If STA is still running, the driver will be released in the event handler
+  return wifiStopWiFi();
+}
+
+bool wifiSuspend()
+{
+  if (_wifiState == WIFI_STATE_OFF) {
+    return false;
+  };
+  rlog_i(logTAG, "Suspend WiFi STA...");
+  _wifiSuspendRequested = true;
+  #if CONFIG_WIFI_RECOVERY_LADDER
+    wifiRecoveryEnd(false);
+  #endif // CONFIG_WIFI_RECOVERY_LADDER
+  wifiStartMeasureCancel();
   return wifiStopWiFi();
 }
 
+bool wifiResume()
+{
+  if (_wifiState != WIFI_STATE_SUSPENDED) {
+    return wifiStart();
+  };
+  rlog_i(logTAG, "Resume WiFi STA...");
+  wifiStartMeasureBegin(true);
+  _wifiSuspendRequested = false;
+  return wifiStartWiFi();
+}
+
+bool wifiIsSuspended()
+{
+  return _wifiState == WIFI_STATE_SUSPENDED;
+}
+
 bool wifiFree()
 {
   if (!wifiStop()) {
     return false;
   };
+  // If the driver is still running, netif will remain until the next initialization
+  wifiNetifDestroy();
+  #if CONFIG_WIFI_SCAN_ENABLE
+    wifiScanStop();
+  #endif // CONFIG_WIFI_SCAN_ENABLE
+  #if CONFIG_WIFI_DEFER_QUEUE
+    wifiDeferFree();
+  #endif // CONFIG_WIFI_DEFER_QUEUE
   if (_wifiStatusBits) {
     vEventGroupDelete(_wifiStatusBits);
     _wifiStatusBits = nullptr;
@@ -972,14 +5887,56 @@ bool wifiFree()
 // ------------------------------------------------------ Parameters -----------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-static uint8_t _wifiRssiThreshold = CONFIG_WIFI_RSSI_THERSHOLD;
-
 void wifiRegisterParameters()
 {
   paramsGroupHandle_t pgWifi = paramsRegisterGroup(nullptr, CONFIG_WIFI_PGROUP_KEY, CONFIG_WIFI_PGROUP_TOPIC, CONFIG_WIFI_PGROUP_FRIENDLY);
 
   paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgWifi, 
     CONFIG_WIFI_RSSI_THERSHOLD_KEY, CONFIG_WIFI_RSSI_THERSHOLD_FRIENDLY, CONFIG_MQTT_PARAMS_QOS, &_wifiRssiThreshold);
+
+  #if CONFIG_WIFI_RTT_PROBE
+    // The new interval is applied at the next connection
+    paramsEntryHandle_t peRttInterval = paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U16, nullptr, pgWifi, 
+      CONFIG_WIFI_RTT_INTERVAL_KEY, CONFIG_WIFI_RTT_INTERVAL_FRIENDLY, CONFIG_MQTT_PARAMS_QOS, &_wifiRttInterval);
+    paramsSetLimitsU16(peRttInterval, 1, 3600);
+    paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U16, nullptr, pgWifi, 
+      CONFIG_WIFI_RTT_THRESHOLD_KEY, CONFIG_WIFI_RTT_THRESHOLD_FRIENDLY, CONFIG_MQTT_PARAMS_QOS, &_wifiRttThreshold);
+    wifiRttRegister(pgWifi);
+  #endif // CONFIG_WIFI_RTT_PROBE
+
+  #if CONFIG_WIFI_TUNABLES
+    // Changes are validated and applied without restart by the handler, and rolled back if the connection degrades, 
+    // see wifiTunablesChanged() and wifiTunablesTimerEnd()
+    _wifiTunablesParams = _wifiTunables;
+    _wifiTunablesEntries[0] = paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U32, &_wifiTunablesHandler, pgWifi, 
+      CONFIG_WIFI_TIMEOUT_KEY, CONFIG_WIFI_TIMEOUT_FRIENDLY, CONFIG_MQTT_PARAMS_QOS, &_wifiTunablesParams.timeout);
+    paramsSetLimitsU32(_wifiTunablesEntries[0], 1000, 600000);
+    _wifiTunablesEntries[1] = paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U32, &_wifiTunablesHandler, pgWifi, 
+      CONFIG_WIFI_RECONNECT_DELAY_KEY, CONFIG_WIFI_RECONNECT_DELAY_FRIENDLY, CONFIG_MQTT_PARAMS_QOS, &_wifiTunablesParams.reconnect_delay);
+    paramsSetLimitsU32(_wifiTunablesEntries[1], 0, 600000);
+    _wifiTunablesEntries[2] = paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U16, &_wifiTunablesHandler, pgWifi, 
+      CONFIG_WIFI_RECONNECT_ATTEMPTS_KEY, CONFIG_WIFI_RECONNECT_ATTEMPTS_FRIENDLY, CONFIG_MQTT_PARAMS_QOS, &_wifiTunablesParams.reconnect_attempts);
+    paramsSetLimitsU16(_wifiTunablesEntries[2], 1, 255);
+    _wifiTunablesEntries[3] = paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U16, &_wifiTunablesHandler, pgWifi, 
+      CONFIG_WIFI_RESTART_ATTEMPTS_KEY, CONFIG_WIFI_RESTART_ATTEMPTS_FRIENDLY, CONFIG_MQTT_PARAMS_QOS, &_wifiTunablesParams.restart_attempts);
+    paramsSetLimitsU16(_wifiTunablesEntries[3], 1, 1000);
+    #if defined(CONFIG_WIFI_TIMER_RESTART_DEVICE) && CONFIG_WIFI_TIMER_RESTART_DEVICE > 0
+      // The restart timer is compiled only if it is enabled, so it can't be disabled at runtime
+      _wifiTunablesEntries[4] = paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U16, &_wifiTunablesHandler, pgWifi, 
+        CONFIG_WIFI_TIMER_RESTART_DEVICE_KEY, CONFIG_WIFI_TIMER_RESTART_DEVICE_FRIENDLY, CONFIG_MQTT_PARAMS_QOS, &_wifiTunablesParams.restart_device);
+      paramsSetLimitsU16(_wifiTunablesEntries[4], 1, 10080);
+    #endif // CONFIG_WIFI_TIMER_RESTART_DEVICE
+    #if !CONFIG_WIFI_PROFILES && !CONFIG_WIFI_BANDWIDTH_AUTO
+      _wifiTunablesEntries[5] = paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, &_wifiTunablesHandler, pgWifi, 
+        CONFIG_WIFI_BANDWIDTH_KEY, CONFIG_WIFI_BANDWIDTH_FRIENDLY, CONFIG_MQTT_PARAMS_QOS, &_wifiTunablesParams.bandwidth);
+      paramsSetLimitsU8(_wifiTunablesEntries[5], 0, 2);
+    #endif // CONFIG_WIFI_PROFILES
+    wifiTunablesInit();
+  #endif // CONFIG_WIFI_TUNABLES
+
+  #if CONFIG_WIFI_STATS
+    wifiStatsRegister(pgWifi);
+  #endif // CONFIG_WIFI_STATS
 }
 
 // -----------------------------------------------------------------------------------------------------------------------
@@ -1025,6 +5982,7 @@ int8_t wifiRSSI()
 
   wifi_ap_record_t info;
   if (!esp_wifi_sta_get_ap_info(&info)) {
+    wifiRssiPut(info.rssi);
     return info.rssi;
   };
 
@@ -1121,4 +6079,65 @@ esp_err_t wifiHostByName(const char* hostname, ip_addr_t* hostaddr)
 }
 */
 
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------- Telemetry -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_WIFI_TELEMETRY
+
+static wifi_telemetry_t _wifiTelemetryPrev;
+static uint8_t _wifiTelemetrySeq = 0;
+static uint8_t _wifiTelemetryFull = 0;
+
+wifi_telemetry_t wifiTelemetryGet()
+{
+  wifi_telemetry_t data;
+  memset(&data, 0, sizeof(wifi_telemetry_t));
+  data.bits = (uint16_t)wifiStatusGet();
+  data.state = (uint8_t)_wifiState;
+  #ifdef CONFIG_WIFI_SSID
+    data.index = 1;
+  #else
+    data.index = _wifiCurrIndex;
+  #endif // CONFIG_WIFI_SSID
+  data.reason = _wifiLastErr;
+  // Only cached values: a snapshot must not add a sample to the moving average and the min / max window
+  if (_wifiState == WIFI_STATE_ONLINE) {
+    data.rssi = _wifiLastRssi;
+    data.online = (uint32_t)((esp_timer_get_time() - _wifiOnlineSince) / 1000000);
+  };
+  data.rssi_avg = (int8_t)(_wifiRssiAvg / 16);
+  data.rssi_min = _wifiRssiMin;
+  data.rssi_max = _wifiRssiMax;
+  data.connects = _wifiConnectTotal;
+  data.disconnects = _wifiDisconnectTotal;
+  data.attempts = _wifiAttemptTotal;
+  data.t_start = _wifiPhaseLast[WIFI_PHASE_START];
+  data.t_connect = _wifiPhaseLast[WIFI_PHASE_CONNECT];
+  data.t_got_ip = _wifiPhaseLast[WIFI_PHASE_GOT_IP];
+  return data;
+}
+
+size_t wifiTelemetrySnapshot(uint8_t* buf, size_t size, bool delta)
+{
+  wifi_telemetry_t data = wifiTelemetryGet();
+  // The first snapshot and every N-th snapshot are always full
+  bool full = !delta || (_wifiTelemetryFull == 0);
+  size_t len = wifiTelemetryEncode(&data, full ? nullptr : &_wifiTelemetryPrev, _wifiTelemetrySeq, buf, size);
+  if (len > 0) {
+    _wifiTelemetryPrev = data;
+    _wifiTelemetrySeq++;
+    if (++_wifiTelemetryFull >= CONFIG_WIFI_TELEMETRY_FULL_INTERVAL) {
+      _wifiTelemetryFull = 0;
+    };
+    // Minimum and maximum of RSSI are calculated between snapshots
+    _wifiRssiMin = _wifiRssiMax = data.rssi_avg;
+  } else {
+    rlog_e(logTAG, "Failed to encode WiFi telemetry: buffer too small");
+  };
+  return len;
+}
+
+#endif // CONFIG_WIFI_TELEMETRY
+
 #endif // CONFIG_WIFI_ENABLED
\ No newline at end of file
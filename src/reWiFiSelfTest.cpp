@@ -0,0 +1,326 @@
+/*
+   EN: On-device TCP throughput self-test against a configurable endpoint
+   RU: Встроенный тест пропускной способности TCP до заданного узла
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#include "reWiFiSelfTest.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#if defined(ESP_PLATFORM)
+  #include "esp_timer.h"
+  #include "freertos/FreeRTOS.h"
+  #include "freertos/task.h"
+  #include "lwip/api.h"
+  #include "lwip/stats.h"
+#else
+  #include <errno.h>
+  #include <time.h>
+  #include <unistd.h>
+  #include <netdb.h>
+  #include <sys/socket.h>
+  #include <sys/time.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+#endif // ESP_PLATFORM
+
+#define SELFTEST_CHUNK 4096
+
+// Payload is never changed, so on ESP-IDF lwIP sends it by reference (NETCONN_NOCOPY) until it is acknowledged.
+// The buffer is in RAM, not in flash: WiFi driver can't read from flash with cache disabled
+static uint8_t _selftestBuf[SELFTEST_CHUNK];
+
+static void selftestFinish(wifi_selftest_result_t* result, int64_t start, int64_t now)
+{
+  result->duration = (uint32_t)((now - start) / 1000);
+  // bit/ms = kbit/s
+  result->goodput = result->duration > 0 ? (uint32_t)(result->bytes * 8 / result->duration) : 0;
+}
+
+#if defined(ESP_PLATFORM)
+
+static int64_t selftestNow()
+{
+  return esp_timer_get_time();
+}
+
+// lwIP counts retransmissions only globally, the test traffic is assumed to dominate
+static int32_t selftestRetransmits()
+{
+  #if LWIP_STATS && TCP_STATS
+    return (int32_t)lwip_stats.tcp.rexmit;
+  #else
+    return -1;
+  #endif // TCP_STATS
+}
+
+static void selftestDirection(const wifi_selftest_config_t* config, bool upload, wifi_selftest_result_t* result)
+{
+  ip_addr_t addr;
+  err_t err = netconn_gethostbyname(config->host, &addr);
+  if (err != ERR_OK) {
+    result->error = err;
+    return;
+  };
+  struct netconn* conn = netconn_new(NETCONN_TCP);
+  if (!conn) {
+    result->error = ERR_MEM;
+    return;
+  };
+
+  int64_t start = selftestNow();
+  err = netconn_connect(conn, &addr, upload ? config->port_upload : config->port_download);
+  if (err == ERR_OK) {
+    result->rtt = (uint32_t)(selftestNow() - start);
+    int32_t rexmit = selftestRetransmits();
+    #if LWIP_SO_RCVTIMEO
+      netconn_set_recvtimeout(conn, 100);
+    #endif // LWIP_SO_RCVTIMEO
+    #if LWIP_SO_SNDTIMEO
+      netconn_set_sendtimeout(conn, 100);
+    #endif // LWIP_SO_SNDTIMEO
+
+    start = selftestNow();
+    int64_t deadline = start + (int64_t)config->duration * 1000000;
+    int64_t now = start;
+    while ((err == ERR_OK) && (now < deadline)) {
+      if (upload) {
+        size_t written = 0;
+        err = netconn_write_partly(conn, _selftestBuf, sizeof(_selftestBuf), NETCONN_NOCOPY, &written);
+        result->bytes += written;
+      } else {
+        // The received data is counted in the pbufs of lwIP, without copying
+        struct netbuf* buf = nullptr;
+        err = netconn_recv(conn, &buf);
+        if (err == ERR_OK) {
+          result->bytes += netbuf_len(buf);
+          netbuf_delete(buf);
+        };
+      };
+      if ((err == ERR_TIMEOUT) || (err == ERR_WOULDBLOCK)) {
+        err = ERR_OK;
+      };
+      now = selftestNow();
+    };
+    selftestFinish(result, start, now);
+    if (rexmit >= 0) {
+      result->retransmits = selftestRetransmits() - rexmit;
+    };
+    netconn_close(conn);
+  };
+  result->error = err;
+  netconn_delete(conn);
+}
+
+#else
+
+static int64_t selftestNow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int32_t selftestRetransmits(int sock)
+{
+  #ifdef TCP_INFO
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+      return (int32_t)info.tcpi_total_retrans;
+    };
+  #endif // TCP_INFO
+  return -1;
+}
+
+static void selftestDirection(const wifi_selftest_config_t* config, bool upload, wifi_selftest_result_t* result)
+{
+  char port[8];
+  snprintf(port, sizeof(port), "%u", upload ? config->port_upload : config->port_download);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* ai = nullptr;
+  if (getaddrinfo(config->host, port, &hints, &ai) != 0) {
+    result->error = EHOSTUNREACH;
+    return;
+  };
+  int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (sock < 0) {
+    result->error = errno;
+    freeaddrinfo(ai);
+    return;
+  };
+
+  int err = 0;
+  int64_t start = selftestNow();
+  if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+    result->rtt = (uint32_t)(selftestNow() - start);
+    int32_t rexmit = selftestRetransmits(sock);
+    struct timeval tv = { 0, 100000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    start = selftestNow();
+    int64_t deadline = start + (int64_t)config->duration * 1000000;
+    int64_t now = start;
+    while ((err == 0) && (now < deadline)) {
+      ssize_t n = upload ? send(sock, _selftestBuf, sizeof(_selftestBuf), MSG_NOSIGNAL)
+                         : recv(sock, _selftestBuf, sizeof(_selftestBuf), 0);
+      if (n > 0) {
+        result->bytes += (uint64_t)n;
+      } else if (n == 0) {
+        // The endpoint closed the connection
+        err = ECONNRESET;
+      } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+        err = errno;
+      };
+      now = selftestNow();
+    };
+    selftestFinish(result, start, now);
+    if (rexmit >= 0) {
+      result->retransmits = selftestRetransmits(sock) - rexmit;
+    };
+  } else {
+    err = errno;
+  };
+  result->error = err;
+  close(sock);
+  freeaddrinfo(ai);
+}
+
+#endif // ESP_PLATFORM
+
+bool wifiSelfTestRun(const wifi_selftest_config_t* config, wifi_selftest_result_t* upload, wifi_selftest_result_t* download)
+{
+  if (!config || !config->host || (config->duration == 0)) return false;
+  if (upload) {
+    memset(upload, 0, sizeof(wifi_selftest_result_t));
+    upload->retransmits = -1;
+  };
+  if (download) {
+    memset(download, 0, sizeof(wifi_selftest_result_t));
+    download->retransmits = -1;
+  };
+
+  bool ok = true;
+  if ((config->directions & WIFI_SELFTEST_UPLOAD) && upload) {
+    selftestDirection(config, true, upload);
+    ok = ok && (upload->error == 0);
+  };
+  if ((config->directions & WIFI_SELFTEST_DOWNLOAD) && download) {
+    selftestDirection(config, false, download);
+    ok = ok && (download->error == 0);
+  };
+  return ok;
+}
+
+static int selftestFormatResult(const char* name, const wifi_selftest_result_t* result, char* buf, size_t size)
+{
+  return snprintf(buf, size, "\"%s\":{\"bytes\":%" PRIu64 ",\"duration\":%" PRIu32 ",\"goodput\":%" PRIu32 ",\"rtt\":%" PRIu32 ",\"retransmits\":%" PRId32 ",\"error\":%" PRId32 "}",
+    name, result->bytes, result->duration, result->goodput, result->rtt, result->retransmits, result->error);
+}
+
+size_t wifiSelfTestFormat(const wifi_selftest_result_t* upload, const wifi_selftest_result_t* download, char* buf, size_t size)
+{
+  if (!buf || (size < 3)) return 0;
+  size_t pos = 0;
+  buf[pos++] = '{';
+  if (upload) {
+    int n = selftestFormatResult("upload", upload, buf + pos, size - pos);
+    if ((n < 0) || ((size_t)n >= size - pos)) return 0;
+    pos += n;
+  };
+  if (download) {
+    if (upload) {
+      if (pos + 1 >= size) return 0;
+      buf[pos++] = ',';
+    };
+    int n = selftestFormatResult("download", download, buf + pos, size - pos);
+    if ((n < 0) || ((size_t)n >= size - pos)) return 0;
+    pos += n;
+  };
+  if (pos + 2 > size) return 0;
+  buf[pos++] = '}';
+  buf[pos] = 0;
+  return pos;
+}
+
+#if defined(ESP_PLATFORM)
+
+#ifndef CONFIG_WIFI_SELFTEST_STACK_SIZE
+  #define CONFIG_WIFI_SELFTEST_STACK_SIZE 3072
+#endif
+#ifndef CONFIG_WIFI_SELFTEST_PRIORITY
+  #define CONFIG_WIFI_SELFTEST_PRIORITY 5
+#endif
+
+typedef enum {
+  SELFTEST_IDLE = 0,
+  SELFTEST_RUNNING,
+  SELFTEST_DONE
+} selftest_state_t;
+
+static volatile selftest_state_t _selftestState = SELFTEST_IDLE;
+static wifi_selftest_config_t _selftestConfig;
+static char _selftestHost[WIFI_SELFTEST_HOST_MAX];
+static wifi_selftest_result_t _selftestUpload;
+static wifi_selftest_result_t _selftestDownload;
+
+static void selftestTask(void* arg)
+{
+  wifiSelfTestRun(&_selftestConfig, &_selftestUpload, &_selftestDownload);
+  _selftestState = SELFTEST_DONE;
+  vTaskDelete(nullptr);
+}
+
+bool wifiSelfTestStart(const wifi_selftest_config_t* config)
+{
+  if (!config || !config->host || (config->duration == 0) || (_selftestState == SELFTEST_RUNNING)) return false;
+  strncpy(_selftestHost, config->host, sizeof(_selftestHost) - 1);
+  _selftestHost[sizeof(_selftestHost) - 1] = 0;
+  _selftestConfig = *config;
+  _selftestConfig.host = _selftestHost;
+  _selftestState = SELFTEST_RUNNING;
+  if (xTaskCreate(selftestTask, "wifi_selftest", CONFIG_WIFI_SELFTEST_STACK_SIZE, nullptr, CONFIG_WIFI_SELFTEST_PRIORITY, nullptr) != pdPASS) {
+    _selftestState = SELFTEST_IDLE;
+    return false;
+  };
+  return true;
+}
+
+bool wifiSelfTestRunning()
+{
+  return _selftestState == SELFTEST_RUNNING;
+}
+
+char* wifiSelfTestGetJson()
+{
+  const size_t size = 384;
+  char* json = (char*)malloc(size);
+  if (!json) return nullptr;
+  char results[320];
+  size_t len = 0;
+  if (_selftestState == SELFTEST_DONE) {
+    len = wifiSelfTestFormat(
+      (_selftestConfig.directions & WIFI_SELFTEST_UPLOAD) ? &_selftestUpload : nullptr,
+      (_selftestConfig.directions & WIFI_SELFTEST_DOWNLOAD) ? &_selftestDownload : nullptr,
+      results, sizeof(results));
+  };
+  if (len > 2) {
+    // {"upload":...} -> {"state":"done","upload":...}
+    snprintf(json, size, "{\"state\":\"done\",%s", results + 1);
+  } else {
+    snprintf(json, size, "{\"state\":\"%s\"}", 
+      _selftestState == SELFTEST_RUNNING ? "running" : (_selftestState == SELFTEST_DONE ? "done" : "idle"));
+  };
+  return json;
+}
+
+#endif // ESP_PLATFORM
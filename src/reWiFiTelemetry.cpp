@@ -0,0 +1,150 @@
+/*
+   EN: Compact binary snapshot of WiFi health: encoder and decoder
+   RU: Компактный двоичный снимок состояния WiFi: кодирование и декодирование
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#include "reWiFiTelemetry.h"
+#include <string.h>
+
+typedef enum {
+  TLM_U8 = 0,
+  TLM_I8,
+  TLM_U16,
+  TLM_VAR
+} tlm_type_t;
+
+typedef struct {
+  uint8_t offset;
+  uint8_t type;
+} tlm_field_t;
+
+#define TLM_FIELD(name, type) { (uint8_t)offsetof(wifi_telemetry_t, name), type }
+
+// Must be in the same order as wifi_telemetry_field_t
+static const tlm_field_t tlmFields[WIFI_TLM_MAX] = {
+  TLM_FIELD(bits, TLM_U16),
+  TLM_FIELD(state, TLM_U8),
+  TLM_FIELD(index, TLM_U8),
+  TLM_FIELD(reason, TLM_U8),
+  TLM_FIELD(rssi, TLM_I8),
+  TLM_FIELD(rssi_avg, TLM_I8),
+  TLM_FIELD(rssi_min, TLM_I8),
+  TLM_FIELD(rssi_max, TLM_I8),
+  TLM_FIELD(connects, TLM_VAR),
+  TLM_FIELD(disconnects, TLM_VAR),
+  TLM_FIELD(attempts, TLM_VAR),
+  TLM_FIELD(online, TLM_VAR),
+  TLM_FIELD(t_start, TLM_U16),
+  TLM_FIELD(t_connect, TLM_U16),
+  TLM_FIELD(t_got_ip, TLM_U16)
+};
+
+static uint32_t tlmGet(const wifi_telemetry_t* data, const tlm_field_t* field)
+{
+  const uint8_t* ptr = (const uint8_t*)data + field->offset;
+  switch (field->type) {
+    case TLM_U8:  return *ptr;
+    case TLM_I8:  return (uint8_t)*(const int8_t*)ptr;
+    case TLM_U16: { uint16_t v; memcpy(&v, ptr, sizeof(v)); return v; }
+    default:      { uint32_t v; memcpy(&v, ptr, sizeof(v)); return v; }
+  };
+}
+
+static void tlmSet(wifi_telemetry_t* data, const tlm_field_t* field, uint32_t value)
+{
+  uint8_t* ptr = (uint8_t*)data + field->offset;
+  switch (field->type) {
+    case TLM_U8:
+    case TLM_I8:  *ptr = (uint8_t)value; break;
+    case TLM_U16: { uint16_t v = (uint16_t)value; memcpy(ptr, &v, sizeof(v)); break; }
+    default:      memcpy(ptr, &value, sizeof(value)); break;
+  };
+}
+
+size_t wifiTelemetryEncode(const wifi_telemetry_t* data, const wifi_telemetry_t* prev, uint8_t seq, uint8_t* buf, size_t size)
+{
+  if (!data || !buf || (size < WIFI_TELEMETRY_HEADER_SIZE)) return 0;
+
+  size_t pos = WIFI_TELEMETRY_HEADER_SIZE;
+  uint16_t mask = 0;
+  for (uint8_t i = 0; i < WIFI_TLM_MAX; i++) {
+    const tlm_field_t* field = &tlmFields[i];
+    uint32_t value = tlmGet(data, field);
+    if (prev && (value == tlmGet(prev, field))) continue;
+    mask |= (uint16_t)(1 << i);
+    switch (field->type) {
+      case TLM_U8:
+      case TLM_I8:
+        if (pos + 1 > size) return 0;
+        buf[pos++] = (uint8_t)value;
+        break;
+      case TLM_U16:
+        if (pos + 2 > size) return 0;
+        buf[pos++] = (uint8_t)value;
+        buf[pos++] = (uint8_t)(value >> 8);
+        break;
+      default:
+        do {
+          if (pos + 1 > size) return 0;
+          buf[pos++] = (uint8_t)((value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+          value >>= 7;
+        } while (value);
+        break;
+    };
+  };
+
+  buf[0] = WIFI_TELEMETRY_VERSION;
+  buf[1] = prev ? WIFI_TELEMETRY_FLAG_DELTA : 0;
+  buf[2] = seq;
+  buf[3] = (uint8_t)mask;
+  buf[4] = (uint8_t)(mask >> 8);
+  return pos;
+}
+
+bool wifiTelemetryDecode(const uint8_t* buf, size_t size, wifi_telemetry_t* data, uint16_t* mask, uint8_t* seq, bool* delta)
+{
+  if (!buf || !data || (size < WIFI_TELEMETRY_HEADER_SIZE) || (buf[0] != WIFI_TELEMETRY_VERSION)) return false;
+
+  uint16_t fields = (uint16_t)(buf[3] | (buf[4] << 8));
+  if (fields >> WIFI_TLM_MAX) return false;
+  bool is_delta = (buf[1] & WIFI_TELEMETRY_FLAG_DELTA) != 0;
+  if (!is_delta) {
+    memset(data, 0, sizeof(wifi_telemetry_t));
+  };
+
+  size_t pos = WIFI_TELEMETRY_HEADER_SIZE;
+  for (uint8_t i = 0; i < WIFI_TLM_MAX; i++) {
+    if ((fields & (1 << i)) == 0) continue;
+    const tlm_field_t* field = &tlmFields[i];
+    uint32_t value = 0;
+    switch (field->type) {
+      case TLM_U8:
+      case TLM_I8:
+        if (pos + 1 > size) return false;
+        value = buf[pos++];
+        break;
+      case TLM_U16:
+        if (pos + 2 > size) return false;
+        value = (uint32_t)(buf[pos] | (buf[pos + 1] << 8));
+        pos += 2;
+        break;
+      default:
+        for (uint8_t shift = 0; ; shift += 7) {
+          if ((pos + 1 > size) || (shift > 28)) return false;
+          uint8_t b = buf[pos++];
+          value |= (uint32_t)(b & 0x7F) << shift;
+          if ((b & 0x80) == 0) break;
+        };
+        break;
+    };
+    tlmSet(data, field, value);
+  };
+
+  if (mask) *mask = fields;
+  if (seq) *seq = buf[2];
+  if (delta) *delta = is_delta;
+  return pos == size;
+}
@@ -0,0 +1,135 @@
+/*
+   EN: Host test of the gateway RTT histogram: sliding window and percentiles
+       g++ -std=gnu++17 -Iinclude -Itest test/test_rtt/test_main.cpp -o test_rtt && ./test_rtt
+   RU: Тест гистограммы времени отклика шлюза на хосте: скользящее окно и процентили
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#include "reWiFiRtt.h"
+#include "wifi_test.h"
+
+#define TEST_WINDOW  240
+#define TEST_TIMEOUT 1000
+
+static uint16_t histSum(const wifi_rtt_hist_t* h)
+{
+  uint16_t sum = 0;
+  for (uint8_t i = 0; i < WIFI_RTT_BUCKETS; i++) {
+    sum += h->hist[i];
+  };
+  return sum;
+}
+
+// Small deterministic generator, so that the run does not depend on the platform
+static uint32_t _testSeed = 12345;
+static uint32_t testRandom()
+{
+  _testSeed = _testSeed * 1103515245 + 12345;
+  return (_testSeed >> 16) & 0x7FFF;
+}
+
+static void test_empty()
+{
+  wifi_rtt_hist_t h;
+  memset(&h, 0, sizeof(h));
+  TEST_CHECK(wifiRttHistPercentile(&h, 50, TEST_TIMEOUT) == 0);
+  TEST_CHECK(wifiRttHistPercentile(&h, 99, TEST_TIMEOUT) == 0);
+  TEST_CHECK(wifiRttHistLoss(&h) == 0);
+}
+
+static void test_buckets()
+{
+  wifi_rtt_hist_t h;
+  memset(&h, 0, sizeof(h));
+  wifiRttHistPut(&h, 0, TEST_WINDOW);
+  wifiRttHistPut(&h, 1, TEST_WINDOW);
+  TEST_CHECK(h.hist[0] == 2);
+  wifiRttHistPut(&h, 9, TEST_WINDOW);
+  TEST_CHECK(h.hist[5] == 1);
+  wifiRttHistPut(&h, 800, TEST_WINDOW);
+  TEST_CHECK(h.hist[14] == 1);
+  // Everything above the last bound goes to the timeout bucket
+  wifiRttHistPut(&h, 801, TEST_WINDOW);
+  wifiRttHistPut(&h, 100000, TEST_WINDOW);
+  TEST_CHECK(h.hist[WIFI_RTT_BUCKETS - 1] == 2);
+  TEST_CHECK(h.count == 6);
+  TEST_CHECK(h.count == histSum(&h));
+}
+
+static void test_percentiles()
+{
+  wifi_rtt_hist_t h;
+  memset(&h, 0, sizeof(h));
+  // 90 replies of 4..5 ms, 10 replies of 21..30 ms
+  for (int i = 0; i < 90; i++) wifiRttHistPut(&h, 5, TEST_WINDOW);
+  for (int i = 0; i < 10; i++) wifiRttHistPut(&h, 25, TEST_WINDOW);
+  uint16_t p50 = wifiRttHistPercentile(&h, 50, TEST_TIMEOUT);
+  uint16_t p95 = wifiRttHistPercentile(&h, 95, TEST_TIMEOUT);
+  uint16_t p99 = wifiRttHistPercentile(&h, 99, TEST_TIMEOUT);
+  TEST_CHECK((p50 > 3) && (p50 <= 5));
+  TEST_CHECK((p95 > 20) && (p95 <= 30));
+  TEST_CHECK((p99 > 20) && (p99 <= 30));
+  TEST_CHECK(p50 <= p95);
+  TEST_CHECK(p95 <= p99);
+}
+
+static void test_loss()
+{
+  wifi_rtt_hist_t h;
+  memset(&h, 0, sizeof(h));
+  for (int i = 0; i < 75; i++) wifiRttHistPut(&h, 3, TEST_WINDOW);
+  for (int i = 0; i < 25; i++) wifiRttHistLost(&h, TEST_WINDOW);
+  TEST_CHECK(wifiRttHistLoss(&h) == 25);
+  // Timeouts are not replies and do not move the percentiles
+  TEST_CHECK(wifiRttHistPercentile(&h, 99, TEST_TIMEOUT) <= 3);
+}
+
+// Steady 2..9 ms replies: through many decays the number of replies stays equal to the sum of the buckets,
+// and p99 never runs past the largest bucket that has been observed (13 ms)
+static void test_decay_steady()
+{
+  wifi_rtt_hist_t h;
+  memset(&h, 0, sizeof(h));
+  uint32_t decays = 0;
+  for (int i = 0; i < 20000; i++) {
+    uint16_t before = h.count;
+    wifiRttHistPut(&h, 2 + testRandom() % 8, TEST_WINDOW);
+    if (h.count < before) decays++;
+    TEST_CHECK(h.count == histSum(&h));
+    TEST_CHECK(h.count + h.lost < TEST_WINDOW);
+    uint16_t p99 = wifiRttHistPercentile(&h, 99, TEST_TIMEOUT);
+    TEST_CHECK_MSG(p99 <= 13, "p99 is beyond the observed buckets");
+    TEST_CHECK(wifiRttHistPercentile(&h, 50, TEST_TIMEOUT) >= 1);
+  };
+  TEST_CHECK(decays > 10);
+}
+
+// The same with timeouts mixed in: the loss share stays near the real one
+static void test_decay_lossy()
+{
+  wifi_rtt_hist_t h;
+  memset(&h, 0, sizeof(h));
+  for (int i = 0; i < 20000; i++) {
+    if (testRandom() % 10 == 0) {
+      wifiRttHistLost(&h, TEST_WINDOW);
+    } else {
+      wifiRttHistPut(&h, 2 + testRandom() % 8, TEST_WINDOW);
+    };
+    TEST_CHECK(h.count == histSum(&h));
+    TEST_CHECK(wifiRttHistPercentile(&h, 99, TEST_TIMEOUT) <= 13);
+  };
+  TEST_CHECK(wifiRttHistLoss(&h) <= 25);
+}
+
+int main()
+{
+  TEST_RUN(test_empty);
+  TEST_RUN(test_buckets);
+  TEST_RUN(test_percentiles);
+  TEST_RUN(test_loss);
+  TEST_RUN(test_decay_steady);
+  TEST_RUN(test_decay_lossy);
+  return TEST_RESULT();
+}
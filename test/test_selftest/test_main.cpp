@@ -0,0 +1,154 @@
+/*
+   EN: Host test of the TCP throughput self-test against a loopback sink and source in the same process
+       g++ -std=gnu++17 -pthread -Iinclude -Itest test/test_selftest/test_main.cpp src/reWiFiSelfTest.cpp -o test_selftest && ./test_selftest
+   RU: Тест проверки пропускной способности TCP на хосте через loopback с приёмником и источником в том же процессе
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#include "reWiFiSelfTest.h"
+#include "wifi_test.h"
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TEST_DURATION 1   // s
+
+// Listening socket on 127.0.0.1 with a port chosen by the system
+static int listenLoopback(uint16_t* port)
+{
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) return -1;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t len = sizeof(addr);
+  if ((bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) || (listen(sock, 1) != 0)
+   || (getsockname(sock, (struct sockaddr*)&addr, &len) != 0)) {
+    close(sock);
+    return -1;
+  };
+  *port = ntohs(addr.sin_port);
+  return sock;
+}
+
+// Accepts one connection and discards everything until it is closed (nc -l > /dev/null)
+static void sinkExec(int sock)
+{
+  int conn = accept(sock, nullptr, nullptr);
+  if (conn >= 0) {
+    static uint8_t buf[4096];
+    while (recv(conn, buf, sizeof(buf), 0) > 0) {};
+    close(conn);
+  };
+  close(sock);
+}
+
+// Accepts one connection and sends data until it is closed (nc -l < /dev/zero)
+static void sourceExec(int sock)
+{
+  int conn = accept(sock, nullptr, nullptr);
+  if (conn >= 0) {
+    static uint8_t buf[4096];
+    while (send(conn, buf, sizeof(buf), MSG_NOSIGNAL) > 0) {};
+    close(conn);
+  };
+  close(sock);
+}
+
+static void checkResult(const wifi_selftest_result_t* result)
+{
+  TEST_CHECK(result->error == 0);
+  TEST_CHECK(result->bytes > 0);
+  TEST_CHECK(result->duration >= TEST_DURATION * 1000);
+  TEST_CHECK(result->duration < TEST_DURATION * 1000 + 500);
+  TEST_CHECK(result->goodput > 0);
+}
+
+static void test_upload()
+{
+  uint16_t port = 0;
+  int sock = listenLoopback(&port);
+  TEST_CHECK(sock >= 0);
+  std::thread sink(sinkExec, sock);
+
+  wifi_selftest_config_t config = { "127.0.0.1", port, 0, TEST_DURATION, WIFI_SELFTEST_UPLOAD };
+  wifi_selftest_result_t upload, download;
+  bool ok = wifiSelfTestRun(&config, &upload, &download);
+  sink.join();
+  TEST_CHECK(ok);
+  checkResult(&upload);
+  // The skipped direction is zeroed
+  TEST_CHECK(download.bytes == 0);
+  TEST_CHECK(download.error == 0);
+}
+
+static void test_download()
+{
+  uint16_t port = 0;
+  int sock = listenLoopback(&port);
+  TEST_CHECK(sock >= 0);
+  std::thread source(sourceExec, sock);
+
+  wifi_selftest_config_t config = { "127.0.0.1", 0, port, TEST_DURATION, WIFI_SELFTEST_DOWNLOAD };
+  wifi_selftest_result_t download;
+  bool ok = wifiSelfTestRun(&config, nullptr, &download);
+  source.join();
+  TEST_CHECK(ok);
+  checkResult(&download);
+}
+
+static void test_refused()
+{
+  // The port is released before the test, so nothing is listening on it
+  uint16_t port = 0;
+  int sock = listenLoopback(&port);
+  TEST_CHECK(sock >= 0);
+  close(sock);
+
+  wifi_selftest_config_t config = { "127.0.0.1", port, 0, TEST_DURATION, WIFI_SELFTEST_UPLOAD };
+  wifi_selftest_result_t upload;
+  TEST_CHECK(!wifiSelfTestRun(&config, &upload, nullptr));
+  TEST_CHECK(upload.error != 0);
+  TEST_CHECK(upload.bytes == 0);
+}
+
+static void test_format()
+{
+  wifi_selftest_result_t upload, download;
+  memset(&upload, 0, sizeof(upload));
+  memset(&download, 0, sizeof(download));
+  upload.bytes = 1000000;
+  upload.duration = 1000;
+  upload.goodput = 8000;
+  upload.retransmits = -1;
+  download.error = 111;
+
+  char buf[512];
+  size_t len = wifiSelfTestFormat(&upload, &download, buf, sizeof(buf));
+  TEST_CHECK(len > 0);
+  TEST_CHECK(len == strlen(buf));
+  TEST_CHECK(strstr(buf, "\"upload\":{\"bytes\":1000000,\"duration\":1000,\"goodput\":8000,") != nullptr);
+  TEST_CHECK(strstr(buf, "\"retransmits\":-1") != nullptr);
+  TEST_CHECK(strstr(buf, "\"error\":111}}") != nullptr);
+  // Too small buffer: nothing is returned
+  TEST_CHECK(wifiSelfTestFormat(&upload, &download, buf, len) == 0);
+  TEST_CHECK(wifiSelfTestFormat(&upload, nullptr, buf, 16) == 0);
+  TEST_CHECK(wifiSelfTestFormat(&upload, &download, buf, 2) == 0);
+  // Exactly enough space for the terminating zero
+  TEST_CHECK(wifiSelfTestFormat(&upload, &download, buf, len + 1) == len);
+}
+
+int main()
+{
+  TEST_RUN(test_upload);
+  TEST_RUN(test_download);
+  TEST_RUN(test_refused);
+  TEST_RUN(test_format);
+  return TEST_RESULT();
+}
@@ -0,0 +1,218 @@
+/*
+   EN: Host test of the connection state machine transition table
+       g++ -std=gnu++17 -Iinclude -Itest test/test_states/test_main.cpp -o test_states && ./test_states
+   RU: Тест таблицы переходов конечного автомата подключения на хосте
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#include "reWiFiStates.h"
+#include "wifi_test.h"
+
+typedef struct {
+  wifi_fsm_event_t  event;
+  wifi_fsm_action_t action;
+  wifi_fsm_state_t  next;
+} fsm_step_t;
+
+static wifi_fsm_state_t fsmRun(wifi_fsm_state_t state, const fsm_step_t* steps, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    wifi_fsm_transition_t t = wifiFsmTransition(state, steps[i].event);
+    if ((t.action != steps[i].action) || (t.next != steps[i].next)) {
+      printf("  step %d: %s + %s -> %s (%s), expected %s (%s)\n", (int)i,
+        wifiFsmStateName(state), wifiFsmEventName(steps[i].event),
+        wifiFsmStateName((wifi_fsm_state_t)t.next), wifiFsmActionName((wifi_fsm_action_t)t.action),
+        wifiFsmStateName(steps[i].next), wifiFsmActionName(steps[i].action));
+      return WIFI_STATE_MAX;
+    };
+    state = (wifi_fsm_state_t)t.next;
+  };
+  return state;
+}
+
+// All cells contain valid actions and states
+static void test_table_ranges()
+{
+  for (int s = 0; s < WIFI_STATE_MAX; s++) {
+    for (int e = 0; e < WIFI_FSM_EV_MAX; e++) {
+      wifi_fsm_transition_t t = wifiFsmTransition((wifi_fsm_state_t)s, (wifi_fsm_event_t)e);
+      TEST_CHECK(t.action < WIFI_FSM_ACT_MAX);
+      TEST_CHECK(t.next < WIFI_STATE_MAX);
+    };
+  };
+  wifi_fsm_transition_t t = wifiFsmTransition(WIFI_STATE_MAX, WIFI_FSM_EV_START);
+  TEST_CHECK(t.action == WIFI_FSM_ACT_NONE);
+  t = wifiFsmTransition(WIFI_STATE_IDLE, WIFI_FSM_EV_MAX);
+  TEST_CHECK(t.action == WIFI_FSM_ACT_NONE);
+  TEST_CHECK(t.next == WIFI_STATE_IDLE);
+}
+
+// Without the driver nothing can be done, the only way out is initialization
+static void test_off_accepts_only_init()
+{
+  for (int e = 0; e < WIFI_FSM_EV_MAX; e++) {
+    wifi_fsm_transition_t t = wifiFsmTransition(WIFI_STATE_OFF, (wifi_fsm_event_t)e);
+    TEST_CHECK(t.action == WIFI_FSM_ACT_NONE);
+    TEST_CHECK(t.next == ((e == WIFI_FSM_EV_INIT) ? WIFI_STATE_IDLE : WIFI_STATE_OFF));
+  };
+}
+
+// Every state can be reached from OFF
+static void test_all_states_reachable()
+{
+  bool reached[WIFI_STATE_MAX] = { false };
+  reached[WIFI_STATE_OFF] = true;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int s = 0; s < WIFI_STATE_MAX; s++) {
+      if (!reached[s]) continue;
+      for (int e = 0; e < WIFI_FSM_EV_MAX; e++) {
+        uint8_t next = wifiFsmTransition((wifi_fsm_state_t)s, (wifi_fsm_event_t)e).next;
+        if (!reached[next]) {
+          reached[next] = true;
+          changed = true;
+        };
+      };
+    };
+  };
+  for (int s = 0; s < WIFI_STATE_MAX; s++) {
+    TEST_CHECK_MSG(reached[s], wifiFsmStateName((wifi_fsm_state_t)s));
+  };
+}
+
+// The driver can be released from any state: STOP, then the events the driver sends while stopping
+static void test_stop_reaches_idle()
+{
+  const wifi_fsm_event_t drain[] = { WIFI_FSM_EV_STOP, WIFI_FSM_EV_DISCONNECTED, WIFI_FSM_EV_STA_STOP };
+  for (int s = WIFI_STATE_IDLE; s < WIFI_STATE_MAX; s++) {
+    wifi_fsm_state_t state = (wifi_fsm_state_t)s;
+    for (size_t i = 0; i < sizeof(drain) / sizeof(drain[0]); i++) {
+      state = (wifi_fsm_state_t)wifiFsmTransition(state, drain[i]).next;
+    };
+    TEST_CHECK_MSG((state == WIFI_STATE_IDLE) || (state == WIFI_STATE_SUSPENDED), wifiFsmStateName((wifi_fsm_state_t)s));
+  };
+}
+
+static void test_connect_and_stop()
+{
+  const fsm_step_t steps[] = {
+    { WIFI_FSM_EV_INIT,         WIFI_FSM_ACT_NONE,      WIFI_STATE_IDLE },
+    { WIFI_FSM_EV_START,        WIFI_FSM_ACT_START_STA, WIFI_STATE_STARTING },
+    { WIFI_FSM_EV_STA_START,    WIFI_FSM_ACT_CONNECT,   WIFI_STATE_CONNECTING },
+    { WIFI_FSM_EV_CONNECTED,    WIFI_FSM_ACT_NONE,      WIFI_STATE_CONNECTED },
+    { WIFI_FSM_EV_GOT_IP,       WIFI_FSM_ACT_NONE,      WIFI_STATE_ONLINE },
+    { WIFI_FSM_EV_STOP,         WIFI_FSM_ACT_DISCONNECT, WIFI_STATE_DISCONNECTING },
+    { WIFI_FSM_EV_DISCONNECTED, WIFI_FSM_ACT_STOP_STA,  WIFI_STATE_STOPPING },
+    { WIFI_FSM_EV_STA_STOP,     WIFI_FSM_ACT_RELEASE,   WIFI_STATE_IDLE },
+    { WIFI_FSM_EV_DEINIT,       WIFI_FSM_ACT_NONE,      WIFI_STATE_OFF },
+  };
+  TEST_CHECK(fsmRun(WIFI_STATE_OFF, steps, sizeof(steps) / sizeof(steps[0])) == WIFI_STATE_OFF);
+}
+
+static void test_reconnect()
+{
+  const fsm_step_t steps[] = {
+    { WIFI_FSM_EV_DISCONNECTED, WIFI_FSM_ACT_RECONNECT, WIFI_STATE_CONNECTING },
+    { WIFI_FSM_EV_TIMEOUT,      WIFI_FSM_ACT_RECONNECT, WIFI_STATE_CONNECTING },
+    { WIFI_FSM_EV_CONNECTED,    WIFI_FSM_ACT_NONE,      WIFI_STATE_CONNECTED },
+    { WIFI_FSM_EV_TIMEOUT,      WIFI_FSM_ACT_RECONNECT, WIFI_STATE_CONNECTING },
+    { WIFI_FSM_EV_CONNECTED,    WIFI_FSM_ACT_NONE,      WIFI_STATE_CONNECTED },
+    { WIFI_FSM_EV_GOT_IP,       WIFI_FSM_ACT_NONE,      WIFI_STATE_ONLINE },
+    { WIFI_FSM_EV_LOST_IP,      WIFI_FSM_ACT_RECONNECT, WIFI_STATE_CONNECTING },
+  };
+  TEST_CHECK(fsmRun(WIFI_STATE_ONLINE, steps, sizeof(steps) / sizeof(steps[0])) == WIFI_STATE_CONNECTING);
+}
+
+static void test_restart()
+{
+  // Connected: disconnect, restore and reconnect
+  const fsm_step_t online[] = {
+    { WIFI_FSM_EV_RESTART,      WIFI_FSM_ACT_DISCONNECT, WIFI_STATE_RESTORING },
+    { WIFI_FSM_EV_DISCONNECTED, WIFI_FSM_ACT_RESTORE,   WIFI_STATE_CONNECTING },
+  };
+  TEST_CHECK(fsmRun(WIFI_STATE_ONLINE, online, sizeof(online) / sizeof(online[0])) == WIFI_STATE_CONNECTING);
+  // Not connected: stop STA and start it again
+  const fsm_step_t connecting[] = {
+    { WIFI_FSM_EV_RESTART,      WIFI_FSM_ACT_STOP_STA,  WIFI_STATE_RESTARTING },
+    { WIFI_FSM_EV_STA_STOP,     WIFI_FSM_ACT_RESTART_STA, WIFI_STATE_STARTING },
+    { WIFI_FSM_EV_STA_START,    WIFI_FSM_ACT_CONNECT,   WIFI_STATE_CONNECTING },
+  };
+  TEST_CHECK(fsmRun(WIFI_STATE_CONNECTING, connecting, sizeof(connecting) / sizeof(connecting[0])) == WIFI_STATE_CONNECTING);
+}
+
+// wifiStart() while STA is being stopped: STA is started again after it has stopped
+static void test_start_while_stopping()
+{
+  const fsm_step_t steps[] = {
+    { WIFI_FSM_EV_STOP,         WIFI_FSM_ACT_STOP_STA,  WIFI_STATE_STOPPING },
+    { WIFI_FSM_EV_START,        WIFI_FSM_ACT_NONE,      WIFI_STATE_RESTARTING },
+    { WIFI_FSM_EV_STA_STOP,     WIFI_FSM_ACT_RESTART_STA, WIFI_STATE_STARTING },
+  };
+  TEST_CHECK(fsmRun(WIFI_STATE_CONNECTING, steps, sizeof(steps) / sizeof(steps[0])) == WIFI_STATE_STARTING);
+}
+
+static void test_suspend_resume()
+{
+  const fsm_step_t steps[] = {
+    { WIFI_FSM_EV_STOP,         WIFI_FSM_ACT_STOP_STA,  WIFI_STATE_STOPPING },
+    { WIFI_FSM_EV_STA_STOP,     WIFI_FSM_ACT_RELEASE,   WIFI_STATE_IDLE },
+    { WIFI_FSM_EV_SUSPENDED,    WIFI_FSM_ACT_NONE,      WIFI_STATE_SUSPENDED },
+    { WIFI_FSM_EV_STA_START,    WIFI_FSM_ACT_NONE,      WIFI_STATE_SUSPENDED },
+    { WIFI_FSM_EV_START,        WIFI_FSM_ACT_START_STA, WIFI_STATE_STARTING },
+  };
+  TEST_CHECK(fsmRun(WIFI_STATE_CONNECTING, steps, sizeof(steps) / sizeof(steps[0])) == WIFI_STATE_STARTING);
+}
+
+// Status bits: IP address only when online, "enabled" is cleared as soon as the stop is requested
+static void test_state_bits()
+{
+  for (int s = 0; s < WIFI_STATE_MAX; s++) {
+    uint16_t bits = wifiFsmStateBits((wifi_fsm_state_t)s);
+    TEST_CHECK((bits & ~WIFI_FSM_BITS) == 0);
+    TEST_CHECK(((bits & WIFI_FSM_BIT_GOT_IP) != 0) == (s == WIFI_STATE_ONLINE));
+    TEST_CHECK(((bits & WIFI_FSM_BIT_SUSPENDED) != 0) == (s == WIFI_STATE_SUSPENDED));
+    if (bits & WIFI_FSM_BIT_GOT_IP) {
+      TEST_CHECK((bits & WIFI_FSM_BIT_CONNECTED) != 0);
+    };
+    if (bits & WIFI_FSM_BIT_CONNECTED) {
+      TEST_CHECK((bits & WIFI_FSM_BIT_STARTED) != 0);
+    };
+  };
+  TEST_CHECK((wifiFsmStateBits(WIFI_STATE_DISCONNECTING) & WIFI_FSM_BIT_ENABLED) == 0);
+  TEST_CHECK((wifiFsmStateBits(WIFI_STATE_STOPPING) & WIFI_FSM_BIT_ENABLED) == 0);
+  TEST_CHECK(wifiFsmStateBits(WIFI_STATE_MAX) == 0);
+}
+
+static void test_names()
+{
+  for (int s = 0; s < WIFI_STATE_MAX; s++) {
+    TEST_CHECK(wifiFsmStateName((wifi_fsm_state_t)s) != nullptr);
+    TEST_CHECK(strcmp(wifiFsmStateName((wifi_fsm_state_t)s), "?") != 0);
+  };
+  for (int e = 0; e < WIFI_FSM_EV_MAX; e++) {
+    TEST_CHECK(strcmp(wifiFsmEventName((wifi_fsm_event_t)e), "?") != 0);
+  };
+  for (int a = 0; a < WIFI_FSM_ACT_MAX; a++) {
+    TEST_CHECK(strcmp(wifiFsmActionName((wifi_fsm_action_t)a), "?") != 0);
+  };
+  TEST_CHECK(strcmp("?", wifiFsmStateName(WIFI_STATE_MAX)) == 0);
+}
+
+int main()
+{
+  TEST_RUN(test_table_ranges);
+  TEST_RUN(test_off_accepts_only_init);
+  TEST_RUN(test_all_states_reachable);
+  TEST_RUN(test_stop_reaches_idle);
+  TEST_RUN(test_connect_and_stop);
+  TEST_RUN(test_reconnect);
+  TEST_RUN(test_restart);
+  TEST_RUN(test_start_while_stopping);
+  TEST_RUN(test_suspend_resume);
+  TEST_RUN(test_state_bits);
+  TEST_RUN(test_names);
+  return TEST_RESULT();
+}
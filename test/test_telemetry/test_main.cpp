@@ -0,0 +1,146 @@
+/*
+   EN: Host test of the binary telemetry snapshot: encoding and decoding
+       g++ -std=gnu++17 -Iinclude -Itest test/test_telemetry/test_main.cpp src/reWiFiTelemetry.cpp -o test_telemetry && ./test_telemetry
+   RU: Тест двоичного снимка телеметрии на хосте: кодирование и декодирование
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#include "reWiFiTelemetry.h"
+#include "wifi_test.h"
+
+static wifi_telemetry_t sample()
+{
+  wifi_telemetry_t data;
+  memset(&data, 0, sizeof(data));
+  data.bits = 0x01A7;
+  data.state = 6;
+  data.index = 2;
+  data.reason = 201;
+  data.rssi = -67;
+  data.rssi_avg = -70;
+  data.rssi_min = -88;
+  data.rssi_max = -55;
+  data.connects = 12;
+  data.disconnects = 300;
+  data.attempts = 0x12345678;
+  data.online = 86400 * 45;
+  data.t_start = 120;
+  data.t_connect = 2500;
+  data.t_got_ip = 65535;
+  return data;
+}
+
+static void test_full_roundtrip()
+{
+  wifi_telemetry_t data = sample();
+  uint8_t buf[WIFI_TELEMETRY_MAX_SIZE];
+  size_t len = wifiTelemetryEncode(&data, nullptr, 7, buf, sizeof(buf));
+  TEST_CHECK(len > WIFI_TELEMETRY_HEADER_SIZE);
+  TEST_CHECK(buf[0] == WIFI_TELEMETRY_VERSION);
+
+  wifi_telemetry_t decoded;
+  memset(&decoded, 0xFF, sizeof(decoded));
+  uint16_t mask = 0;
+  uint8_t seq = 0;
+  bool delta = true;
+  TEST_CHECK(wifiTelemetryDecode(buf, len, &decoded, &mask, &seq, &delta));
+  TEST_CHECK(!delta);
+  TEST_CHECK(seq == 7);
+  TEST_CHECK(mask == (1 << WIFI_TLM_MAX) - 1);
+  TEST_CHECK(memcmp(&decoded, &data, sizeof(data)) == 0);
+}
+
+// A zeroed structure is still a full snapshot: every field is present
+static void test_full_zero()
+{
+  wifi_telemetry_t data;
+  memset(&data, 0, sizeof(data));
+  uint8_t buf[WIFI_TELEMETRY_MAX_SIZE];
+  size_t len = wifiTelemetryEncode(&data, nullptr, 0, buf, sizeof(buf));
+  // One byte per field, two for each of the four U16 fields
+  TEST_CHECK(len == WIFI_TELEMETRY_HEADER_SIZE + WIFI_TLM_MAX + 4);
+
+  wifi_telemetry_t decoded = sample();
+  uint16_t mask = 0;
+  TEST_CHECK(wifiTelemetryDecode(buf, len, &decoded, &mask, nullptr, nullptr));
+  TEST_CHECK(mask == (1 << WIFI_TLM_MAX) - 1);
+  TEST_CHECK(memcmp(&decoded, &data, sizeof(data)) == 0);
+}
+
+static void test_delta_roundtrip()
+{
+  wifi_telemetry_t prev = sample();
+  wifi_telemetry_t data = prev;
+  data.rssi = -71;
+  data.online += 60;
+
+  uint8_t buf[WIFI_TELEMETRY_MAX_SIZE];
+  size_t len = wifiTelemetryEncode(&data, &prev, 8, buf, sizeof(buf));
+  TEST_CHECK(len > WIFI_TELEMETRY_HEADER_SIZE);
+  TEST_CHECK((buf[1] & WIFI_TELEMETRY_FLAG_DELTA) != 0);
+
+  // The receiver applies the delta to its copy of the previous snapshot
+  wifi_telemetry_t decoded = prev;
+  uint16_t mask = 0;
+  uint8_t seq = 0;
+  bool delta = false;
+  TEST_CHECK(wifiTelemetryDecode(buf, len, &decoded, &mask, &seq, &delta));
+  TEST_CHECK(delta);
+  TEST_CHECK(seq == 8);
+  TEST_CHECK(mask == ((1 << WIFI_TLM_RSSI) | (1 << WIFI_TLM_ONLINE)));
+  TEST_CHECK(memcmp(&decoded, &data, sizeof(data)) == 0);
+}
+
+static void test_delta_unchanged()
+{
+  wifi_telemetry_t data = sample();
+  uint8_t buf[WIFI_TELEMETRY_MAX_SIZE];
+  size_t len = wifiTelemetryEncode(&data, &data, 9, buf, sizeof(buf));
+  TEST_CHECK(len == WIFI_TELEMETRY_HEADER_SIZE);
+
+  wifi_telemetry_t decoded = data;
+  uint16_t mask = 0xFFFF;
+  TEST_CHECK(wifiTelemetryDecode(buf, len, &decoded, &mask, nullptr, nullptr));
+  TEST_CHECK(mask == 0);
+  TEST_CHECK(memcmp(&decoded, &data, sizeof(data)) == 0);
+}
+
+static void test_buffer_too_small()
+{
+  wifi_telemetry_t data = sample();
+  uint8_t buf[WIFI_TELEMETRY_MAX_SIZE];
+  size_t len = wifiTelemetryEncode(&data, nullptr, 0, buf, sizeof(buf));
+  TEST_CHECK(len > 0);
+  TEST_CHECK(wifiTelemetryEncode(&data, nullptr, 0, buf, len - 1) == 0);
+  TEST_CHECK(wifiTelemetryEncode(&data, nullptr, 0, buf, WIFI_TELEMETRY_HEADER_SIZE - 1) == 0);
+}
+
+// Truncated, unknown version or fields beyond the end must be rejected
+static void test_invalid()
+{
+  wifi_telemetry_t data = sample();
+  uint8_t buf[WIFI_TELEMETRY_MAX_SIZE];
+  size_t len = wifiTelemetryEncode(&data, nullptr, 0, buf, sizeof(buf));
+  wifi_telemetry_t decoded;
+  for (size_t i = 0; i < len; i++) {
+    TEST_CHECK_MSG(!wifiTelemetryDecode(buf, i, &decoded, nullptr, nullptr, nullptr), "truncated");
+  };
+  buf[0] = WIFI_TELEMETRY_VERSION + 1;
+  TEST_CHECK(!wifiTelemetryDecode(buf, len, &decoded, nullptr, nullptr, nullptr));
+  buf[0] = WIFI_TELEMETRY_VERSION;
+  buf[4] |= 0x80;
+  TEST_CHECK(!wifiTelemetryDecode(buf, len, &decoded, nullptr, nullptr, nullptr));
+}
+
+int main()
+{
+  TEST_RUN(test_full_roundtrip);
+  TEST_RUN(test_full_zero);
+  TEST_RUN(test_delta_roundtrip);
+  TEST_RUN(test_delta_unchanged);
+  TEST_RUN(test_buffer_too_small);
+  TEST_RUN(test_invalid);
+  return TEST_RESULT();
+}
@@ -0,0 +1,47 @@
+/*
+   EN: Minimal assertions for host tests of the modules that do not depend on ESP-IDF
+   RU: Минимальные проверки для тестов на хосте модулей, не зависящих от ESP-IDF
+   --------------------------
+   (с) 2020-2024 Разживин Александр | Razzhivin Alexander
+   kotyara12@yandex.ru | https://kotyara12.ru | tg: @kotyara1971
+*/
+
+#ifndef __RE_WIFI_TEST_H__
+#define __RE_WIFI_TEST_H__
+
+#include <stdio.h>
+#include <string.h>
+
+static int _testFailed = 0;
+static int _testCount = 0;
+static bool _testOk = true;
+
+// Stops the current test on the first failed check
+#define TEST_CHECK(cond) do {                                                  \
+  if (!(cond)) {                                                               \
+    printf("  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);          \
+    _testOk = false;                                                           \
+    return;                                                                    \
+  };                                                                           \
+} while (0)
+
+#define TEST_CHECK_MSG(cond, msg) do {                                         \
+  if (!(cond)) {                                                               \
+    printf("  %s:%d: check failed: %s [%s]\n", __FILE__, __LINE__, #cond, msg); \
+    _testOk = false;                                                           \
+    return;                                                                    \
+  };                                                                           \
+} while (0)
+
+#define TEST_RUN(test) do {                                                    \
+  _testOk = true;                                                              \
+  _testCount++;                                                                \
+  test();                                                                      \
+  if (!_testOk) _testFailed++;                                                 \
+  printf("%s %s\n", _testOk ? "PASS" : "FAIL", #test);                         \
+} while (0)
+
+// Returns the exit code of the test program
+#define TEST_RESULT() (printf("%d tests, %d failed\n", _testCount, _testFailed), _testFailed > 0 ? 1 : 0)
+
+#endif // __RE_WIFI_TEST_H__